@@ -0,0 +1,285 @@
+// Replays keystroke scripts through libmio's mioProcessKey() against a
+// fake terminal and reports per-keystroke latency, open and save time,
+// frame bytes and peak RSS for a few synthetic corpora
+// Prints one JSON object per corpus so runs can be tracked over time
+//
+// make bench
+
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../mio.h"
+
+// From syntax.h, compiled into the library
+extern char *CSS_HL_keywords[];
+
+#define SCREEN_ROWS 24
+#define SCREEN_COLS 80
+
+double benchNow() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A keystroke script step: a key pressed count times
+// Keys starting with ESC are one escape sequence, anything else is
+// typed a char at a time
+struct benchStep {
+	const char *keys;
+	int count;
+};
+
+#define KEY_UP "\x1b[A"
+#define KEY_DOWN "\x1b[B"
+#define KEY_RIGHT "\x1b[C"
+#define KEY_LEFT "\x1b[D"
+#define KEY_HOME "\x1b[H"
+#define KEY_END "\x1b[F"
+#define KEY_PAGE_DOWN "\x1b[6~"
+#define KEY_PAGE_UP "\x1b[5~"
+#define KEY_BACKSPACE "\x7f"
+#define KEY_ENTER "\r"
+#define KEY_CTRL(k) ((const char[]){ (k) & 0x1f, '\0' })
+
+// Moving, typing, deleting, undoing and scrolling, as in normal editing
+struct benchStep editingScript[] = {
+	{ KEY_DOWN, 200 }, { KEY_END, 1 }, { "hello, world", 1 }, { KEY_BACKSPACE, 12 },
+	{ KEY_PAGE_DOWN, 20 }, { KEY_HOME, 1 }, { "int x = 42;", 1 }, { KEY_ENTER, 5 },
+	{ KEY_CTRL('z'), 10 }, { KEY_CTRL('y'), 5 }, { KEY_PAGE_UP, 10 }, { KEY_UP, 100 },
+	{ KEY_CTRL('d'), 5 }, { KEY_RIGHT, 40 }, { "typing in the middle", 1 }, { NULL, 0 }
+};
+
+// Opening and closing a comment near the top re-highlights everything
+// below it up to the next close
+struct benchStep commentScript[] = {
+	{ KEY_PAGE_UP, 50 }, { KEY_DOWN, 11 }, { KEY_HOME, 1 }, { "/*", 1 }, { KEY_BACKSPACE, 2 },
+	{ "/*", 1 }, { KEY_BACKSPACE, 2 }, { KEY_DOWN, 50 }, { "x", 20 }, { KEY_BACKSPACE, 20 }, { NULL, 0 }
+};
+
+// Moving and typing inside a single huge line
+struct benchStep longLineScript[] = {
+	{ KEY_RIGHT, 200 }, { "var y=1;", 1 }, { KEY_BACKSPACE, 8 }, { KEY_END, 1 },
+	{ "x", 20 }, { KEY_HOME, 1 }, { NULL, 0 }
+};
+
+struct benchCorpus {
+	const char *name;
+	const char *file; // the extension picks the highlighting
+	void (*generate)(FILE *fp);
+	struct benchStep *scripts[3];
+};
+
+void generateLog(FILE *fp) {
+	static const char *levels[] = { "INFO ", "DEBUG", "WARN ", "ERROR" };
+	srand(42);
+	for (int i = 0; i < 1000000; i++) {
+		fprintf(fp, "2024-01-%02dT%02d:%02d:%02d.%03dZ %s request %d served in %dms from 10.0.%d.%d\n",
+			i % 28 + 1, i % 24, i % 60, (i / 60) % 60, rand() % 1000, levels[rand() % 4], rand(), rand() % 500, rand() % 256, rand() % 256);
+	}
+}
+
+void generateMinified(FILE *fp) {
+	for (int i = 0; i < 100000; i++) {
+		fprintf(fp, "var a%d=\"s%d\";function f%d(x){return x*%d+0.5}if(a%d){f%d(%d)}else{a%d=null};", i, i, i, i % 97, i, i, i, i);
+	}
+	fputc('\n', fp);
+}
+
+void generateCommentedC(FILE *fp) {
+	for (int i = 0; i < 200000; i++) {
+		if (i % 50 == 0) {
+			fprintf(fp, "/*\n * Block %d explains the next few functions\n", i);
+		} else if (i % 50 == 10) {
+			fprintf(fp, " */\n");
+		} else if (i % 50 < 10) {
+			fprintf(fp, " * int f%d(char *s) { return s[%d] == '\\n'; } // not code\n", i, i % 10);
+		} else {
+			fprintf(fp, "int f%d(char *s) { return strlen(s) > %d ? s[%d] : 0; } // %d\n", i, i % 80, i % 10, i);
+		}
+	}
+}
+
+void generateCss(FILE *fp) {
+	int keywords = 0;
+	while (CSS_HL_keywords[keywords]) {
+		keywords++;
+	}
+	for (int i = 0; i < 20000; i++) {
+		fprintf(fp, ".rule-%d {\n", i);
+		for (int j = 0; j < 8; j++) {
+			fprintf(fp, "    %s %dpx solid #%06x;\n", CSS_HL_keywords[(i * 8 + j) % keywords], j, i * 2654435761u & 0xffffff);
+		}
+		fprintf(fp, "}\n");
+	}
+}
+
+struct benchCorpus corpora[] = {
+	{ "huge_log", "huge.log", generateLog, { editingScript, NULL } },
+	{ "minified_js", "minified.js", generateMinified, { longLineScript, NULL } },
+	{ "commented_c", "commented.c", generateCommentedC, { editingScript, commentScript, NULL } },
+	{ "css_keywords", "keywords.css", generateCss, { editingScript, NULL } },
+};
+
+struct mio *ed;
+int inputWrite;
+int outputRead;
+long frameBytes;
+
+// Reads whatever frames the editor has written, as a terminal would
+void benchDrainFrames() {
+	char buf[65536];
+	while (1) {
+		ssize_t n;
+		while ((n = read(outputRead, buf, sizeof(buf))) > 0) {
+			frameBytes += n;
+		}
+		if (!mioFlush(ed)) {
+			break;
+		}
+	}
+}
+
+// Stands in for the terminal: keys come from one pipe, frames go to another
+void benchFakeTerminal() {
+	int input[2];
+	int output[2];
+	if (pipe(input) == -1 || pipe(output) == -1) {
+		perror("pipe");
+		exit(1);
+	}
+	fcntl(input[0], F_SETFL, O_NONBLOCK);
+	inputWrite = input[1];
+	fcntl(output[0], F_SETFL, O_NONBLOCK);
+	fcntl(output[1], F_SETFL, O_NONBLOCK);
+	outputRead = output[0];
+
+	ed = mioNew(input[0], output[1], SCREEN_ROWS, SCREEN_COLS);
+}
+
+int compareDoubles(const void *a, const void *b) {
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+// Times one keypress and the frame drawn after it
+double benchKey(const char *key, int len) {
+	write(inputWrite, key, len);
+	double t = benchNow();
+	mioProcessKey(ed);
+	mioRefresh(ed);
+	t = benchNow() - t;
+	benchDrainFrames();
+	return t;
+}
+
+// Runs in its own process so peak RSS is the corpus's own
+void benchCorpus(struct benchCorpus *corpus, const char *dir) {
+	char path[512];
+	snprintf(path, sizeof(path), "%s/%s", dir, corpus->file);
+	FILE *fp = fopen(path, "w");
+	if (fp == NULL) {
+		perror(path);
+		exit(1);
+	}
+	corpus->generate(fp);
+	fclose(fp);
+	struct stat st;
+	stat(path, &st);
+
+	benchFakeTerminal();
+
+	double openTime = benchNow();
+	mioOpen(ed, path);
+	openTime = benchNow() - openTime;
+	int lines = mioNumLines(ed);
+	mioRefresh(ed);
+	benchDrainFrames();
+	long firstFrameBytes = frameBytes;
+	frameBytes = 0;
+
+	int capacity = 1024;
+	int keys = 0;
+	double *samples = malloc(sizeof(double) * capacity);
+	for (int s = 0; corpus->scripts[s]; s++) {
+		for (struct benchStep *step = corpus->scripts[s]; step->keys; step++) {
+			for (int n = 0; n < step->count; n++) {
+				int escape = (step->keys[0] == '\x1b');
+				int len = escape ? (int)strlen(step->keys) : 1;
+				const char *key;
+				for (key = step->keys; *key; key += len) {
+					if (keys == capacity) {
+						capacity *= 2;
+						samples = realloc(samples, sizeof(double) * capacity);
+					}
+					samples[keys++] = benchKey(key, len);
+				}
+			}
+		}
+	}
+
+	double saveTime = benchNow();
+	mioSave(ed);
+	saveTime = benchNow() - saveTime;
+
+	qsort(samples, keys, sizeof(double), compareDoubles);
+	double total = 0;
+	for (int j = 0; j < keys; j++) {
+		total += samples[j];
+	}
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	printf("{\"corpus\": \"%s\", \"bytes\": %lld, \"lines\": %d, \"open_ms\": %.3f, \"save_ms\": %.3f, "
+		"\"keys\": %d, \"key_p50_us\": %.1f, \"key_p99_us\": %.1f, \"key_max_us\": %.1f, \"key_mean_us\": %.1f, "
+		"\"first_frame_bytes\": %ld, \"frame_bytes_per_key\": %.1f, \"peak_rss_kb\": %ld}\n",
+		corpus->name, (long long)st.st_size, lines, openTime * 1e3, saveTime * 1e3,
+		keys, samples[keys / 2] * 1e6, samples[(int)(keys * 0.99)] * 1e6, samples[keys - 1] * 1e6, total / keys * 1e6,
+		firstFrameBytes, (double)frameBytes / keys, usage.ru_maxrss);
+	fflush(stdout);
+	unlink(path);
+}
+
+int main(int argc, char *argv[]) {
+	char dir[] = "/tmp/mio-bench-XXXXXX";
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+
+	// Naming corpora runs just those
+	int status = 0;
+	for (size_t c = 0; c < sizeof(corpora) / sizeof(corpora[0]); c++) {
+		int wanted = (argc == 1);
+		for (int j = 1; j < argc; j++) {
+			wanted |= !strcmp(argv[j], corpora[c].name);
+		}
+		if (!wanted) {
+			continue;
+		}
+
+		pid_t pid = fork();
+		if (pid == 0) {
+			benchCorpus(&corpora[c], dir);
+			_exit(0);
+		}
+		int childStatus;
+		if (pid == -1 || waitpid(pid, &childStatus, 0) == -1 || !WIFEXITED(childStatus) || WEXITSTATUS(childStatus) != 0) {
+			fprintf(stderr, "%s failed\n", corpora[c].name);
+			status = 1;
+		}
+	}
+	rmdir(dir);
+	return status;
+}
@@ -0,0 +1,141 @@
+// Replays an editing macro 500k times through libmio's mioProcessKey(),
+// once on each line of a buffer, then undoes and redoes the run and
+// checks each gets the buffer back exactly
+// Prints one JSON object so runs can be tracked over time
+//
+// make bench
+
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../mio.h"
+
+#define SCREEN_ROWS 24
+#define SCREEN_COLS 80
+#define LINES 500000
+
+#define KEY_DOWN "\x1b[B"
+#define KEY_END "\x1b[F"
+#define KEY_CTRL(k) ((const char[]){ (k) & 0x1f, '\0' })
+
+double benchNow() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct mio *ed;
+int inputWrite;
+int outputRead;
+
+// Throws away whatever frames the editor has written
+void benchDrainFrames() {
+	char buf[65536];
+	while (1) {
+		while (read(outputRead, buf, sizeof(buf)) > 0) {
+		}
+		if (!mioFlush(ed)) {
+			break;
+		}
+	}
+}
+
+// Undo is only recorded with a terminal, so keys come from one pipe and
+// frames go to another
+void benchFakeTerminal() {
+	int input[2];
+	int output[2];
+	if (pipe(input) == -1 || pipe(output) == -1) {
+		perror("pipe");
+		exit(1);
+	}
+	fcntl(input[0], F_SETFL, O_NONBLOCK);
+	inputWrite = input[1];
+	fcntl(output[0], F_SETFL, O_NONBLOCK);
+	fcntl(output[1], F_SETFL, O_NONBLOCK);
+	outputRead = output[0];
+
+	ed = mioNew(input[0], output[1], SCREEN_ROWS, SCREEN_COLS);
+}
+
+// Handles one key, or a prompt and everything typed into it
+double benchKeys(const char *keys) {
+	write(inputWrite, keys, strlen(keys));
+	double t = benchNow();
+	mioProcessKey(ed);
+	t = benchNow() - t;
+	mioRefresh(ed);
+	benchDrainFrames();
+	return t;
+}
+
+int benchSame(const char *expected, int expectedLen) {
+	int len;
+	char *buf = mioContents(ed, &len);
+	int same = (len == expectedLen && !memcmp(buf, expected, len));
+	free(buf);
+	return same;
+}
+
+int main() {
+	char path[] = "/tmp/mio-macro-XXXXXX";
+	int fd = mkstemp(path);
+	FILE *fp = (fd == -1) ? NULL : fdopen(fd, "w");
+	if (fp == NULL) {
+		perror("mkstemp");
+		return 1;
+	}
+	for (int i = 0; i < LINES; i++) {
+		fprintf(fp, "item %d = %d;\n", i, i * 7);
+	}
+	fclose(fp);
+
+	benchFakeTerminal();
+	mioOpen(ed, path);
+	unlink(path);
+	int lines = mioNumLines(ed);
+
+	// Append to a line and move down, recording edits the first line, the
+	// run edits the rest one row per replay
+	benchKeys(KEY_CTRL(']'));
+	benchKeys(KEY_END);
+	for (const char *c = " // seen"; *c; c++) {
+		char key[2] = { *c, '\0' };
+		benchKeys(key);
+	}
+	benchKeys(KEY_DOWN);
+	benchKeys(KEY_CTRL(']'));
+	int beforeLen;
+	char *before = mioContents(ed, &beforeLen);
+
+	char run[32];
+	snprintf(run, sizeof(run), "%s%d\r", KEY_CTRL('\\'), LINES - 1);
+	double runTime = benchKeys(run);
+	int afterLen;
+	char *after = mioContents(ed, &afterLen);
+	int edited = (afterLen == beforeLen + (LINES - 1) * 8);
+
+	double undoTime = benchKeys(KEY_CTRL('z'));
+	int undone = benchSame(before, beforeLen);
+	double redoTime = benchKeys(KEY_CTRL('y'));
+	int redone = benchSame(after, afterLen);
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	printf("{\"corpus\": \"macro_500k\", \"lines\": %d, \"run_ms\": %.3f, \"undo_ms\": %.3f, \"redo_ms\": %.3f, "
+		"\"edited\": %s, \"undone\": %s, \"redone\": %s, \"peak_rss_kb\": %ld}\n",
+		lines, runTime * 1e3, undoTime * 1e3, redoTime * 1e3,
+		edited ? "true" : "false", undone ? "true" : "false", redone ? "true" : "false", usage.ru_maxrss);
+	free(before);
+	free(after);
+	mioFree(ed);
+	return (edited && undone && redone) ? 0 : 1;
+}
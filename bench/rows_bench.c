@@ -0,0 +1,105 @@
+// Times whole-buffer scans of libmio's row table on a 10M-row buffer:
+// walking every line's length, joining the buffer into one string and
+// searching it for a string that isn't there
+// Prints one JSON object so runs can be tracked over time
+//
+// make bench
+
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../mio.h"
+
+#define ROWS 10000000
+#define RUNS 5
+
+double benchNow() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct mio *ed;
+long checksum; // keeps the scans from being optimized away
+
+// What a status bar or a goto-byte would do: every line's length
+void scanLengths() {
+	int lines = mioNumLines(ed);
+	long total = 0;
+	for (int j = 0; j < lines; j++) {
+		int len;
+		mioLine(ed, j, &len);
+		total += len + 1;
+	}
+	checksum += total;
+}
+
+void scanContents() {
+	int len;
+	char *buf = mioContents(ed, &len);
+	checksum += len + buf[len / 2];
+	free(buf);
+}
+
+void scanFind() {
+	struct mioMatch match = { -1, 0, 0 };
+	checksum += mioFind(ed, "no such line", 0, &match);
+}
+
+// Best of RUNS, in milliseconds
+double benchScan(void (*scan)()) {
+	double best = 0;
+	for (int r = 0; r < RUNS; r++) {
+		double t = benchNow();
+		scan();
+		t = benchNow() - t;
+		if (r == 0 || t < best) {
+			best = t;
+		}
+	}
+	return best * 1e3;
+}
+
+int main() {
+	char path[] = "/tmp/mio-rows-XXXXXX";
+	int fd = mkstemp(path);
+	FILE *fp = (fd == -1) ? NULL : fdopen(fd, "w");
+	if (fp == NULL) {
+		perror("mkstemp");
+		return 1;
+	}
+	// Short lines, so the row table rather than the text is what's read
+	for (int i = 0; i < ROWS; i++) {
+		fprintf(fp, "r%d %.*s\n", i, i % 7, "abcdefg");
+	}
+	fclose(fp);
+
+	// Headless, nothing is rendered or highlighted
+	ed = mioNew(-1, -1, 0, 0);
+	double openTime = benchNow();
+	mioOpen(ed, path);
+	openTime = benchNow() - openTime;
+	unlink(path);
+
+	int lines = mioNumLines(ed);
+	double lengths = benchScan(scanLengths);
+	double contents = benchScan(scanContents);
+	double find = benchScan(scanFind);
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	printf("{\"corpus\": \"rows_10m\", \"lines\": %d, \"open_ms\": %.3f, "
+		"\"lengths_ms\": %.3f, \"lengths_mrows_s\": %.1f, \"contents_ms\": %.3f, \"find_ms\": %.3f, "
+		"\"peak_rss_kb\": %ld, \"checksum\": %ld}\n",
+		lines, openTime * 1e3, lengths, lines / lengths / 1e3, contents, find,
+		usage.ru_maxrss, checksum);
+	mioFree(ed);
+	return 0;
+}
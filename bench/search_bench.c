@@ -0,0 +1,250 @@
+// Compares Find's searchFind() against plain strstr() over a
+// synthetic log, searched row by row the way editorFindCallback does,
+// then checks that going through every regex match in a long row stays
+// linear in its length
+//
+// make bench
+
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../search.h"
+#include "../dfa.h"
+
+#define ROWS 2000000
+#define RUNS 5
+
+struct row {
+	char *chars;
+	int size;
+};
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Lines look like "2024-01-01T00:00:00.123Z INFO  request 1234 served in 12ms"
+struct row *makeRows(size_t *totalBytes) {
+	static const char *levels[] = { "INFO ", "DEBUG", "WARN ", "TRACE" };
+	struct row *rows = malloc(sizeof(struct row) * ROWS);
+	char line[160];
+	*totalBytes = 0;
+
+	srand(42);
+	for (int i = 0; i < ROWS; i++) {
+		int len = snprintf(line, sizeof(line), "2024-01-%02dT%02d:%02d:%02d.%03dZ %s request %d served in %dms from 10.0.%d.%d",
+			i % 28 + 1, i % 24, i % 60, (i / 60) % 60, rand() % 1000, levels[rand() % 4], rand(), rand() % 500, rand() % 256, rand() % 256);
+		rows[i].chars = malloc(len + 1);
+		memcpy(rows[i].chars, line, len + 1);
+		rows[i].size = len;
+		*totalBytes += len;
+	}
+
+	// A handful of rows carry the needle we're looking for
+	for (int i = ROWS / 7; i < ROWS; i += ROWS / 7) {
+		memcpy(rows[i].chars + 25, "ERROR", 5);
+	}
+	return rows;
+}
+
+int countFind(struct row *rows, const char *needle) {
+	int found = 0;
+	struct searchPattern p;
+	searchCompile(&p, needle, strlen(needle));
+	for (int i = 0; i < ROWS; i++) {
+		if (searchFind(&p, rows[i].chars, rows[i].size) != -1) {
+			found++;
+		}
+	}
+	return found;
+}
+
+int countStrstr(struct row *rows, const char *needle) {
+	int found = 0;
+	for (int i = 0; i < ROWS; i++) {
+		if (strstr(rows[i].chars, needle) != NULL) {
+			found++;
+		}
+	}
+	return found;
+}
+
+// The same text as one contiguous buffer, counting every occurrence
+int countFindFlat(const char *flat, size_t len, const char *needle) {
+	int found = 0;
+	size_t at = 0;
+	long match;
+	struct searchPattern p;
+	searchCompile(&p, needle, strlen(needle));
+	while ((match = searchFind(&p, flat + at, len - at)) != -1) {
+		found++;
+		at += match + 1;
+	}
+	return found;
+}
+
+int countStrstrFlat(const char *flat, size_t len, const char *needle) {
+	int found = 0;
+	const char *match = flat;
+	(void)len;
+	while ((match = strstr(match, needle)) != NULL) {
+		found++;
+		match++;
+	}
+	return found;
+}
+
+void benchFlat(const char *flat, size_t len, const char *needle) {
+	double best[2] = { 1e9, 1e9 };
+	int found[2] = { 0, 0 };
+
+	for (int run = 0; run < RUNS; run++) {
+		double t = now();
+		found[0] = countFindFlat(flat, len, needle);
+		t = now() - t;
+		if (t < best[0]) {
+			best[0] = t;
+		}
+
+		t = now();
+		found[1] = countStrstrFlat(flat, len, needle);
+		t = now() - t;
+		if (t < best[1]) {
+			best[1] = t;
+		}
+	}
+
+	if (found[0] != found[1]) {
+		fprintf(stderr, "mismatch for \"%s\": searchFind %d, strstr %d\n", needle, found[0], found[1]);
+		exit(1);
+	}
+
+	double mb = len / 1e6;
+	printf("%-24s %8d hits  searchFind %8.1f MB/s  strstr %8.1f MB/s  speedup %.2fx\n",
+		needle, found[0], mb / best[0], mb / best[1], best[1] / best[0]);
+}
+
+void bench(struct row *rows, size_t totalBytes, const char *needle) {
+	double best[2] = { 1e9, 1e9 };
+	int found[2] = { 0, 0 };
+
+	for (int run = 0; run < RUNS; run++) {
+		double t = now();
+		found[0] = countFind(rows, needle);
+		t = now() - t;
+		if (t < best[0]) {
+			best[0] = t;
+		}
+
+		t = now();
+		found[1] = countStrstr(rows, needle);
+		t = now() - t;
+		if (t < best[1]) {
+			best[1] = t;
+		}
+	}
+
+	if (found[0] != found[1]) {
+		fprintf(stderr, "mismatch for \"%s\": searchFind %d, strstr %d\n", needle, found[0], found[1]);
+		exit(1);
+	}
+
+	double mb = totalBytes / 1e6;
+	printf("%-24s %8d rows  searchFind %8.1f MB/s  strstr %8.1f MB/s  speedup %.2fx\n",
+		needle, found[0], mb / best[0], mb / best[1], best[1] / best[0]);
+}
+
+// Every match of a regex in one row, found the way the editor steps
+// through a row's matches
+int countRegexRow(struct regex *re, const char *row, int len) {
+	struct regexCache cache;
+	regexCacheInit(&cache, re);
+	int found = 0;
+	int matchLen;
+	int at = regexSearch(re, &cache, row, len, 0, &matchLen);
+	while (at != -1) {
+		found++;
+		at = regexSearch(re, &cache, row, len, at + 1, &matchLen);
+	}
+	regexCacheFree(&cache);
+	return found;
+}
+
+// A match every 10 chars in rows of 20K to 160K; eight times the row
+// should take about eight times as long, not sixty-four
+int benchRegexRows() {
+	const char *error;
+	struct regex *re = regexCompile("xa+", &error);
+	double first = 0;
+	int status = 0;
+	for (int len = 20000; len <= 160000; len *= 2) {
+		char *row = malloc(len);
+		for (int i = 0; i < len; i++) {
+			row[i] = (i % 10 == 0) ? 'x' : (i % 10 < 4) ? 'a' : 'b';
+		}
+
+		double best = 1e9;
+		int found = 0;
+		for (int run = 0; run < RUNS; run++) {
+			double t = now();
+			found = countRegexRow(re, row, len);
+			t = now() - t;
+			if (t < best) {
+				best = t;
+			}
+		}
+		if (found != len / 10) {
+			fprintf(stderr, "xa+ in a %d char row: %d matches, expected %d\n", len, found, len / 10);
+			status = 1;
+		}
+		if (len == 20000) {
+			first = best;
+		}
+		printf("xa+ %7d char row  %8d hits  %8.3f ms  %6.1fx the 20K row\n", len, found, best * 1e3, best / first);
+		if (len == 160000 && best > first * 32) {
+			fprintf(stderr, "xa+ matches in a 160K row took %.0fx as long as in a 20K row\n", best / first);
+			status = 1;
+		}
+		free(row);
+	}
+	regexFree(re);
+	return status;
+}
+
+int main() {
+	size_t totalBytes;
+	struct row *rows = makeRows(&totalBytes);
+
+	printf("row by row, %d rows, %.1f MB\n", ROWS, totalBytes / 1e6);
+	bench(rows, totalBytes, "ERROR");
+	bench(rows, totalBytes, "served in 499ms");
+	bench(rows, totalBytes, "10.0.255.255");
+	bench(rows, totalBytes, "e");
+	bench(rows, totalBytes, "not present anywhere");
+
+	// Joined into one buffer, as a single huge line or a file in memory
+	char *flat = malloc(totalBytes + ROWS + 1);
+	size_t len = 0;
+	for (int i = 0; i < ROWS; i++) {
+		memcpy(flat + len, rows[i].chars, rows[i].size);
+		len += rows[i].size;
+		flat[len++] = '\n';
+	}
+	flat[len] = '\0';
+
+	printf("\ncontiguous, %.1f MB\n", len / 1e6);
+	benchFlat(flat, len, "ERROR");
+	benchFlat(flat, len, "served in 499ms");
+	benchFlat(flat, len, "10.0.255.255");
+	benchFlat(flat, len, "not present anywhere");
+
+	printf("\nregex, every match in one row\n");
+	return benchRegexRows();
+}
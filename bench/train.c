@@ -0,0 +1,246 @@
+// The training workload for make pgo: opens a generated file for every
+// language in HLDB and for a big log, then highlights, searches, edits,
+// greps and saves them through libmio the way a session at the terminal
+// would, so the profile it leaves behind follows the real hot paths
+//
+// make pgo
+
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "../mio.h"
+
+#define SCREEN_ROWS 40
+#define SCREEN_COLS 120
+
+#define KEY_UP "\x1b[A"
+#define KEY_DOWN "\x1b[B"
+#define KEY_RIGHT "\x1b[C"
+#define KEY_HOME "\x1b[H"
+#define KEY_END "\x1b[F"
+#define KEY_PAGE_DOWN "\x1b[6~"
+#define KEY_PAGE_UP "\x1b[5~"
+#define KEY_BACKSPACE "\x7f"
+#define KEY_ESC "\x1b"
+#define KEY_CTRL(k) ((const char[]){ (k) & 0x1f, '\0' })
+
+// A script step: keys pressed count times, prompts and all
+// Steps are written out whole before the editor reads them, so a step
+// must leave the editor outside any prompt, and a lone ESC must come last
+// in its step or it reads as the start of an escape sequence
+struct trainStep {
+	const char *keys;
+	int count;
+};
+
+// Scrolling, typing, finding, replacing, undoing and the clipboard
+struct trainStep editingScript[] = {
+	{ KEY_PAGE_DOWN, 3 }, { KEY_DOWN, 10 }, { KEY_END, 1 }, { " x = 42; trained", 1 }, { "\r", 3 },
+	{ "return value trained", 1 }, { KEY_BACKSPACE, 5 },
+	{ "\x06" "value\r", 1 }, { KEY_CTRL('n'), 5 }, { KEY_CTRL('p'), 2 },
+	{ "\x06\x14" "[0-9]+ \r", 1 }, { KEY_CTRL('n'), 3 },
+	{ "\x12" "trained\rTRAINED\ra", 1 },
+	{ KEY_CTRL('z'), 6 }, { KEY_CTRL('y'), 3 },
+	{ KEY_PAGE_UP, 2 }, { KEY_CTRL('a'), 1 }, { KEY_DOWN, 20 }, { KEY_CTRL('c'), 1 },
+	{ KEY_PAGE_DOWN, 1 }, { KEY_CTRL('v'), 1 }, { KEY_CTRL('a'), 1 }, { KEY_UP, 5 }, { KEY_CTRL('x'), 1 },
+	{ "\x1d" "item " KEY_DOWN KEY_HOME "\x1d", 1 }, { "\x1c" "5\r", 1 },
+	{ KEY_CTRL('d'), 3 }, { KEY_RIGHT, 30 }, { KEY_CTRL('s'), 1 }, { NULL, 0 }
+};
+
+// Opening and closing a comment near the top re-highlights what follows
+struct trainStep commentScript[] = {
+	{ KEY_PAGE_UP, 20 }, { KEY_DOWN, 3 }, { KEY_HOME, 1 }, { NULL, 0 }
+};
+
+// Finding in a file big enough to be searched in parallel
+struct trainStep logScript[] = {
+	{ "\x06" "served in 4\r", 1 }, { KEY_CTRL('n'), 20 }, { "\x06\x14" "[0-9]+ms\r", 1 }, { NULL, 0 }
+};
+
+// Searching every file in the directory, then closing the results
+struct trainStep grepScript[] = {
+	{ "\x17" "return\r" KEY_DOWN KEY_DOWN KEY_PAGE_DOWN KEY_ESC, 1 },
+	{ "\x17\x14" "f[0-9]+\\(\r" KEY_DOWN KEY_ESC, 1 }, { NULL, 0 }
+};
+
+struct mio *ed;
+int inputWrite;
+int inputRead;
+
+// Reads and throws away the frames, as a terminal would
+void trainDrainFrames(int outputRead) {
+	char buf[65536];
+	do {
+		while (read(outputRead, buf, sizeof(buf)) > 0) {
+		}
+	} while (mioFlush(ed));
+}
+
+// Feeds keys to the editor until it has read them all
+void trainKeys(const char *keys, int len, int outputRead) {
+	write(inputWrite, keys, len);
+	int pending;
+	while (ioctl(inputRead, FIONREAD, &pending) == 0 && pending > 0) {
+		mioProcessKey(ed);
+		mioRefresh(ed);
+		trainDrainFrames(outputRead);
+	}
+}
+
+void trainScript(struct trainStep *script, int outputRead) {
+	for (struct trainStep *step = script; step->keys; step++) {
+		for (int n = 0; n < step->count; n++) {
+			trainKeys(step->keys, strlen(step->keys), outputRead);
+		}
+	}
+}
+
+// Source-like lines built from a language's own keywords, numbers,
+// strings and comments
+void trainGenerate(FILE *fp, const struct editorSyntax *syntax, int lines) {
+	int keywords = 0;
+	while (syntax->keywords && syntax->keywords[keywords]) {
+		keywords++;
+	}
+	const char *single = syntax->singleline_comment_start;
+	const char *open = syntax->multiline_comment_start;
+	const char *close = syntax->multiline_comment_end;
+
+	for (int i = 0; i < lines; i++) {
+		if (open && close && i % 40 == 0) {
+			fprintf(fp, "%s block %d\n  still inside %d\n%s\n", open, i, i * 7, close);
+		}
+		if (keywords) {
+			const char *keyword = syntax->keywords[i % keywords];
+			int len = strlen(keyword);
+			if (keyword[len - 1] == '|') {
+				len--;
+			}
+			fprintf(fp, "%.*s ", len, keyword);
+		}
+		fprintf(fp, "item%d = f%d(\"value %d\", %d.%d, 'c');", i, i % 13, i, i, i % 10);
+		if (single) {
+			fprintf(fp, " %s note %d", single, i);
+		}
+		fprintf(fp, "%s\n", (i % 9 == 0) ? "\treturn item;" : "");
+	}
+}
+
+// Opens path in a fresh editor and runs the scripts over it
+void trainFile(const char *path, const struct editorSyntax *syntax, int outputRead) {
+	mioOpen(ed, path);
+	mioRefresh(ed);
+	trainDrainFrames(outputRead);
+
+	trainScript(editingScript, outputRead);
+	if (syntax && syntax->multiline_comment_start && syntax->multiline_comment_end) {
+		trainScript(commentScript, outputRead);
+		const char *open = syntax->multiline_comment_start;
+		int len = strlen(open);
+		for (int n = 0; n < 2; n++) {
+			trainKeys(open, len, outputRead);
+			for (int j = 0; j < len; j++) {
+				trainKeys(KEY_BACKSPACE, 1, outputRead);
+			}
+		}
+	}
+	mioSave(ed);
+}
+
+int main() {
+	char dir[] = "/tmp/mio-train-XXXXXX";
+	if (mkdtemp(dir) == NULL || chdir(dir) == -1) {
+		perror("mkdtemp");
+		return 1;
+	}
+
+	// Frames go to a pipe rather than nowhere, a headless editor would
+	// skip drawing and highlighting altogether
+	int input[2];
+	int output[2];
+	if (pipe(input) == -1 || pipe(output) == -1) {
+		perror("pipe");
+		return 1;
+	}
+	fcntl(input[0], F_SETFL, O_NONBLOCK);
+	fcntl(output[0], F_SETFL, O_NONBLOCK);
+	fcntl(output[1], F_SETFL, O_NONBLOCK);
+	inputRead = input[0];
+	inputWrite = input[1];
+
+	// One file per language, named so its highlighting gets picked
+	char path[256];
+	int files = 0;
+	for (int j = 0; j < mioSyntaxCount(); j++) {
+		const struct editorSyntax *syntax = mioSyntax(j);
+		const char *match = syntax->filematch[0];
+		snprintf(path, sizeof(path), "%s%s", (match[0] == '.') ? "train" : "", match);
+		FILE *fp = fopen(path, "w");
+		if (fp == NULL) {
+			perror(path);
+			return 1;
+		}
+		trainGenerate(fp, syntax, 3000);
+		fclose(fp);
+		files++;
+	}
+
+	FILE *fp = fopen("train.log", "w");
+	if (fp == NULL) {
+		perror("train.log");
+		return 1;
+	}
+	for (int i = 0; i < 200000; i++) {
+		fprintf(fp, "2024-01-%02dT%02d:%02d:%02dZ INFO request %d served in %dms return %d\n",
+			i % 28 + 1, i % 24, i % 60, (i / 60) % 60, i * 7919, i % 500, i % 3);
+	}
+	fclose(fp);
+
+	for (int j = 0; j < mioSyntaxCount(); j++) {
+		const struct editorSyntax *syntax = mioSyntax(j);
+		const char *match = syntax->filematch[0];
+		snprintf(path, sizeof(path), "%s%s", (match[0] == '.') ? "train" : "", match);
+		ed = mioNew(inputRead, output[1], SCREEN_ROWS, SCREEN_COLS);
+		trainFile(path, syntax, output[0]);
+		mioFree(ed);
+	}
+
+	// A big file searched in parallel, then the whole directory grepped
+	ed = mioNew(inputRead, output[1], SCREEN_ROWS, SCREEN_COLS);
+	trainFile("train.log", NULL, output[0]);
+	trainScript(logScript, output[0]);
+	trainScript(grepScript, output[0]);
+	mioFree(ed);
+
+	// Batch mode's script, run as each of its worker processes does
+	char error[256];
+	struct mioScript *script = mioScriptParse("s/request/REQUEST/\ns/[0-9]+ms/fast/r\nd/return 2/\n1i first line\na last line\n", error, sizeof(error));
+	if (script == NULL) {
+		fprintf(stderr, "%s\n", error);
+		return 1;
+	}
+	ed = mioNew(-1, -1, 0, 0);
+	mioScriptRun(ed, script, "train.log", error, sizeof(error));
+	mioFree(ed);
+	mioScriptFree(script);
+
+	// Leave nothing behind
+	for (int j = 0; j < mioSyntaxCount(); j++) {
+		const char *match = mioSyntax(j)->filematch[0];
+		snprintf(path, sizeof(path), "%s%s", (match[0] == '.') ? "train" : "", match);
+		unlink(path);
+	}
+	unlink("train.log");
+	if (chdir("/tmp") == 0) {
+		rmdir(dir);
+	}
+	printf("trained on %d languages\n", files);
+	return 0;
+}
@@ -9,4 +9,54 @@
 // list at the bottom of the screen
 // 0 - No
 // 1 - Yes
-#define SHOW_COMMANDS 1
\ No newline at end of file
+#define SHOW_COMMANDS 1
+
+// Rows longer than LONG_ROW chars are rendered and highlighted in
+// pieces of about ROW_CHUNK chars, only the ones on screen are expanded
+#define LONG_ROW 65536
+#define ROW_CHUNK 4096
+
+// Memory, in bytes, Find may spend remembering the matches of the
+// current query so they can be narrowed as the query grows
+#define SEARCH_CANDIDATE_BUDGET (8 * 1024 * 1024)
+
+// Threads used to search the buffer in parallel
+// 0 - One per online CPU
+#define SEARCH_THREADS 0
+
+// Grep stops collecting results after this many matching lines
+#define GREP_MAX_RESULTS 100000
+
+// Grep skips files with a NUL byte in their first GREP_SNIFF_BYTES
+#define GREP_SNIFF_BYTES 8000
+
+// Longest part of a matching line Grep keeps for its results list
+#define GREP_LINE_MAX 256
+
+// Memory, in bytes, the undo history may use
+// The oldest edits are forgotten to stay under it
+#define UNDO_MEMORY_LIMIT (32 * 1024 * 1024)
+
+// Row arrays and undo logs of killed buffers kept for reuse
+#define SPARE_BLOCKS 8
+
+// Furthest, in lines, a reload looks ahead for the file to line up
+// with the buffer again after a change, past it the rest is replaced
+// Must be a power of two
+#define RELOAD_SYNC_LINES 65536
+
+// Bytes at the end of a followed file checked again on every read, so
+// a file truncated and written past its old size is read from the start
+#define FOLLOW_CHECK_BYTES 64
+
+// Processes batch mode (-b) edits files in
+// 0 - One per online CPU
+#define BATCH_JOBS 0
+
+// File stats are appended to on SIGUSR1 unless MIO_STATS names another
+// Setting MIO_STATS also writes them when the editor quits
+#define STATS_FILE "/tmp/mio-stats"
+
+// Events kept for a trace (MIO_TRACE), the oldest are dropped
+// Must be a power of two
+#define TRACE_EVENTS 262144
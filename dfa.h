@@ -0,0 +1,790 @@
+#ifndef DFA_H
+#define DFA_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "search.h"
+
+// Regular expressions for Find, matched with a lazily built DFA
+//
+// Supports literals, ., [classes], \d \w \s (and \D \W \S), (groups),
+// | alternation, * + ? repetition and ^ / $ at the ends of the pattern.
+// The pattern is compiled to an NFA; DFA states (sets of NFA states)
+// are only built when the text reaches them and are cached after that,
+// so matching never backtracks and stays linear in the length of the row.
+
+#define NFA_CHARS 0 // consumes one byte found in set
+#define NFA_SPLIT 1 // epsilon moves to out and out1
+#define NFA_MATCH 2
+
+// Once a DFA holds this many states its cache is flushed and rebuilt
+#define DFA_MAX_STATES 1024
+
+struct nfaState {
+	int type;
+	int out;
+	int out1;
+	unsigned char set[32];
+};
+
+struct nfa {
+	struct nfaState *states;
+	int count;
+	int capacity;
+	int start;
+	int match;
+};
+
+struct regex {
+	struct nfa forward;
+	struct nfa reverse; // the pattern read backwards, to find where matches start
+	int anchoredStart;
+	int anchoredEnd;
+	char *prefix; // literal every match starts with, may be empty
+	struct searchPattern prefixPattern;
+};
+
+/*** nfa construction ***/
+
+// A piece of NFA under construction
+// Its dangling exits are slots: state * 2 for out, state * 2 + 1 for out1
+struct nfaFrag {
+	int start;
+	int *outs;
+	int numOuts;
+};
+
+struct regexParser {
+	const char *p;
+	const char *end;
+	int reverse;
+	struct nfa *nfa;
+	const char *error;
+};
+
+int nfaAdd(struct nfa *n, int type) {
+	if (n->count == n->capacity) {
+		n->capacity = n->capacity ? n->capacity * 2 : 16;
+		n->states = realloc(n->states, sizeof(struct nfaState) * n->capacity);
+	}
+	struct nfaState *s = &n->states[n->count];
+	s->type = type;
+	s->out = -1;
+	s->out1 = -1;
+	memset(s->set, 0, sizeof(s->set));
+	return n->count++;
+}
+
+void nfaSetAdd(struct nfaState *s, int lo, int hi) {
+	int c;
+	for (c = lo; c <= hi; c++) {
+		s->set[c >> 3] |= 1 << (c & 7);
+	}
+}
+
+int nfaSetHas(const struct nfaState *s, unsigned char c) {
+	return s->set[c >> 3] & (1 << (c & 7));
+}
+
+struct nfaFrag fragMake(int start, int slot) {
+	struct nfaFrag f;
+	f.start = start;
+	f.outs = malloc(sizeof(int));
+	f.outs[0] = slot;
+	f.numOuts = 1;
+	return f;
+}
+
+void fragPatch(struct nfa *n, struct nfaFrag *f, int target) {
+	int j;
+	for (j = 0; j < f->numOuts; j++) {
+		struct nfaState *s = &n->states[f->outs[j] / 2];
+		if (f->outs[j] % 2) {
+			s->out1 = target;
+		} else {
+			s->out = target;
+		}
+	}
+	free(f->outs);
+	f->outs = NULL;
+	f->numOuts = 0;
+}
+
+// Moves b's exits onto a
+void fragMergeOuts(struct nfaFrag *a, struct nfaFrag *b) {
+	a->outs = realloc(a->outs, sizeof(int) * (a->numOuts + b->numOuts));
+	memcpy(&a->outs[a->numOuts], b->outs, sizeof(int) * b->numOuts);
+	a->numOuts += b->numOuts;
+	free(b->outs);
+	b->outs = NULL;
+	b->numOuts = 0;
+}
+
+// Adds the class escape \c to s, returns 0 if c isn't one
+int regexClassEscape(struct nfaState *s, char c) {
+	struct nfaState tmp;
+	memset(tmp.set, 0, sizeof(tmp.set));
+
+	switch (c) {
+		case 'd':
+		case 'D':
+			nfaSetAdd(&tmp, '0', '9');
+			break;
+		case 'w':
+		case 'W':
+			nfaSetAdd(&tmp, '0', '9');
+			nfaSetAdd(&tmp, 'a', 'z');
+			nfaSetAdd(&tmp, 'A', 'Z');
+			nfaSetAdd(&tmp, '_', '_');
+			break;
+		case 's':
+		case 'S':
+			nfaSetAdd(&tmp, ' ', ' ');
+			nfaSetAdd(&tmp, '\t', '\r');
+			break;
+		default:
+			return 0;
+	}
+
+	int j;
+	int negate = (c == 'D' || c == 'W' || c == 'S');
+	for (j = 0; j < 32; j++) {
+		s->set[j] |= negate ? ~tmp.set[j] : tmp.set[j];
+	}
+	return 1;
+}
+
+char regexEscapedChar(char c) {
+	switch (c) {
+		case 't': return '\t';
+		case 'n': return '\n';
+		case 'r': return '\r';
+		default: return c;
+	}
+}
+
+struct nfaFrag regexParseAlt(struct regexParser *P);
+
+int regexParseClass(struct regexParser *P, struct nfaState *s) {
+	int negate = 0;
+	if (P->p < P->end && *P->p == '^') {
+		negate = 1;
+		P->p++;
+	}
+
+	int first = 1;
+	while (P->p < P->end && (*P->p != ']' || first)) {
+		first = 0;
+		unsigned char lo = *P->p++;
+		if (lo == '\\' && P->p < P->end) {
+			if (regexClassEscape(s, *P->p)) {
+				P->p++;
+				continue;
+			}
+			lo = regexEscapedChar(*P->p++);
+		}
+
+		unsigned char hi = lo;
+		if (P->p + 1 < P->end && P->p[0] == '-' && P->p[1] != ']') {
+			P->p++;
+			hi = *P->p++;
+			if (hi == '\\' && P->p < P->end) {
+				hi = regexEscapedChar(*P->p++);
+			}
+			if (hi < lo) {
+				P->error = "bad range";
+				return -1;
+			}
+		}
+		nfaSetAdd(s, lo, hi);
+	}
+
+	if (P->p == P->end) {
+		P->error = "missing ]";
+		return -1;
+	}
+	P->p++;
+
+	if (negate) {
+		int j;
+		for (j = 0; j < 32; j++) {
+			s->set[j] = ~s->set[j];
+		}
+	}
+	return 0;
+}
+
+struct nfaFrag regexParseAtom(struct regexParser *P) {
+	struct nfaFrag f = { -1, NULL, 0 };
+	char c = *P->p++;
+
+	if (c == '(') {
+		f = regexParseAlt(P);
+		if (P->error) {
+			return f;
+		}
+		if (P->p == P->end || *P->p != ')') {
+			P->error = "missing )";
+			return f;
+		}
+		P->p++;
+		return f;
+	}
+
+	if (c == ')') {
+		P->error = "unmatched )";
+		return f;
+	}
+	if (c == '*' || c == '+' || c == '?') {
+		P->error = "nothing to repeat";
+		return f;
+	}
+
+	int s = nfaAdd(P->nfa, NFA_CHARS);
+	struct nfaState *state = &P->nfa->states[s];
+	if (c == '.') {
+		nfaSetAdd(state, 0, 255);
+	} else if (c == '[') {
+		if (regexParseClass(P, &P->nfa->states[s]) == -1) {
+			return f;
+		}
+	} else if (c == '\\' && P->p < P->end) {
+		c = *P->p++;
+		if (!regexClassEscape(state, c)) {
+			c = regexEscapedChar(c);
+			nfaSetAdd(state, (unsigned char)c, (unsigned char)c);
+		}
+	} else {
+		nfaSetAdd(state, (unsigned char)c, (unsigned char)c);
+	}
+	return fragMake(s, s * 2);
+}
+
+struct nfaFrag regexParseRepeat(struct regexParser *P) {
+	struct nfaFrag f = regexParseAtom(P);
+
+	while (!P->error && P->p < P->end && (*P->p == '*' || *P->p == '+' || *P->p == '?')) {
+		char op = *P->p++;
+		int s = nfaAdd(P->nfa, NFA_SPLIT);
+		P->nfa->states[s].out = f.start;
+
+		if (op == '*') {
+			fragPatch(P->nfa, &f, s);
+			f.start = s;
+		} else if (op == '+') {
+			fragPatch(P->nfa, &f, s);
+		} else {
+			f.start = s;
+		}
+		struct nfaFrag loop = fragMake(s, s * 2 + 1);
+		fragMergeOuts(&f, &loop);
+	}
+	return f;
+}
+
+struct nfaFrag regexParseConcat(struct regexParser *P) {
+	struct nfaFrag *parts = NULL;
+	int numParts = 0;
+
+	while (!P->error && P->p < P->end && *P->p != '|' && *P->p != ')') {
+		parts = realloc(parts, sizeof(struct nfaFrag) * (numParts + 1));
+		parts[numParts++] = regexParseRepeat(P);
+	}
+
+	struct nfaFrag f;
+	if (P->error || numParts == 0) {
+		// Matches the empty string
+		int s = nfaAdd(P->nfa, NFA_SPLIT);
+		f = fragMake(s, s * 2);
+	} else {
+		// The reverse NFA joins the same pieces back to front
+		int j;
+		for (j = 0; j + 1 < numParts; j++) {
+			if (P->reverse) {
+				fragPatch(P->nfa, &parts[numParts - 1 - j], parts[numParts - 2 - j].start);
+			} else {
+				fragPatch(P->nfa, &parts[j], parts[j + 1].start);
+			}
+		}
+		f = P->reverse ? parts[0] : parts[numParts - 1];
+		f.start = P->reverse ? parts[numParts - 1].start : parts[0].start;
+	}
+
+	int j;
+	for (j = 0; j < numParts; j++) {
+		if (parts[j].outs != f.outs) {
+			free(parts[j].outs);
+		}
+	}
+	free(parts);
+	return f;
+}
+
+struct nfaFrag regexParseAlt(struct regexParser *P) {
+	struct nfaFrag f = regexParseConcat(P);
+
+	while (!P->error && P->p < P->end && *P->p == '|') {
+		P->p++;
+		struct nfaFrag g = regexParseConcat(P);
+		int s = nfaAdd(P->nfa, NFA_SPLIT);
+		P->nfa->states[s].out = f.start;
+		P->nfa->states[s].out1 = g.start;
+		fragMergeOuts(&f, &g);
+		f.start = s;
+	}
+	return f;
+}
+
+int regexBuildNfa(struct nfa *n, const char *pattern, int len, int reverse, const char **error) {
+	struct regexParser P = { pattern, pattern + len, reverse, n, NULL };
+	memset(n, 0, sizeof(struct nfa));
+
+	struct nfaFrag f = regexParseAlt(&P);
+	if (!P.error && P.p != P.end) {
+		P.error = "unmatched )";
+	}
+	if (P.error) {
+		free(f.outs);
+		*error = P.error;
+		return -1;
+	}
+
+	n->match = nfaAdd(n, NFA_MATCH);
+	fragPatch(n, &f, n->match);
+	n->start = f.start;
+	return 0;
+}
+
+// The literal every match has to begin with, e.g. "GET /api/" for
+// "GET /api/v[0-9]+", or nothing if the pattern has a top level |
+char *regexLiteralPrefix(const char *pattern, int len) {
+	int depth = 0;
+	int j;
+	for (j = 0; j < len; j++) {
+		char c = pattern[j];
+		if (c == '\\') {
+			j++;
+		} else if (c == '[') {
+			while (j + 1 < len && pattern[j + 1] != ']') {
+				j++;
+			}
+		} else if (c == '(') {
+			depth++;
+		} else if (c == ')') {
+			depth--;
+		} else if (c == '|' && depth == 0) {
+			return strdup("");
+		}
+	}
+
+	char *prefix = malloc(len + 1);
+	int prefixLen = 0;
+	j = 0;
+	while (j < len) {
+		char c = pattern[j];
+		int atomLen = 1;
+		if (c == '\\' && j + 1 < len) {
+			if (strchr("dDwWsS", pattern[j + 1])) {
+				break;
+			}
+			c = regexEscapedChar(pattern[j + 1]);
+			atomLen = 2;
+		} else if (strchr(".[()|*+?", c)) {
+			break;
+		}
+
+		char next = (j + atomLen < len) ? pattern[j + atomLen] : '\0';
+		if (next == '*' || next == '?') {
+			break;
+		}
+		prefix[prefixLen++] = c;
+		if (next == '+') {
+			break;
+		}
+		j += atomLen;
+	}
+	prefix[prefixLen] = '\0';
+	return prefix;
+}
+
+/*** dfa ***/
+
+struct dfaState {
+	int *set; // sorted indices of the NFA states it stands for
+	int count;
+	int accepting;
+	unsigned int hash;
+	int next[256]; // -1 until the transition is first taken
+};
+
+struct dfa {
+	const struct nfa *nfa;
+	int unanchored; // acts as if the pattern started with .*
+	struct dfaState *states;
+	int numStates;
+	int *table; // open addressing hash of state indices, -1 is empty
+	int start;  // -1 until built
+	int *stack;
+	int *marks;
+	int markGen;
+	int *scratch;
+};
+
+void dfaInit(struct dfa *d, const struct nfa *n, int unanchored) {
+	d->nfa = n;
+	d->unanchored = unanchored;
+	d->states = malloc(sizeof(struct dfaState) * DFA_MAX_STATES);
+	d->numStates = 0;
+	d->table = malloc(sizeof(int) * DFA_MAX_STATES * 2);
+	memset(d->table, -1, sizeof(int) * DFA_MAX_STATES * 2);
+	d->start = -1;
+	d->stack = malloc(sizeof(int) * n->count);
+	d->marks = calloc(n->count, sizeof(int));
+	d->markGen = 0;
+	d->scratch = malloc(sizeof(int) * n->count);
+}
+
+void dfaFlush(struct dfa *d) {
+	int j;
+	for (j = 0; j < d->numStates; j++) {
+		free(d->states[j].set);
+	}
+	d->numStates = 0;
+	memset(d->table, -1, sizeof(int) * DFA_MAX_STATES * 2);
+	d->start = -1;
+}
+
+void dfaFree(struct dfa *d) {
+	dfaFlush(d);
+	free(d->states);
+	free(d->table);
+	free(d->stack);
+	free(d->marks);
+	free(d->scratch);
+}
+
+int dfaCompareInt(const void *a, const void *b) {
+	return *(const int *)a - *(const int *)b;
+}
+
+// Follows epsilon moves from the seeds, leaving the consuming and
+// matching states reached in d->scratch, sorted
+int dfaClosure(struct dfa *d, const int *seeds, int numSeeds) {
+	const struct nfa *n = d->nfa;
+	int count = 0;
+	int top = 0;
+	int j;
+
+	d->markGen++;
+	for (j = 0; j < numSeeds; j++) {
+		if (d->marks[seeds[j]] != d->markGen) {
+			d->marks[seeds[j]] = d->markGen;
+			d->stack[top++] = seeds[j];
+		}
+	}
+
+	while (top) {
+		int s = d->stack[--top];
+		const struct nfaState *state = &n->states[s];
+		if (state->type != NFA_SPLIT) {
+			d->scratch[count++] = s;
+			continue;
+		}
+		int outs[2] = { state->out, state->out1 };
+		for (j = 0; j < 2; j++) {
+			if (outs[j] != -1 && d->marks[outs[j]] != d->markGen) {
+				d->marks[outs[j]] = d->markGen;
+				d->stack[top++] = outs[j];
+			}
+		}
+	}
+
+	qsort(d->scratch, count, sizeof(int), dfaCompareInt);
+	return count;
+}
+
+// Returns the state for the set in d->scratch, adding it if it's new
+int dfaIntern(struct dfa *d, int count) {
+	unsigned int hash = 2166136261u;
+	int j;
+	for (j = 0; j < count; j++) {
+		hash = (hash ^ d->scratch[j]) * 16777619u;
+	}
+
+	int mask = DFA_MAX_STATES * 2 - 1;
+	int slot = hash & mask;
+	while (d->table[slot] != -1) {
+		struct dfaState *s = &d->states[d->table[slot]];
+		if (s->hash == hash && s->count == count && !memcmp(s->set, d->scratch, sizeof(int) * count)) {
+			return d->table[slot];
+		}
+		slot = (slot + 1) & mask;
+	}
+
+	if (d->numStates == DFA_MAX_STATES) {
+		// Cache is full, start over; only the state being added survives
+		dfaFlush(d);
+		slot = hash & mask;
+	}
+
+	int index = d->numStates++;
+	struct dfaState *s = &d->states[index];
+	s->set = malloc(sizeof(int) * (count ? count : 1));
+	memcpy(s->set, d->scratch, sizeof(int) * count);
+	s->count = count;
+	s->hash = hash;
+	s->accepting = 0;
+	for (j = 0; j < count; j++) {
+		if (s->set[j] == d->nfa->match) {
+			s->accepting = 1;
+		}
+	}
+	memset(s->next, -1, sizeof(s->next));
+	d->table[slot] = index;
+	return index;
+}
+
+int dfaStart(struct dfa *d) {
+	if (d->start == -1) {
+		int seed = d->nfa->start;
+		d->start = dfaIntern(d, dfaClosure(d, &seed, 1));
+	}
+	return d->start;
+}
+
+// Follows (building it if needed) the transition from state s on c
+int dfaStep(struct dfa *d, int s, unsigned char c) {
+	int t = d->states[s].next[c];
+	if (t != -1) {
+		return t;
+	}
+
+	const struct nfa *n = d->nfa;
+	const struct dfaState *from = &d->states[s];
+	int *seeds = malloc(sizeof(int) * (from->count + 1));
+	int numSeeds = 0;
+	int j;
+	for (j = 0; j < from->count; j++) {
+		const struct nfaState *state = &n->states[from->set[j]];
+		if (state->type == NFA_CHARS && nfaSetHas(state, c)) {
+			seeds[numSeeds++] = state->out;
+		}
+	}
+	if (d->unanchored) {
+		seeds[numSeeds++] = n->start;
+	}
+
+	int before = d->numStates;
+	t = dfaIntern(d, dfaClosure(d, seeds, numSeeds));
+	free(seeds);
+
+	// A flush inside dfaIntern() invalidated s
+	if (d->numStates >= before) {
+		d->states[s].next[c] = t;
+	}
+	return t;
+}
+
+int dfaDead(struct dfa *d, int s) {
+	return d->states[s].count == 0;
+}
+
+/*** matching ***/
+
+// Per thread DFA caches for a compiled regex
+// Also where matches start in the text last searched, found by one
+// right to left pass, so stepping through a row's matches with a growing
+// from doesn't run the reverse DFA over the rest of the row every time
+struct regexCache {
+	struct dfa forward;
+	struct dfa reverse;
+	const char *text; // NULL when there's nothing to reuse
+	int textLen;
+	int lastFrom;
+	int scannedFrom; // no match starts before it
+	uint64_t *starts; // a bit per position at or after scannedFrom
+	int startsCapacity;
+};
+
+void regexFree(struct regex *re) {
+	if (re == NULL) {
+		return;
+	}
+	free(re->forward.states);
+	free(re->reverse.states);
+	free(re->prefix);
+	free(re);
+}
+
+// Returns NULL and sets error if the pattern doesn't compile
+struct regex *regexCompile(const char *pattern, const char **error) {
+	struct regex *re = calloc(1, sizeof(struct regex));
+	int len = strlen(pattern);
+
+	if (len && pattern[0] == '^') {
+		re->anchoredStart = 1;
+		pattern++;
+		len--;
+	}
+	if (len && pattern[len - 1] == '$') {
+		// Unless it's escaped
+		int backslashes = 0;
+		while (backslashes < len - 1 && pattern[len - 2 - backslashes] == '\\') {
+			backslashes++;
+		}
+		if (backslashes % 2 == 0) {
+			re->anchoredEnd = 1;
+			len--;
+		}
+	}
+
+	if (regexBuildNfa(&re->forward, pattern, len, 0, error) == -1 ||
+		regexBuildNfa(&re->reverse, pattern, len, 1, error) == -1) {
+		regexFree(re);
+		return NULL;
+	}
+
+	// Every row would match at every column
+	struct dfa d;
+	dfaInit(&d, &re->forward, 0);
+	int nullable = d.states[dfaStart(&d)].accepting;
+	dfaFree(&d);
+	if (nullable) {
+		*error = "matches the empty string";
+		regexFree(re);
+		return NULL;
+	}
+
+	re->prefix = regexLiteralPrefix(pattern, len);
+	searchCompile(&re->prefixPattern, re->prefix, strlen(re->prefix));
+	return re;
+}
+
+void regexCacheInit(struct regexCache *c, const struct regex *re) {
+	dfaInit(&c->forward, &re->forward, 0);
+	dfaInit(&c->reverse, &re->reverse, !re->anchoredEnd);
+	c->text = NULL;
+	c->starts = NULL;
+	c->startsCapacity = 0;
+}
+
+void regexCacheFree(struct regexCache *c) {
+	dfaFree(&c->forward);
+	dfaFree(&c->reverse);
+	free(c->starts);
+}
+
+// The text last searched may have changed in place, search it afresh
+void regexCacheForget(struct regexCache *c) {
+	c->text = NULL;
+}
+
+// Runs the reversed pattern right to left from the end of s down to lo,
+// each accepting position is somewhere a match starts
+void regexScanStarts(struct regexCache *c, const char *s, int len, int lo) {
+	int words = (len + 63) / 64;
+	if (words > c->startsCapacity) {
+		c->startsCapacity = words * 2;
+		free(c->starts);
+		c->starts = malloc(sizeof(uint64_t) * c->startsCapacity);
+	}
+	memset(&c->starts[lo / 64], 0, sizeof(uint64_t) * (words - lo / 64));
+
+	struct dfa *d = &c->reverse;
+	int state = dfaStart(d);
+	int j;
+	for (j = len - 1; j >= lo; j--) {
+		state = dfaStep(d, state, s[j]);
+		if (dfaDead(d, state)) {
+			break;
+		}
+		if (d->states[state].accepting) {
+			c->starts[j / 64] |= 1ULL << (j % 64);
+		}
+	}
+	c->text = s;
+	c->textLen = len;
+	c->scannedFrom = lo;
+}
+
+// First position at or after from where a match starts, or -1
+int regexNextStart(const struct regexCache *c, int from) {
+	if (from < c->scannedFrom) {
+		from = c->scannedFrom;
+	}
+	if (from >= c->textLen) {
+		return -1;
+	}
+	int w = from / 64;
+	uint64_t bits = c->starts[w] & (~0ULL << (from % 64));
+	int words = (c->textLen + 63) / 64;
+	while (bits == 0) {
+		if (++w == words) {
+			return -1;
+		}
+		bits = c->starts[w];
+	}
+	return w * 64 + __builtin_ctzll(bits);
+}
+
+// End of the longest match starting at from, or -1
+int regexLongest(const struct regex *re, struct dfa *d, const char *s, int len, int from) {
+	int state = dfaStart(d);
+	int end = -1;
+	int j;
+	for (j = from; j < len; j++) {
+		state = dfaStep(d, state, s[j]);
+		if (dfaDead(d, state)) {
+			break;
+		}
+		if (d->states[state].accepting && (!re->anchoredEnd || j + 1 == len)) {
+			end = j + 1;
+		}
+	}
+	return end;
+}
+
+// Finds the leftmost-longest match starting at or after from
+// Returns its column and sets matchLen, or returns -1
+// Searching the same text again with a later from, as when going
+// through a row's matches, reuses the starts found the first time
+int regexSearch(const struct regex *re, struct regexCache *c, const char *s, int len, int from, int *matchLen) {
+	int start;
+
+	if (re->anchoredStart) {
+		if (from > 0) {
+			return -1;
+		}
+		start = 0;
+	} else {
+		if (c->text != s || c->textLen != len || from <= c->lastFrom) {
+			// Every match begins with the prefix, skip straight to it
+			int lo = from;
+			if (re->prefixPattern.len) {
+				long at = searchFind(&re->prefixPattern, s + from, len - from);
+				if (at == -1) {
+					c->text = NULL;
+					return -1;
+				}
+				lo = from + at;
+			}
+			regexScanStarts(c, s, len, lo);
+		}
+		c->lastFrom = from;
+		start = regexNextStart(c, from);
+		if (start == -1) {
+			return -1;
+		}
+	}
+
+	int end = regexLongest(re, &c->forward, s, len, start);
+	if (end == -1) {
+		return -1;
+	}
+	*matchLen = end - start;
+	return start;
+}
+
+#endif
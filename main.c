@@ -0,0 +1,326 @@
+// The terminal front end: puts the terminal in raw mode and runs one
+// editor from libmio on it until it quits
+// mio -b runs a script of edits over files instead, in worker processes
+// that each have a headless editor of their own
+
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
+#include <errno.h> // errno
+#include <fcntl.h> // open(), O_WRONLY, O_NOCTTY, O_NONBLOCK
+#include <signal.h> // sigaction(), SIGUSR1
+#include <stdarg.h> // va_list, va_start(), va_end()
+#include <stdio.h> // perror(), sscanf(), fopen(), fread(), getline(), vsnprintf()
+#include <stdlib.h> // atexit(), exit(), malloc(), realloc(), free()
+#include <string.h> // strcmp(), memset(), strdup(), strerror()
+#include <sys/ioctl.h> // ioctl(), TIOCGWINSZ, struct winsize
+#include <sys/wait.h> // wait(), WIFEXITED(), WEXITSTATUS()
+#include <termios.h> // tcgetattr(), tcsetattr()
+#include <unistd.h> // write(), read(), fork(), sysconf(), STDIN_FILENO, STDOUT_FILENO, ttyname()
+
+#include "mio.h"
+#include "config.h"
+
+struct termios origTermios;
+
+void terminalDie(const char *s) {
+    write(STDOUT_FILENO, "\x1b[2j", 4);
+    write(STDOUT_FILENO, "\x1b[H", 3);
+    perror(s);
+    exit(1);
+}
+
+// Reset the terminal's attributes on quit
+void disableRawMode() {
+	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &origTermios) == -1) {
+	    terminalDie("tcsetattr");
+	}
+}
+
+// Returns the descriptor frames should be written to
+int enableRawMode() {
+	if (tcgetattr(STDIN_FILENO, &origTermios) == -1) {
+	    terminalDie("tcgetattr");
+	}
+	atexit(disableRawMode);
+
+	struct termios raw =  origTermios;
+	raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+	raw.c_oflag &= ~(OPOST);
+	raw.c_cflag |= (CS8);
+	raw.c_lflag &= ~(ECHO | ICANON | IEXTEN  | ISIG);
+	raw.c_cc[VMIN] = 0;  // min # of bytes needed before read() returns
+	raw.c_cc[VTIME] = 1; // max about of time for read() to wait before returning
+
+	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
+	    terminalDie("tcsetattr");
+	}
+
+	// Frames go out through a separate non-blocking descriptor so a slow
+	// terminal can't stall input; stdin keeps its VMIN/VTIME behaviour
+	char *tty = ttyname(STDOUT_FILENO);
+	int outFd = tty ? open(tty, O_WRONLY | O_NOCTTY | O_NONBLOCK) : -1;
+	return (outFd == -1) ? STDOUT_FILENO : outFd;
+}
+
+int getCursorPosition(int *rows, int *cols) {
+
+    char buf[32];
+    unsigned int i = 0;
+
+    // n queries the terminal for status information
+    // 6 gives cursor position
+    if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) {
+        return -1;
+    }
+
+    while (i < sizeof(buf) - 1) {
+        if (read(STDIN_FILENO, &buf[i], 1) != 1) {
+            break;
+        }
+        if (buf[i] == 'R') {
+            break;
+        }
+        i++;
+    }
+    buf[i] = '\0';
+
+    if (buf[0] != '\x1b' || buf[1] != '[') {
+        return -1;
+    }
+
+    if (sscanf(&buf[2], "%d;%d", rows, cols) != 2) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int getWindowSize(int *rows, int *cols) {
+    struct winsize ws;
+
+    // Use ioctl or manually determine window size
+    // C means Cursor Forwards (moves us to the right)
+    // B means Cursor Down (moves us down)
+    // 999 ensures we go all the way right and down
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+        if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) {
+            return -1;
+        }
+        return getCursorPosition(rows, cols);
+    } else {
+        *cols = ws.ws_col;
+        *rows = ws.ws_row;
+        return 0;
+    }
+}
+
+void onStatsSignal(int sig) {
+	(void)sig;
+	mioStatsRequestDump();
+}
+
+// Returns the whole of fp, NUL terminated, for the caller to free
+char *batchReadAll(FILE *fp) {
+	size_t capacity = 4096;
+	size_t len = 0;
+	char *text = malloc(capacity);
+	size_t n;
+	while ((n = fread(text + len, 1, capacity - len - 1, fp)) > 0) {
+		len += n;
+		if (len + 1 == capacity) {
+			capacity *= 2;
+			text = realloc(text, capacity);
+		}
+	}
+	text[len] = '\0';
+	return text;
+}
+
+// Prints a line with one write() so the workers' lines don't mix
+void batchReport(int fd, const char *fmt, ...) {
+	char buf[1024];
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (len >= (int)sizeof(buf)) {
+		len = sizeof(buf) - 1;
+		buf[len - 1] = '\n';
+	}
+	write(fd, buf, len);
+}
+
+// Runs the script over every step-th file from first with one headless
+// editor, returns 1 if any of them failed
+int batchFiles(struct mioScript *script, char **names, int count, int first, int step) {
+	struct mio *ed = mioNew(-1, -1, 0, 0);
+	if (ed == NULL) {
+		perror("mioNew");
+		return 1;
+	}
+	int failed = 0;
+	int j;
+	for (j = first; j < count; j += step) {
+		char error[256];
+		int changes = mioScriptRun(ed, script, names[j], error, sizeof(error));
+		if (changes == -1) {
+			batchReport(STDERR_FILENO, "mio: %s: %s\n", names[j], error);
+			failed = 1;
+		} else {
+			batchReport(STDOUT_FILENO, "%s: %d %s\n", names[j], changes, (changes == 1) ? "change" : "changes");
+		}
+	}
+	mioFree(ed);
+	return failed;
+}
+
+// mio -b script [file...]: the script is read from stdin if it's -, the
+// file names are, one per line, if none are named
+// The files are spread over BATCH_JOBS processes, each taking every
+// jobs-th one; returns the exit status
+int batchMain(const char *scriptPath, int fileCount, char **files) {
+	FILE *fp = strcmp(scriptPath, "-") ? fopen(scriptPath, "r") : stdin;
+	if (fp == NULL) {
+		fprintf(stderr, "mio: %s: %s\n", scriptPath, strerror(errno));
+		return 2;
+	}
+	if (fileCount == 0 && fp == stdin) {
+		fprintf(stderr, "mio: name the files when the script is read from stdin\n");
+		return 2;
+	}
+	char *text = batchReadAll(fp);
+	if (fp != stdin) {
+		fclose(fp);
+	}
+	char error[256];
+	struct mioScript *script = mioScriptParse(text, error, sizeof(error));
+	free(text);
+	if (script == NULL) {
+		fprintf(stderr, "mio: %s\n", error);
+		return 2;
+	}
+
+	char **names = files;
+	if (fileCount == 0) {
+		int capacity = 0;
+		char *line = NULL;
+		size_t lineCap = 0;
+		ssize_t lineLen;
+		names = NULL;
+		while ((lineLen = getline(&line, &lineCap, stdin)) != -1) {
+			if (lineLen > 0 && line[lineLen - 1] == '\n') {
+				line[--lineLen] = '\0';
+			}
+			if (lineLen == 0) {
+				continue;
+			}
+			if (fileCount == capacity) {
+				capacity = capacity ? capacity * 2 : 64;
+				names = realloc(names, sizeof(char *) * capacity);
+			}
+			names[fileCount++] = strdup(line);
+		}
+		free(line);
+	}
+
+	int jobs = BATCH_JOBS;
+	if (jobs <= 0) {
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (jobs > fileCount) {
+		jobs = fileCount;
+	}
+
+	int status = 0;
+	if (jobs <= 1) {
+		status = batchFiles(script, names, fileCount, 0, 1);
+	} else {
+		// No editor exists yet, so there are no worker threads to fork with
+		fflush(stdout);
+		int job;
+		for (job = 0; job < jobs; job++) {
+			pid_t pid = fork();
+			if (pid == -1) {
+				perror("fork");
+				status = 1;
+				break;
+			}
+			if (pid == 0) {
+				_exit(batchFiles(script, names, fileCount, job, jobs));
+			}
+		}
+		int childStatus;
+		while (wait(&childStatus) != -1) {
+			if (!WIFEXITED(childStatus) || WEXITSTATUS(childStatus) != 0) {
+				status = 1;
+			}
+		}
+	}
+
+	mioScriptFree(script);
+	if (names != files) {
+		int j;
+		for (j = 0; j < fileCount; j++) {
+			free(names[j]);
+		}
+		free(names);
+	}
+	return status;
+}
+
+int main(int argc, char *argv[]) {
+	// Batch mode never touches the terminal
+	if (argc >= 3 && !strcmp(argv[1], "-b")) {
+		return batchMain(argv[2], argc - 3, argv + 3);
+	}
+
+	// kill -USR1 writes out the editor's stats
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = onStatsSignal;
+	action.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &action, NULL);
+
+	int outFd = enableRawMode();
+	int rows;
+	int cols;
+	if (getWindowSize(&rows, &cols) == -1) {
+		terminalDie("getWindowSize");
+	}
+	struct mio *ed = mioNew(STDIN_FILENO, outFd, rows, cols);
+	if (ed == NULL) {
+		terminalDie("mioNew");
+	}
+
+    // Init status message with key bindings
+    // Files that can't be opened replace it with an error
+    mioSetStatus(ed, "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+
+    // Every file named gets a buffer, the first one is shown
+    // Files named after -f are followed as they grow
+    int follow = 0;
+    int j;
+    for (j = 1; j < argc; j++) {
+        if (!strcmp(argv[j], "-f")) {
+            follow = 1;
+            continue;
+        }
+        if (mioOpen(ed, argv[j]) && follow) {
+            mioFollow(ed);
+        }
+    }
+    mioShowBuffer(ed, 0);
+
+	// Main loop, quits on ctrl+q
+	int running;
+	do {
+	    mioRefresh(ed);
+	} while ((running = mioProcessKey(ed)) > 0);
+	if (running == -1) {
+	    terminalDie("read");
+	}
+
+    return 0;
+}
@@ -5,22 +5,30 @@
 #define _GNU_SOURCE
 
 #include <ctype.h> // iscntrl()
+#include <dirent.h> // opendir(), readdir(), closedir(), DT_DIR, DT_REG
 #include <errno.h> // errno, EAGAIN
 #include <fcntl.h> // open(), O_RDWR, O_CREAT
-#include <stdio.h> // printf(), perror(), sscanf(), snprintf(), FILE, fopen(), getline(), vsnprintf()
+#include <stdio.h> // printf(), sscanf(), snprintf(), FILE, fopen(), getline(), vsnprintf()
 #include <stdarg.h> // va_list, va_start(), va_end()
-#include <stdlib.h> // atexit(), exit(), realloc(), free(), malloc()
+#include <stdlib.h> // realloc(), free(), malloc()
+#include <sys/select.h> // select(), fd_set
 #include <string.h> // memcpy(), strlen(), strdup(), memmmove(), strerror(), strstr(), memset(), strchr(), strrchr(), strcmp(), strncmp()
-#include <sys/ioctl.h> // ioctl(), TIOCGWINSZ, struct winsize
-#include <sys/types.h> // ssize_t
-#include <termios.h> // tcgetattr(), tcsetattr()
+#include <sys/inotify.h> // inotify_init1(), inotify_add_watch(), struct inotify_event
+#include <sys/mman.h> // mmap(), munmap()
+#include <sys/stat.h> // fstat(), lstat(), struct stat
+#include <sys/syscall.h> // SYS_gettid
+#include <sys/types.h> // ssize_t, pid_t
 #include <time.h> // time_t, time()
-#include <unistd.h> // write(), STDOUT_FILENO, ftruncate(), close();
+#include <unistd.h> // write(), STDOUT_FILENO, ftruncate(), close()
 #include <inttypes.h> // strtoumax()
+#include <pthread.h> // pthread_create(), pthread_mutex_lock(), pthread_cond_wait()
+#include <signal.h> // sig_atomic_t
 
+#include "mio.h"
 #include "config.h"
-#include "data.h"
 #include "syntax.h"
+#include "search.h"
+#include "dfa.h"
 
 /*** defines ***/
 
@@ -38,32 +46,58 @@ enum editorKey {
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    FILE_CHANGED // the file changed on disk, only returned outside prompts
 };
 
-enum editorHighlight {
-	HL_NORMAL = 0,
-	HL_COMMENT,
-	HL_MLCOMMENT,
-	HL_KEYWORD1,
-	HL_KEYWORD2,
-	HL_STRING,
-	HL_NUMBER,
-	HL_MATCH
+enum undoType {
+	UNDO_SPLICE = 1,  // chars replaced within a row
+	UNDO_INSERT_ROWS,
+	UNDO_DELETE_ROWS,
+	UNDO_REPLACE_ROWS, // a macro run's rows, before and after
+	UNDO_BARRIER       // a macro run too big to record, undo stops here
 };
 
 /*** data ***/
 
+// A tab in a row: its char index and the render column just after it
+struct rowTab {
+    int cx;
+    int rx;
+};
+
+// What whole-buffer passes read, kept small so a scan of the row array
+// streams through as many rows per cache line as it can
+// The rest of a row lives at the same index in E.rowCold
 typedef struct editorRow {
     int index;
     int size;
     int renderSize;
-    char *chars;
-    char *render;
-    unsigned char *highlight;
     int highlight_open_comment;
+    char *chars;
 } editorRow;
 
+// What's only touched for rows being drawn, highlighted or reloaded
+struct rowCold {
+    char *render; // chars itself when there are no tabs to expand
+    unsigned char *highlight;
+    struct rowChunks *chunks; // rows over LONG_ROW chars, which have no render or highlight
+    struct rowTab *tabs; // built with the render, NULL when there are no tabs
+    int tabCount;
+    uint64_t diskHash; // hash of the line on disk it was read as, 0 if none
+};
+
+// The version of the file on disk the buffer was read from or saved as
+struct diskState {
+    int watch; // inotify watch on the file's directory
+    off_t size; // bytes read, when following
+    struct timespec time;
+    ino_t inode;
+    int follow; // new text at the end is read as it's written
+    int partial; // the last row didn't end in a newline yet
+    uint64_t tailHash; // of the last bytes read, to tell a rewrite from an append
+};
+
 struct editorConfig {
     int cx;
     int cy;
@@ -74,83 +108,458 @@ struct editorConfig {
     int screenCols;
     int numRows;
     editorRow *row;
+    struct rowCold *rowCold; // an array of its own, rowCapacity long like row
+    int rowCapacity;
     int dirty;
     char *filename;
     char statusmsg[80];
     time_t statusmsg_time;
     struct editorSyntax *syntax;
-    struct termios orig_termios;
+    int inFd; // keys are read from here
+    int outFd; // non-blocking descriptor frames are written through
+    struct diskState disk;
+    int headless; // batch mode, there's no terminal and nothing is drawn
+    int markSet; // a region runs from the mark to the cursor
+    int markX;
+    int markY;
+    int searchRegex; // Find treats the query as a regex
+    char searchStatus[48]; // shown in the status bar while searching
+    struct searchMatch findLast; // Find's current match, row -1 if none
+    int findDirection;
+    int quitTimes;
+    int killPending;
+    int killUndo; // ^K was the last key, ^Z brings back what it closed
+    int inputError; // errno of the read or select on inFd that failed
+    int quit;
+    char *view; // the columns of a long row on screen, see editorRowView()
+    unsigned char *viewHighlight;
+    int viewCapacity;
+};
+
+// One editor: what would otherwise be globals, so several can run in a
+// process (see mio.h)
+// The parts other than E are defined in the sections that use them, the
+// code reaches them through the calling thread's current editor
+struct mio {
+    struct editorConfig E;
+    struct sparePool *spare;
+    struct undoLog *undo;
+    struct clip *clip;
+    struct cursorList *cursors;
+    struct fileWatch *watch;
+    struct bufferList *buffers;
+    struct searchIndex *index;
+    struct grepSearch *grep;
+    struct outputQueue *output;
+    struct macro *macro;
+    struct undoSpan *span;
+    struct editorStats *stats;
 };
 
-struct editorConfig E;
+__thread struct mio *mioCurrent;
+
+#define E (mioCurrent->E)
+
+struct rowCold *editorRowCold(editorRow *row) {
+	return &E.rowCold[row->index];
+}
 
 /*** prototypes ***/
 
 void editorSetStatusMessage(const char* fmt, ...);
 void editorRefreshScreen();
+void editorReloadCheck();
+int editorWatchWaiting();
+int editorWatchTakeChange();
+int editorFollowRead();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+char *editorPromptEmpty(char *prompt, void (*callback)(char *, int));
+int editorOutputPending();
+int editorFlushOutput();
+void editorDrainOutput();
+void editorIdle();
+void editorIndexReset();
+void editorIndexSettle();
+void editorIndexPause();
+void editorIndexUpdateRow(int at);
+void editorIndexInsertRows(int at, int count);
+void editorIndexDeleteRows(int at, int count);
+void editorUndoSplice(int row, int col, const char *deleted, int delLen, const char *inserted, int insLen);
+void editorUndoRows(int type, int at, int count);
+int editorOpenBuffer(const char *filename);
+int editorReadKey();
+void editorProcessKeypress();
+int editorMacroPlaying();
+int editorChunksHighlight(editorRow *row);
+
+/*** trace ***/
+
+// With MIO_TRACE set to a file, begin and end events around reading
+// keys, handling them, highlighting, drawing and writing go into a ring
+// shared by every thread and editor, which is written out as Chrome
+// trace JSON (chrome://tracing, ui.perfetto.dev) on quit and SIGUSR1
+// Only the last TRACE_EVENTS events are kept
+
+struct traceEvent {
+	uint64_t seq; // ring position + 1 once written, 0 while being written
+	uint64_t ns;
+	const char *name;
+	const char *argName; // NULL for none
+	long arg;
+	int tid;
+	char type; // 'B' or 'E'
+};
 
-/*** terminal  ***/
+struct traceRing {
+	struct traceEvent *events;
+	uint64_t next; // ring position of the next event
+	const char *path;
+};
+
+struct traceRing TR = { NULL, 0, NULL };
+pthread_once_t traceStarted = PTHREAD_ONCE_INIT;
+
+// Bulk operations that would flood the ring with per-row events record
+// one event of their own and mute the ones inside
+__thread int traceMuted;
+__thread int traceTid;
+
+void traceStart() {
+	TR.path = getenv("MIO_TRACE");
+	if (TR.path && *TR.path) {
+		TR.events = calloc(TRACE_EVENTS, sizeof(struct traceEvent));
+	}
+}
+
+void traceEvent(char type, const char *name, const char *argName, long arg) {
+	if (TR.events == NULL || traceMuted) {
+		return;
+	}
+	if (traceTid == 0) {
+		traceTid = syscall(SYS_gettid);
+	}
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	uint64_t at = __atomic_fetch_add(&TR.next, 1, __ATOMIC_RELAXED);
+	struct traceEvent *event = &TR.events[at & (TRACE_EVENTS - 1)];
+	__atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	event->ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	event->name = name;
+	event->argName = argName;
+	event->arg = arg;
+	event->tid = traceTid;
+	event->type = type;
+	__atomic_store_n(&event->seq, at + 1, __ATOMIC_RELEASE);
+}
+
+void traceBegin(const char *name) {
+	traceEvent('B', name, NULL, 0);
+}
+
+void traceEnd(const char *name) {
+	traceEvent('E', name, NULL, 0);
+}
 
-void die(const char *s) {
-    // Clear the screen on exit
-    write(STDOUT_FILENO, "\x1b[2j", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
-    perror(s);
-    exit(1);
+// Ends name with a number to show with it
+void traceEndArg(const char *name, const char *argName, long arg) {
+	traceEvent('E', name, argName, arg);
 }
 
-// Reset the terminal's attributes on quit
-void disableRawMode() {
-	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1) {
-	    die("tcsetattr");
+// Writes the events in the ring to path, events being written as it's
+// read are left out
+// Returns -1 if it can't be written or tracing is off
+int traceWrite(const char *path) {
+	if (TR.events == NULL) {
+		return -1;
+	}
+	FILE *fp = fopen(path, "w");
+	if (fp == NULL) {
+		return -1;
+	}
+
+	uint64_t end = __atomic_load_n(&TR.next, __ATOMIC_ACQUIRE);
+	uint64_t at = (end > TRACE_EVENTS) ? end - TRACE_EVENTS : 0;
+	int pid = getpid();
+	int count = 0;
+	fprintf(fp, "{\"traceEvents\": [\n");
+	for (; at < end; at++) {
+		struct traceEvent *slot = &TR.events[at & (TRACE_EVENTS - 1)];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != at + 1) {
+			continue;
+		}
+		struct traceEvent event = *slot;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != at + 1) {
+			continue;
+		}
+
+		fprintf(fp, "%s{\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %.3f, \"pid\": %d, \"tid\": %d",
+			count++ ? ",\n" : "", event.name, event.type, event.ns / 1e3, pid, event.tid);
+		if (event.argName) {
+			fprintf(fp, ", \"args\": {\"%s\": %ld}", event.argName, event.arg);
+		}
+		fputc('}', fp);
 	}
+	fprintf(fp, "\n], \"displayTimeUnit\": \"ms\"}\n");
+	fclose(fp);
+	return 0;
+}
+
+/*** stats ***/
+
+// Always-on counters and per-phase timings, cheap enough to leave in:
+// a counter is an add and a phase switch two clock reads
+// ^_ shows the last cycle's numbers on the message bar, a cycle running
+// from one frame to the next; SIGUSR1 appends the totals to a file
+
+enum statCounter {
+	STAT_KEYS,
+	STAT_FRAMES,
+	STAT_FRAME_BYTES,   // queued by editorRefreshScreen()
+	STAT_ROWS_RENDERED,
+	STAT_SYNTAX_CALLS,  // syntax updates, single rows or batches
+	STAT_SYNTAX_ROWS,   // rows they highlighted, cascades included
+	STAT_ALLOCS,        // made by row, undo and frame building
+	STAT_COUNTERS
+};
+
+const char *statCounterNames[STAT_COUNTERS] = {
+	"keys", "frames", "frame_bytes", "rows_rendered", "syntax_calls", "syntax_rows", "allocs"
+};
+
+enum statPhase {
+	PHASE_NONE = -1, // waiting for a key, not timed
+	PHASE_INPUT,     // reading the key once it's arrived
+	PHASE_EDIT,
+	PHASE_HIGHLIGHT,
+	PHASE_DRAW,
+	PHASE_WRITE,
+	PHASES
+};
+
+const char *statPhaseNames[PHASES] = { "input", "edit", "highlight", "draw", "write" };
+
+struct editorStats {
+	long counters[STAT_COUNTERS];
+	int cascadeMax; // most rows one syntax update went through
+	double phaseTotal[PHASES];
+	double phaseMax[PHASES]; // in one cycle
+	int phase;
+	double since; // when phase was switched to
+	long cycleStart[STAT_COUNTERS];
+	double cycle[PHASES];
+	int cycleCascade;
+	long lastCounters[STAT_COUNTERS];
+	double last[PHASES];
+	int lastCascade;
+	int overlay;
+	int dumps; // of statsDumpRequests seen
+	long renderShared; // bytes of rows drawn straight from their chars, not copied
+};
+
+#define ST (*mioCurrent->stats)
+
+// Bumped from signal handlers, every editor dumps once it sees a change
+volatile sig_atomic_t statsDumpRequests = 0;
+
+double statsNow() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-void enableRawMode() {
-	if (tcgetattr(STDIN_FILENO, &E.orig_termios) == -1) {
-	    die ("tcgetattr");
+void statsAdd(int counter, long n) {
+	ST.counters[counter] += n;
+}
+
+// Charges the time since the last switch to the phase being left
+// Returns that phase, for switching back to
+int statsSwitch(int phase) {
+	int previous = ST.phase;
+	if (phase == previous) {
+		return previous;
 	}
-	atexit(disableRawMode);
+	double now = statsNow();
+	if (previous != PHASE_NONE) {
+		ST.cycle[previous] += now - ST.since;
+	}
+	ST.phase = phase;
+	ST.since = now;
+	return previous;
+}
 
-	struct termios raw =  E.orig_termios;
-	raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
-	raw.c_oflag &= ~(OPOST);
-	raw.c_cflag |= (CS8);
-	raw.c_lflag &= ~(ECHO | ICANON | IEXTEN  | ISIG);
-	raw.c_cc[VMIN] = 0;  // min # of bytes needed before read() returns
-	raw.c_cc[VTIME] = 1; // max about of time for read() to wait before returning
+// Counts one syntax update that highlighted rows rows
+void statsSyntax(int rows) {
+	ST.counters[STAT_SYNTAX_CALLS]++;
+	ST.counters[STAT_SYNTAX_ROWS] += rows;
+	if (rows > ST.cycleCascade) {
+		ST.cycleCascade = rows;
+	}
+	if (rows > ST.cascadeMax) {
+		ST.cascadeMax = rows;
+	}
+}
 
-	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
-	    die("tcsetattr");
+// Called as each frame starts, the cycle that ends becomes the last one
+void statsEndCycle() {
+	int j;
+	for (j = 0; j < PHASES; j++) {
+		ST.last[j] = ST.cycle[j];
+		ST.phaseTotal[j] += ST.cycle[j];
+		if (ST.cycle[j] > ST.phaseMax[j]) {
+			ST.phaseMax[j] = ST.cycle[j];
+		}
+		ST.cycle[j] = 0;
+	}
+	for (j = 0; j < STAT_COUNTERS; j++) {
+		ST.lastCounters[j] = ST.counters[j] - ST.cycleStart[j];
+		ST.cycleStart[j] = ST.counters[j];
 	}
+	ST.lastCascade = ST.cycleCascade;
+	ST.cycleCascade = 0;
 }
 
-// Waits for a keypress and returns it
-int editorReadKey() {
+// The overlay: the last cycle's phases in us, syntax updates and the
+// deepest one, rows rendered, frame bytes and allocations, and the
+// render memory saved so far
+int statsFormat(char *buf, size_t size) {
+	int len = snprintf(buf, size, "in %.0f ed %.0f hl %.0f dr %.0f wr %.0fus  syn %ld/%d rend %ld out %ldB alloc %ld shared %ldK",
+		ST.last[PHASE_INPUT] * 1e6, ST.last[PHASE_EDIT] * 1e6, ST.last[PHASE_HIGHLIGHT] * 1e6,
+		ST.last[PHASE_DRAW] * 1e6, ST.last[PHASE_WRITE] * 1e6,
+		ST.lastCounters[STAT_SYNTAX_CALLS], ST.lastCascade, ST.lastCounters[STAT_ROWS_RENDERED],
+		ST.lastCounters[STAT_FRAME_BYTES], ST.lastCounters[STAT_ALLOCS], ST.renderShared / 1024);
+	return (len >= (int)size) ? (int)size - 1 : len;
+}
+
+const char *statsPath() {
+	const char *path = getenv("MIO_STATS");
+	return path ? path : STATS_FILE;
+}
+
+// Appends the totals to path, returns -1 if it can't be written
+int statsDump(const char *path) {
+	FILE *fp = fopen(path, "a");
+	if (fp == NULL) {
+		return -1;
+	}
+	fprintf(fp, "mio %d %s\n", (int)getpid(), E.filename ? E.filename : "[No Name]");
+	int j;
+	for (j = 0; j < STAT_COUNTERS; j++) {
+		fprintf(fp, "%-14s %ld\n", statCounterNames[j], ST.counters[j]);
+	}
+	fprintf(fp, "%-14s %d\n", "cascade_max", ST.cascadeMax);
+	fprintf(fp, "%-14s %ld\n", "render_shared", ST.renderShared);
+
+	long cycles = ST.counters[STAT_FRAMES] ? ST.counters[STAT_FRAMES] : 1;
+	fprintf(fp, "%-14s %12s %12s %12s\n", "phase", "total_ms", "mean_ms", "max_ms");
+	for (j = 0; j < PHASES; j++) {
+		fprintf(fp, "%-14s %12.3f %12.4f %12.3f\n", statPhaseNames[j],
+			ST.phaseTotal[j] * 1e3, ST.phaseTotal[j] * 1e3 / cycles, ST.phaseMax[j] * 1e3);
+	}
+	fprintf(fp, "\n");
+	fclose(fp);
+	return 0;
+}
+
+// Dumps the stats if a signal asked for it since the last time
+// Returns 1 if it did, the message bar says so
+int statsPoll() {
+	int requests = statsDumpRequests;
+	if (requests == ST.dumps) {
+		return 0;
+	}
+	ST.dumps = requests;
+	if (statsDump(statsPath()) == -1) {
+		editorSetStatusMessage("Can't write stats to %s: %s", statsPath(), strerror(errno));
+	} else {
+		editorSetStatusMessage("Stats written to %s", statsPath());
+	}
+	if (TR.events) {
+		traceWrite(TR.path);
+	}
+	return 1;
+}
+
+/*** terminal  ***/
+
+// Blocks until a key can be read, feeding queued output to the
+// terminal whenever it's ready to take more
+// Returns -1 with errno set if select() fails
+int editorWaitForInput() {
+    while (editorOutputPending()) {
+        fd_set readFds;
+        fd_set writeFds;
+        FD_ZERO(&readFds);
+        FD_ZERO(&writeFds);
+        FD_SET(E.inFd, &readFds);
+        FD_SET(E.outFd, &writeFds);
+
+        int maxFd = (E.outFd > E.inFd) ? E.outFd : E.inFd;
+        if (select(maxFd + 1, &readFds, &writeFds, NULL, NULL) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        if (FD_ISSET(E.outFd, &writeFds)) {
+            int previous = statsSwitch(PHASE_WRITE);
+            editorFlushOutput();
+            statsSwitch(previous);
+        }
+        if (FD_ISSET(E.inFd, &readFds)) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+// Waits for a key from the terminal and returns it
+// Once the terminal can't be read every key is ESC, which backs out of
+// any prompt, and mioProcessKey() reports the error
+int editorReadTerminalKey() {
     int nread;
     char c;
 
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
+    if (E.inputError || editorWaitForInput() == -1) {
+        E.inputError = E.inputError ? E.inputError : errno;
+        return '\x1b';
+    }
+    while ((nread = read(E.inFd, &c, 1)) != 1) {
         if (nread == -1 && errno != EAGAIN) {
-            die("read");
+            E.inputError = errno;
+            return '\x1b';
+        }
+        if (nread == 0) {
+            editorIdle();
+            // Inside a prompt the change waits until it's closed
+            if (editorWatchWaiting() && editorWatchTakeChange()) {
+                return FILE_CHANGED;
+            }
+            if (editorWaitForInput() == -1) {
+                E.inputError = errno;
+                return '\x1b';
+            }
         }
     }
+    statsSwitch(PHASE_INPUT);
 
     if (c == '\x1b') {
         char seq[3];
 
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) {
+        if (read(E.inFd, &seq[0], 1) != 1) {
             return '\x1b';
         }
 
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) {
+        if (read(E.inFd, &seq[1], 1) != 1) {
             return '\x1b';
         }
 
         if (seq[0] == '[') {
             if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) {
+                if (read(E.inFd, &seq[2], 1) != 1) {
                     return '\x1b';
                 }
 
@@ -188,72 +597,51 @@ int editorReadKey() {
     }
 }
 
-int getCursorPosition(int *rows, int *cols) {
-
-    char buf[32];
-    unsigned int i = 0;
-
-    // n queries the terminal for status information
-    // 6 gives cursor position
-    if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) {
-        return -1;
-    }
-
-    while (i < sizeof(buf) - 1) {
-        if (read(STDIN_FILENO, &buf[i], 1) != 1) {
-            break;
-        }
-        if (buf[i] == 'R') {
-            break;
-        }
-        i++;
-    }
-    buf[i] = '\0';
-
-    if (buf[0] != '\x1b' || buf[1] != '[') {
-        return -1;
-    }
-
-    if (sscanf(&buf[2], "%d;%d", rows, cols) != 2) {
-        return -1;
-    }
+/*** syntax highlighting ***/
 
-    return 0;
+int is_separator(int c) {
+	return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
 }
 
-int getWindowSize(int *rows, int *cols) {
-    struct winsize ws;
+// Where the highlighter is in a row, all it needs to carry on from there
+struct lexState {
+	int inComment;  // inside a multi-line comment
+	int inString;   // the quote that opened the string, 0 if none
+	int lineComment; // the rest of the row is a comment
+	int prevSeparator;
+	unsigned char prevHighlight;
+	int skip;       // columns the last token ran on past the span
+	unsigned char skipHighlight;
+};
 
-    // Use ioctl or manually determine window size
-    // C means Cursor Forwards (moves us to the right)
-    // B means Cursor Down (moves us down)
-    // 999 ensures we go all the way right and down
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
-        if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) {
-            return getCursorPosition(rows, cols);
-        }
-        editorReadKey();
-        return -1;
-    } else {
-        *cols = ws.ws_col;
-        *rows = ws.ws_row;
-        return 0;
-    }
+// The state a row starts in
+struct lexState lexRowStart(editorRow *row) {
+	struct lexState state = { 0, 0, 0, 1, HL_NORMAL, 0, HL_NORMAL };
+	state.inComment = (row->index > 0 && E.row[row->index - 1].highlight_open_comment);
+	return state;
 }
 
-/*** syntax highlighting ***/
-
-int is_separator(int c) {
-	return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+int lexStateEqual(const struct lexState *a, const struct lexState *b) {
+	return a->inComment == b->inComment && a->inString == b->inString &&
+		a->lineComment == b->lineComment && a->prevSeparator == b->prevSeparator &&
+		a->prevHighlight == b->prevHighlight && a->skip == b->skip && a->skipHighlight == b->skipHighlight;
 }
 
-void editorUpdateSyntax(editorRow *row) {
-	row->highlight = realloc(row->highlight, row->renderSize);
-	memset(row->highlight, HL_NORMAL, row->renderSize);
+// Highlights len rendered columns from state, leaving state as it is
+// after them
+// render holds avail >= len columns and a NUL, the ones past len are
+// only looked at to finish a token that starts inside the span; hl
+// needs room for avail
+void editorLexSpan(const char *render, int len, int avail, unsigned char *hl, struct lexState *state) {
+	memset(hl, HL_NORMAL, len);
 
 	if (E.syntax == NULL) {
 		return;
 	}
+	if (state->lineComment) {
+		memset(hl, HL_COMMENT, len);
+		return;
+	}
 
 	char **keywords = E.syntax->keywords;
 
@@ -265,28 +653,34 @@ void editorUpdateSyntax(editorRow *row) {
 	int multi_comment_start_length = multi_comment_start ? strlen(multi_comment_start) : 0;
 	int multi_comment_end_length = multi_comment_end ? strlen(multi_comment_end) : 0;
 
-	int prev_separator = 1;
-	int in_string = 0;
-	int in_comment = (row->index > 0 && E.row[row->index - 1].highlight_open_comment);
+	int prev_separator = state->prevSeparator;
+	int in_string = state->inString;
+	int in_comment = state->inComment;
+
+	// The end of a token the last span started
+	int i = (state->skip < len) ? state->skip : len;
+	memset(hl, state->skipHighlight, i);
+	state->skip -= i;
 
-	int i = 0;
 	//for (i = 0; i < row->renderSize; i++) {
-	while(i < row->renderSize) {
-		char c = row->render[i];
-		unsigned char prev_highlight = (i > 0) ? row->highlight[i - 1] : HL_NORMAL;
+	while(i < len) {
+		char c = render[i];
+		unsigned char prev_highlight = (i > 0) ? hl[i - 1] : state->prevHighlight;
 
 		if (single_comments_length && !in_string && !in_comment) {
-			if (!strncmp(&row->render[i], single_comments, single_comments_length)) {
-				memset(&row->highlight[i], HL_COMMENT, row->renderSize - i);
+			if (!strncmp(&render[i], single_comments, single_comments_length)) {
+				memset(&hl[i], HL_COMMENT, len - i);
+				state->lineComment = 1;
+				i = len;
 				break;
 			}
 		}
 
 		if (multi_comment_start_length && multi_comment_end_length && !in_string) {
 			if (in_comment) {
-				row->highlight[i] = HL_MLCOMMENT;
-				if (!strncmp(&row->render[i], multi_comment_end, multi_comment_end_length)) {
-					memset(&row->highlight[i], HL_MLCOMMENT, multi_comment_end_length);
+				hl[i] = HL_MLCOMMENT;
+				if (!strncmp(&render[i], multi_comment_end, multi_comment_end_length)) {
+					memset(&hl[i], HL_MLCOMMENT, multi_comment_end_length);
 					i += multi_comment_end_length;
 					in_comment = 0;
 					prev_separator = 1;
@@ -295,8 +689,8 @@ void editorUpdateSyntax(editorRow *row) {
 					i++;
 					continue;
 				}
-			} else if (!strncmp(&row->render[i], multi_comment_start, multi_comment_start_length)) {
-				memset(&row->highlight[i], HL_MLCOMMENT, multi_comment_start_length);
+			} else if (!strncmp(&render[i], multi_comment_start, multi_comment_start_length)) {
+				memset(&hl[i], HL_MLCOMMENT, multi_comment_start_length);
 				i += multi_comment_start_length;
 				in_comment = 1;
 				continue;
@@ -305,9 +699,9 @@ void editorUpdateSyntax(editorRow *row) {
 
 		if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
 			if (in_string) {
-				row->highlight[i] = HL_STRING;
-				if (c == '\\' && i + 1 < row->renderSize) {
-					row->highlight[i + 1] = HL_STRING;
+				hl[i] = HL_STRING;
+				if (c == '\\' && i + 1 < avail) {
+					hl[i + 1] = HL_STRING;
 					i += 2;
 					continue;
 				}
@@ -320,7 +714,7 @@ void editorUpdateSyntax(editorRow *row) {
 			} else {
 				if (c == '"' || c == '\'') {
 					in_string = c;
-					row->highlight[i] = HL_STRING;
+					hl[i] = HL_STRING;
 					i++;
 					continue;
 				}
@@ -329,7 +723,7 @@ void editorUpdateSyntax(editorRow *row) {
 
 		if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
 			if ((isdigit(c) && (prev_separator || prev_highlight == HL_NUMBER)) || (c == '.' && prev_highlight == HL_NUMBER)) {
-				row->highlight[i] = HL_NUMBER;
+				hl[i] = HL_NUMBER;
 				i++;
 				prev_separator = 0;
 				continue;
@@ -345,8 +739,8 @@ void editorUpdateSyntax(editorRow *row) {
 					keyLen--;
 				}
 
-				if (!strncmp(&row->render[i], keywords[j], keyLen) && is_separator(row->render[i+keyLen])) {
-					memset(&row->highlight[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, keyLen);
+				if (!strncmp(&render[i], keywords[j], keyLen) && is_separator(render[i+keyLen])) {
+					memset(&hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, keyLen);
 					i += keyLen;
 					break;
 				}
@@ -361,11 +755,55 @@ void editorUpdateSyntax(editorRow *row) {
 		i++;
 	}
 
-	int changed = (row->highlight_open_comment != in_comment);
-	row->highlight_open_comment = in_comment;
-	if (changed && row->index + 1 < E.numRows) {
-		editorUpdateSyntax(&E.row[row->index + 1]);
+	// A token that ran on past the span is finished by the next one
+	if (i > len) {
+		state->skip = i - len;
+		state->skipHighlight = hl[len];
 	}
+	if (len > 0) {
+		state->prevHighlight = hl[len - 1];
+	}
+	state->prevSeparator = prev_separator;
+	state->inString = in_string;
+	state->inComment = in_comment;
+}
+
+// Highlights one row, returns 1 if whether a comment is left open at
+// its end changed, so the next row needs highlighting again
+int editorHighlightRow(editorRow *row) {
+	struct rowCold *cold = editorRowCold(row);
+	if (cold->chunks) {
+		return editorChunksHighlight(row);
+	}
+	cold->highlight = realloc(cold->highlight, row->renderSize);
+	statsAdd(STAT_ALLOCS, 1);
+
+	struct lexState state = lexRowStart(row);
+	editorLexSpan(cold->render, row->renderSize, row->renderSize, cold->highlight, &state);
+	if (E.syntax == NULL) {
+		return 0;
+	}
+
+	int changed = (row->highlight_open_comment != state.inComment);
+	row->highlight_open_comment = state.inComment;
+	return changed;
+}
+
+// Highlights the row and the rows after it for as long as an opened or
+// closed comment carries on down
+void editorUpdateSyntax(editorRow *row) {
+	if (E.headless) {
+		return;
+	}
+	int previous = statsSwitch(PHASE_HIGHLIGHT);
+	traceBegin("editorUpdateSyntax");
+	int at = row->index;
+	while (editorHighlightRow(&E.row[at]) && ++at < E.numRows) {
+	}
+	int rows = at - row->index + (at < E.numRows);
+	statsSyntax(rows);
+	traceEndArg("editorUpdateSyntax", "rows", rows);
+	statsSwitch(previous);
 }
 
 int editorSyntaxToColor(int highlight) {
@@ -411,10 +849,16 @@ void editorSelectSyntaxHighlight() {
 			if ((is_extension && extension && !strcmp(extension, s->filematch[i])) || (!is_extension && strstr(E.filename, s->filematch[i]))) {
 				E.syntax = s;
 
+				int previous = statsSwitch(PHASE_HIGHLIGHT);
+				traceBegin("editorSelectSyntaxHighlight");
+				traceMuted++;
 				int fileRow;
 				for (fileRow = 0; fileRow < E.numRows; fileRow++) {
 					editorUpdateSyntax(&E.row[fileRow]);
 				}
+				traceMuted--;
+				traceEndArg("editorSelectSyntaxHighlight", "rows", E.numRows);
+				statsSwitch(previous);
 
 				return;
 			}
@@ -423,135 +867,873 @@ void editorSelectSyntaxHighlight() {
 	}
 }
 
-/*** row operations  ***/
+/*** memory ***/
+
+// Large blocks (row arrays, undo logs) left by killed buffers are kept
+// here for the next buffer that needs one, rather than handed back to
+// malloc and asked for again
+// A row array and its cold halves are kept as a pair, which only goes to
+// a request for a pair; size is the first block's
+struct spareBlock {
+	void *ptr;
+	void *pair; // NULL for a block on its own
+	size_t size;
+};
 
-// Convers the char index to a render index
-int editorRowCxToRx(editorRow *row, int cx) {
-    int rx = 0;
-    int j = 0;
-    for (j = 0; j < cx; j++) {
-        if (row->chars[j] == '\t') {
-            rx += (TAB_STOP - 1) - (rx % TAB_STOP);
-        }
-        rx++;
-    }
-    return rx;
-}
+struct sparePool {
+	struct spareBlock blocks[SPARE_BLOCKS];
+	int count;
+};
 
-int editorRowRxToCx(editorRow *row, int rx) {
-	int cur_rx = 0;
-	int cx;
+#define SP (*mioCurrent->spare)
 
-	for (cx = 0; cx < row->size; cx++) {
-		if (row->chars[cx] == '\t') {
-			cur_rx += (TAB_STOP - 1) - (cur_rx % TAB_STOP);
+void spareGive(void *ptr, void *pair, size_t size) {
+	if (ptr == NULL) {
+		free(pair);
+		return;
+	}
+	if (SP.count < SPARE_BLOCKS) {
+		SP.blocks[SP.count].ptr = ptr;
+		SP.blocks[SP.count].pair = pair;
+		SP.blocks[SP.count].size = size;
+		SP.count++;
+		return;
+	}
+
+	// Full, keep the bigger of the block and the smallest spare
+	int smallest = 0;
+	int j;
+	for (j = 1; j < SP.count; j++) {
+		if (SP.blocks[j].size < SP.blocks[smallest].size) {
+			smallest = j;
 		}
-		cur_rx++;
+	}
+	if (SP.blocks[smallest].size >= size) {
+		free(ptr);
+		free(pair);
+		return;
+	}
+	free(SP.blocks[smallest].ptr);
+	free(SP.blocks[smallest].pair);
+	SP.blocks[smallest].ptr = ptr;
+	SP.blocks[smallest].pair = pair;
+	SP.blocks[smallest].size = size;
+}
 
-		if (cur_rx > rx) {
-			return cx;
+// Takes the smallest spare block of at least minimum bytes, or NULL
+// With pair set it only takes a pair, and fills pair with its second block
+void *spareTake(size_t minimum, void **pair, size_t *size) {
+	int best = -1;
+	int j;
+	for (j = 0; j < SP.count; j++) {
+		if ((SP.blocks[j].pair != NULL) != (pair != NULL)) {
+			continue;
+		}
+		if (SP.blocks[j].size >= minimum && (best == -1 || SP.blocks[j].size < SP.blocks[best].size)) {
+			best = j;
 		}
 	}
-	return cx;
+	if (best == -1) {
+		return NULL;
+	}
+
+	void *ptr = SP.blocks[best].ptr;
+	if (pair) {
+		*pair = SP.blocks[best].pair;
+	}
+	*size = SP.blocks[best].size;
+	SP.blocks[best] = SP.blocks[--SP.count];
+	return ptr;
 }
 
-void editorUpdateRow(editorRow *row) {
-    int j;
-    int tabs = 0;
-    // Count tabs
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            tabs++;
-        }
-    }
+/*** long rows ***/
+
+// A row over LONG_ROW chars is cut into chunks, each knowing the render
+// column and highlighter state it starts at, so what's on screen can be
+// rendered and highlighted without the rest of the row
+// An edit splits the chunks it touches, shifts the ones after it and
+// highlights again only until the state at a chunk's start settles
+struct rowChunk {
+	int start; // first char
+	int len;
+	int rx;    // render column the chunk starts at
+	int width; // render columns it takes up
+	int tabs;
+	struct lexState state; // the highlighter's state at its start
+	char *render;          // cached while the chunk is on screen, else NULL
+	unsigned char *highlight;
+};
 
-    free(row->render);
-    row->render = malloc(row->size + tabs*(TAB_STOP - 1)  + 1);
+struct rowChunks {
+	struct rowChunk *chunk;
+	int count;
+	int capacity;
+	int synced; // the last change to the chars was applied by editorChunksSplice()
+	int dirtyFrom; // chunks to highlight again, none when dirtyFrom > dirtyTo
+	int dirtyTo;
+	int cachedFrom; // only these chunks can have a render cached
+	int cachedTo;
+	struct editorSyntax *syntax; // what they were highlighted as
+	struct lexState end; // the state after the last chunk
+};
 
-    int index = 0;
-    for(j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            row->render[index++] = ' ';
-            while (index % TAB_STOP != 0) {
-                row->render[index++] = ' ';
-            }
-        } else {
-            row->render[index++] = row->chars[j];
-        }
-    }
-    row->render[index] = '\0';
-    row->renderSize = index;
+// Render columns looked past a chunk's end, to finish a token that
+// starts in it
+#define CHUNK_LOOKAHEAD 64
 
-    editorUpdateSyntax(row);
+// Expands len chars starting at render column rx into out, if it isn't
+// NULL, and returns the columns they take up
+int editorExpandTabs(const char *chars, int len, int rx, char *out, int *tabs) {
+	int col = rx;
+	int j;
+	for (j = 0; j < len; j++) {
+		if (chars[j] == '\t') {
+			int spaces = TAB_STOP - col % TAB_STOP;
+			if (out) {
+				memset(&out[col - rx], ' ', spaces);
+			}
+			col += spaces;
+			if (tabs) {
+				(*tabs)++;
+			}
+		} else {
+			if (out) {
+				out[col - rx] = chars[j];
+			}
+			col++;
+		}
+	}
+	return col - rx;
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
+void editorChunkDrop(struct rowChunk *chunk) {
+	free(chunk->render);
+	free(chunk->highlight);
+	chunk->render = NULL;
+	chunk->highlight = NULL;
+}
 
-	if (at < 0 || at > E.numRows) {
+void editorChunksFree(editorRow *row) {
+	struct rowCold *cold = editorRowCold(row);
+	struct rowChunks *rc = cold->chunks;
+	if (rc == NULL) {
 		return;
 	}
+	int j;
+	for (j = rc->cachedFrom; j <= rc->cachedTo && j < rc->count; j++) {
+		editorChunkDrop(&rc->chunk[j]);
+	}
+	free(rc->chunk);
+	free(rc);
+	cold->chunks = NULL;
+}
 
-    E.row = realloc(E.row, sizeof(editorRow) * (E.numRows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(editorRow) * (E.numRows - at));
-	for (int j = at + 1; j <= E.numRows; j++) {
-		E.row[j].index++;
+void editorChunksDirty(struct rowChunks *rc, int from, int to) {
+	if (rc->dirtyFrom > rc->dirtyTo) {
+		rc->dirtyFrom = from;
+		rc->dirtyTo = to;
+		return;
+	}
+	if (from < rc->dirtyFrom) {
+		rc->dirtyFrom = from;
+	}
+	if (to > rc->dirtyTo) {
+		rc->dirtyTo = to;
 	}
+}
 
-    E.row[at].index = at;
+// Measures chunk j from where the one before it ends
+void editorChunkMeasure(editorRow *row, int j) {
+	struct rowChunk *chunk = &editorRowCold(row)->chunks->chunk[j];
+	chunk->rx = j ? chunk[-1].rx + chunk[-1].width : 0;
+	chunk->tabs = 0;
+	chunk->width = editorExpandTabs(&row->chars[chunk->start], chunk->len, chunk->rx, NULL, &chunk->tabs);
+}
 
-    //int at = E.numRows;
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+// Cuts the whole row into chunks, all of them to be highlighted
+void editorChunksBuild(editorRow *row) {
+	editorChunksFree(row);
+	struct rowChunks *rc = calloc(1, sizeof(struct rowChunks));
+	rc->count = (row->size + ROW_CHUNK - 1) / ROW_CHUNK;
+	rc->capacity = rc->count;
+	rc->chunk = calloc(rc->capacity, sizeof(struct rowChunk));
+	statsAdd(STAT_ALLOCS, 2);
+	editorRowCold(row)->chunks = rc;
 
-    E.row[at].renderSize = 0;
-    E.row[at].render = NULL;
-    E.row[at].highlight = NULL;
-    E.row[at].highlight_open_comment = 0;
-    editorUpdateRow(&E.row[at]);
+	int j;
+	for (j = 0; j < rc->count; j++) {
+		rc->chunk[j].start = j * ROW_CHUNK;
+		rc->chunk[j].len = (j + 1 < rc->count) ? ROW_CHUNK : row->size - j * ROW_CHUNK;
+		editorChunkMeasure(row, j);
+	}
+	rc->chunk[0].state = lexRowStart(row);
+	rc->dirtyFrom = 0;
+	rc->dirtyTo = rc->count - 1;
+	rc->cachedFrom = 0;
+	rc->cachedTo = -1;
+	rc->syntax = E.syntax;
+}
 
-    E.numRows++;
-    E.dirty++;
+// Returns the chunk holding char col, the last one past the end
+int editorChunkAt(struct rowChunks *rc, int col) {
+	int lo = 0;
+	int hi = rc->count - 1;
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (rc->chunk[mid].start <= col) {
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return lo;
 }
 
-void editorFreeRow(editorRow *row) {
-	free(row->render);
-	free(row->chars);
-	free(row->highlight);
+// Returns the chunk holding render column rx, the last one past the end
+int editorChunkAtRx(struct rowChunks *rc, int rx) {
+	int lo = 0;
+	int hi = rc->count - 1;
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (rc->chunk[mid].rx <= rx) {
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return lo;
 }
 
-void editorDeleteRow(int at) {
-	if (at < 0 || at >= E.numRows) {
+// Applies an edit that replaced delLen chars at col with insLen others,
+// the row's chars already hold it
+// Only the chunks the edit touched are measured again, the ones after
+// are shifted and re-measured only if tabs in them now land differently
+void editorChunksSplice(editorRow *row, int col, int delLen, int insLen) {
+	struct rowCold *cold = editorRowCold(row);
+	struct rowChunks *rc = cold->chunks;
+	if (rc == NULL) {
 		return;
 	}
-	editorFreeRow(&E.row[at]);
-	memmove(&E.row[at], &E.row[at + 1], sizeof(editorRow) * (E.numRows - at - 1));
-	for (int j = at; j < E.numRows - 1; j++) {
-		E.row[j].index--;
+	int first = editorChunkAt(rc, col);
+	int last = (delLen > 0) ? editorChunkAt(rc, col + delLen - 1) : first;
+	int start = rc->chunk[first].start;
+	int len = rc->chunk[last].start + rc->chunk[last].len - start + insLen - delLen;
+
+	// The touched chunks become one, or several if it grew too long
+	int pieces = (len > 2 * ROW_CHUNK) ? (len + ROW_CHUNK - 1) / ROW_CHUNK : (len > 0);
+	if (pieces == 0 && rc->count == last - first + 1) {
+		pieces = 1;
 	}
-	E.numRows--;
-	E.dirty++;
-}
-
-void editorRowInsertChar(editorRow *row, int at, int c) {
-	// Make sure our position is valid
-	if (at < 0 || at > row->size) {
-		at = row->size;
+	struct lexState state = rc->chunk[first].state;
+	int j;
+	for (j = first; j <= last; j++) {
+		editorChunkDrop(&rc->chunk[j]);
 	}
-
-	// Allocate one more byte in our row
-	row->chars = realloc(row->chars, row->size + 2);
+	int shift = pieces - (last - first + 1);
+	if (rc->count + shift > rc->capacity) {
+		rc->capacity = (rc->count + shift) * 2;
+		rc->chunk = realloc(rc->chunk, sizeof(struct rowChunk) * rc->capacity);
+		statsAdd(STAT_ALLOCS, 1);
+	}
+	memmove(&rc->chunk[last + 1 + shift], &rc->chunk[last + 1], sizeof(struct rowChunk) * (rc->count - last - 1));
+	rc->count += shift;
+	for (j = 0; j < pieces; j++) {
+		struct rowChunk *chunk = &rc->chunk[first + j];
+		memset(chunk, 0, sizeof(struct rowChunk));
+		chunk->start = start + (int)((long long)len * j / pieces);
+		chunk->len = start + (int)((long long)len * (j + 1) / pieces) - chunk->start;
+		chunk->state = state;
+	}
+	if (rc->dirtyTo > last) {
+		rc->dirtyTo += shift;
+	}
+	if (rc->cachedTo > last) {
+		rc->cachedTo += shift;
+	}
+	if (rc->cachedFrom > last) {
+		rc->cachedFrom += shift;
+	}
+	if (rc->cachedTo >= rc->count) {
+		rc->cachedTo = rc->count - 1;
+	}
+
+	// Chunks that looked ahead at the edit are highlighted again too
+	int from = first;
+	while (from > 0 && (from == rc->count || rc->chunk[from].start > col - CHUNK_LOOKAHEAD)) {
+		from--;
+	}
+	editorChunksDirty(rc, from, first + pieces - 1);
+
+	for (j = first; j < rc->count; j++) {
+		struct rowChunk *chunk = &rc->chunk[j];
+		if (j < first + pieces) {
+			editorChunkMeasure(row, j);
+			continue;
+		}
+		chunk->start += insLen - delLen;
+		int rx = chunk[-1].rx + chunk[-1].width;
+		if (rx == chunk->rx) {
+			break;
+		}
+		if (chunk->tabs && (rx - chunk->rx) % TAB_STOP != 0) {
+			editorChunkDrop(chunk);
+			editorChunkMeasure(row, j);
+			editorChunksDirty(rc, j, j);
+		} else {
+			chunk->rx = rx;
+		}
+	}
+	// Past where the columns stopped moving only the chars did
+	for (j++; j < rc->count; j++) {
+		rc->chunk[j].start += insLen - delLen;
+	}
+	rc->synced = 1;
+}
+
+// Renders chunk k with a little of what follows and highlights it from
+// the state at its start, leaving state as it is after the chunk
+// Returns the render, the highlight goes in *hl, both for the caller to
+// free
+char *editorChunkLex(editorRow *row, int k, struct lexState *state, unsigned char **hl) {
+	struct rowCold *cold = editorRowCold(row);
+	struct rowChunk *chunk = &cold->chunks->chunk[k];
+	int end = chunk->start + chunk->len;
+	int ahead = row->size - end;
+	if (ahead > CHUNK_LOOKAHEAD) {
+		ahead = CHUNK_LOOKAHEAD;
+	}
+	char *render = malloc(chunk->width + ahead * TAB_STOP + 1);
+	editorExpandTabs(&row->chars[chunk->start], chunk->len, chunk->rx, render, NULL);
+	int avail = chunk->width + editorExpandTabs(&row->chars[end], ahead, chunk->rx + chunk->width, &render[chunk->width], NULL);
+	render[avail] = '\0';
+	*hl = malloc(avail + 1);
+	statsAdd(STAT_ALLOCS, 2);
+	editorLexSpan(render, chunk->width, avail, *hl, state);
+	return render;
+}
+
+// Highlights the chunks edited since the last time, and the ones after
+// them until the state at a chunk's start comes out as it was
+// Returns 1 if whether a comment is left open at the end changed
+int editorChunksHighlight(editorRow *row) {
+	struct rowCold *cold = editorRowCold(row);
+	struct rowChunks *rc = cold->chunks;
+	struct lexState start = lexRowStart(row);
+	if (rc->syntax != E.syntax) {
+		rc->syntax = E.syntax;
+		editorChunksDirty(rc, 0, rc->count - 1);
+	}
+	if (!lexStateEqual(&start, &rc->chunk[0].state)) {
+		rc->chunk[0].state = start;
+		editorChunksDirty(rc, 0, 0);
+	}
+
+	int k;
+	for (k = rc->dirtyFrom; k < rc->count && k <= rc->dirtyTo; k++) {
+		struct lexState state = rc->chunk[k].state;
+		unsigned char *hl;
+		char *render = editorChunkLex(row, k, &state, &hl);
+		if (rc->chunk[k].render) {
+			free(rc->chunk[k].highlight);
+			rc->chunk[k].highlight = hl;
+			hl = NULL;
+		}
+		free(render);
+		free(hl);
+
+		struct lexState *next = (k + 1 < rc->count) ? &rc->chunk[k + 1].state : &rc->end;
+		if (!lexStateEqual(next, &state)) {
+			*next = state;
+			editorChunksDirty(rc, k + 1, k + 1);
+		}
+	}
+	rc->dirtyFrom = 0;
+	rc->dirtyTo = -1;
+	if (E.syntax == NULL) {
+		return 0;
+	}
+
+	int changed = (row->highlight_open_comment != rc->end.inComment);
+	row->highlight_open_comment = rc->end.inComment;
+	return changed;
+}
+
+// Points render and hl at len render columns of row from column from
+// A long row's are copied out of its chunks on screen, which are the
+// only ones kept rendered
+void editorRowView(editorRow *row, int from, int len, const char **render, const unsigned char **hl) {
+	struct rowCold *cold = editorRowCold(row);
+	struct rowChunks *rc = cold->chunks;
+	if (rc == NULL) {
+		*render = &cold->render[from];
+		*hl = &cold->highlight[from];
+		return;
+	}
+	if (len > E.viewCapacity) {
+		E.viewCapacity = len;
+		E.view = realloc(E.view, len);
+		E.viewHighlight = realloc(E.viewHighlight, len);
+		statsAdd(STAT_ALLOCS, 2);
+	}
+	*render = E.view;
+	*hl = E.viewHighlight;
+	if (len <= 0) {
+		return;
+	}
+
+	int first = editorChunkAtRx(rc, from);
+	int last = editorChunkAtRx(rc, from + len - 1);
+	int j;
+	for (j = rc->cachedFrom; j <= rc->cachedTo; j++) {
+		if (j < first || j > last) {
+			editorChunkDrop(&rc->chunk[j]);
+		}
+	}
+	rc->cachedFrom = first;
+	rc->cachedTo = last;
+
+	for (j = first; j <= last; j++) {
+		struct rowChunk *chunk = &rc->chunk[j];
+		if (chunk->render == NULL) {
+			struct lexState state = chunk->state;
+			free(chunk->highlight);
+			chunk->render = editorChunkLex(row, j, &state, &chunk->highlight);
+		}
+		int lo = (from > chunk->rx) ? from : chunk->rx;
+		int hi = (from + len < chunk->rx + chunk->width) ? from + len : chunk->rx + chunk->width;
+		if (lo < hi) {
+			memcpy(&E.view[lo - from], &chunk->render[lo - chunk->rx], hi - lo);
+			memcpy(&E.viewHighlight[lo - from], &chunk->highlight[lo - chunk->rx], hi - lo);
+		}
+	}
+}
+
+/*** row operations  ***/
+
+// Returns how many of the row's tabs are before char cx
+int editorRowTabsBefore(editorRow *row, int cx) {
+    struct rowCold *cold = editorRowCold(row);
+    int lo = 0;
+    int hi = cold->tabCount;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (cold->tabs[mid].cx < cx) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Convers the char index to a render index
+// Chars between tabs take a column each, so a rendered row only needs
+// the last tab before cx
+int editorRowCxToRx(editorRow *row, int cx) {
+    struct rowCold *cold = editorRowCold(row);
+    if (cold->render) {
+        int k = editorRowTabsBefore(row, cx);
+        return k ? cold->tabs[k - 1].rx + (cx - cold->tabs[k - 1].cx - 1) : cx;
+    }
+
+    int rx = 0;
+    int j = 0;
+    // A long row is walked from the start of the chunk cx is in
+    if (cold->chunks) {
+        struct rowChunk *chunk = &cold->chunks->chunk[editorChunkAt(cold->chunks, cx)];
+        rx = chunk->rx;
+        j = chunk->start;
+    }
+    for (; j < cx; j++) {
+        if (row->chars[j] == '\t') {
+            rx += (TAB_STOP - 1) - (rx % TAB_STOP);
+        }
+        rx++;
+    }
+    return rx;
+}
+
+int editorRowRxToCx(editorRow *row, int rx) {
+	struct rowCold *cold = editorRowCold(row);
+	int cur_rx = 0;
+	int cx = 0;
+
+	if (cold->render) {
+		// The last tab ending at or before rx, then one column per char
+		int lo = 0;
+		int hi = cold->tabCount;
+		while (lo < hi) {
+			int mid = (lo + hi) / 2;
+			if (cold->tabs[mid].rx <= rx) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		cx = lo ? cold->tabs[lo - 1].cx + 1 + (rx - cold->tabs[lo - 1].rx) : rx;
+		// rx inside the next tab's spaces lands on the tab
+		if (lo < cold->tabCount && cx > cold->tabs[lo].cx) {
+			cx = cold->tabs[lo].cx;
+		}
+		return (cx < row->size) ? cx : row->size;
+	}
+
+	if (cold->chunks) {
+		struct rowChunk *chunk = &cold->chunks->chunk[editorChunkAtRx(cold->chunks, rx)];
+		cur_rx = chunk->rx;
+		cx = chunk->start;
+	}
+	for (; cx < row->size; cx++) {
+		if (row->chars[cx] == '\t') {
+			cur_rx += (TAB_STOP - 1) - (cur_rx % TAB_STOP);
+		}
+		cur_rx++;
+
+		if (cur_rx > rx) {
+			return cx;
+		}
+	}
+	return cx;
+}
+
+// Frees the row's render, unless it's the chars
+// Must come before the tab index is rebuilt, which tells them apart
+void editorRowDropRender(editorRow *row) {
+    struct rowCold *cold = editorRowCold(row);
+    if (cold->render && cold->tabCount == 0) {
+        ST.renderShared -= row->renderSize;
+    } else {
+        free(cold->render);
+    }
+    cold->render = NULL;
+}
+
+// Rebuilds the row's render from its chars
+// A long row is only measured, its chunks are rendered when drawn
+void editorRenderRow(editorRow *row) {
+    struct rowCold *cold = editorRowCold(row);
+    if (row->size > LONG_ROW) {
+        if (cold->chunks == NULL || !cold->chunks->synced) {
+            editorChunksBuild(row);
+        }
+        cold->chunks->synced = 0;
+        struct rowChunk *last = &cold->chunks->chunk[cold->chunks->count - 1];
+        editorRowDropRender(row);
+        free(cold->highlight);
+        cold->highlight = NULL;
+        row->renderSize = last->rx + last->width;
+        free(cold->tabs);
+        cold->tabs = NULL;
+        cold->tabCount = 0;
+        statsAdd(STAT_ROWS_RENDERED, 1);
+        return;
+    }
+    editorChunksFree(row);
+
+    int j;
+    int tabs = 0;
+    // Count tabs
+    for (j = 0; j < row->size; j++) {
+        if (row->chars[j] == '\t') {
+            tabs++;
+        }
+    }
+
+    editorRowDropRender(row);
+    statsAdd(STAT_ROWS_RENDERED, 1);
+
+    // Without tabs the render would be a copy of the chars
+    if (tabs == 0) {
+        free(cold->tabs);
+        cold->tabs = NULL;
+        cold->tabCount = 0;
+        cold->render = row->chars;
+        row->renderSize = row->size;
+        ST.renderShared += row->size;
+        return;
+    }
+    cold->render = malloc(row->size + tabs*(TAB_STOP - 1)  + 1);
+    statsAdd(STAT_ALLOCS, 1);
+
+    // Where the tabs are, for mapping between chars and render columns
+    if (tabs != cold->tabCount) {
+        free(cold->tabs);
+        cold->tabs = tabs ? malloc(sizeof(struct rowTab) * tabs) : NULL;
+        cold->tabCount = tabs;
+        statsAdd(STAT_ALLOCS, 1);
+    }
+
+    int index = 0;
+    tabs = 0;
+    for(j = 0; j < row->size; j++) {
+        if (row->chars[j] == '\t') {
+            cold->render[index++] = ' ';
+            while (index % TAB_STOP != 0) {
+                cold->render[index++] = ' ';
+            }
+            cold->tabs[tabs].cx = j;
+            cold->tabs[tabs].rx = index;
+            tabs++;
+        } else {
+            cold->render[index++] = row->chars[j];
+        }
+    }
+    cold->render[index] = '\0';
+    row->renderSize = index;
+}
+
+// Hash of a line's text, 8 bytes at a time
+// Never 0, which marks rows that didn't come from disk
+uint64_t lineHash(const char *s, size_t len) {
+	uint64_t hash = 0x9e3779b97f4a7c15ULL ^ len;
+	uint64_t word;
+	while (len >= 8) {
+		memcpy(&word, s, 8);
+		hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+		hash ^= hash >> 32;
+		s += 8;
+		len -= 8;
+	}
+	word = 0;
+	memcpy(&word, s, len);
+	hash = (hash ^ word) * 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 29;
+	return hash | 1;
+}
+
+// Nothing is rendered or highlighted headless, edits only need the chars
+void editorUpdateRow(editorRow *row) {
+    if (E.headless) {
+        return;
+    }
+    editorRenderRow(row);
+    editorUpdateSyntax(row);
+    editorIndexUpdateRow(row->index);
+}
+
+// Updates a batch of changed rows (sorted, no repeats) once each
+// A comment carrying down from one of them stops at the next one in the
+// batch, which is highlighted in its turn with the state it inherits
+void editorUpdateRows(const int *rows, int count) {
+	if (E.headless) {
+		return;
+	}
+	int i;
+	for (i = 0; i < count; i++) {
+		editorRenderRow(&E.row[rows[i]]);
+	}
+	int previous = statsSwitch(PHASE_HIGHLIGHT);
+	traceBegin("editorUpdateRows");
+	int highlighted = 0;
+	for (i = 0; i < count; i++) {
+		int at = rows[i];
+		int next = (i + 1 < count) ? rows[i + 1] : E.numRows;
+		while (editorHighlightRow(&E.row[at]) && ++at < next) {
+		}
+		highlighted += at - rows[i] + (at < next);
+	}
+	statsSyntax(highlighted);
+	traceEndArg("editorUpdateRows", "rows", highlighted);
+	statsSwitch(previous);
+	for (i = 0; i < count; i++) {
+		editorIndexUpdateRow(rows[i]);
+	}
+}
+
+// Grows the row arrays to hold count rows, a new buffer's first pair
+// comes from the spare pool when there's one big enough
+// The hot and cold halves are separate arrays grown together, so each
+// realloc can extend its block in place rather than move the other half
+void editorReserveRows(int count) {
+	if (count <= E.rowCapacity) {
+		return;
+	}
+	int capacity = E.rowCapacity ? E.rowCapacity * 2 : 64;
+	if (capacity < count) {
+		capacity = count;
+	}
+
+	if (E.row == NULL) {
+		size_t size;
+		void *cold;
+		E.row = spareTake(sizeof(editorRow) * capacity, &cold, &size);
+		if (E.row) {
+			E.rowCold = cold;
+			E.rowCapacity = size / sizeof(editorRow);
+			return;
+		}
+	}
+	E.row = realloc(E.row, sizeof(editorRow) * capacity);
+	E.rowCold = realloc(E.rowCold, sizeof(struct rowCold) * capacity);
+	statsAdd(STAT_ALLOCS, 2);
+	E.rowCapacity = capacity;
+}
+
+void editorInsertRow(int at, char *s, size_t len) {
+
+	if (at < 0 || at > E.numRows) {
+		return;
+	}
+	editorIndexInsertRows(at, 1);
+
+    editorReserveRows(E.numRows + 1);
+    memmove(&E.row[at + 1], &E.row[at], sizeof(editorRow) * (E.numRows - at));
+    memmove(&E.rowCold[at + 1], &E.rowCold[at], sizeof(struct rowCold) * (E.numRows - at));
+	for (int j = at + 1; j <= E.numRows; j++) {
+		E.row[j].index++;
+	}
+
+    E.row[at].index = at;
+
+    //int at = E.numRows;
+    E.row[at].size = len;
+    E.row[at].chars = malloc(len + 1);
+    statsAdd(STAT_ALLOCS, 1);
+    memcpy(E.row[at].chars, s, len);
+    E.row[at].chars[len] = '\0';
+
+    E.row[at].renderSize = 0;
+    E.row[at].highlight_open_comment = 0;
+    E.rowCold[at] = (struct rowCold){ NULL, NULL, NULL, NULL, 0, 0 };
+    editorUpdateRow(&E.row[at]);
+
+    E.numRows++;
+    E.dirty++;
+    editorUndoRows(UNDO_INSERT_ROWS, at, 1);
+}
+
+// Inserts count rows at at, packed one after another as an int length
+// followed by the row's chars
+// The row array is moved once however many rows go in
+void editorInsertRowsPacked(int at, int count, const char *packed) {
+	if (at < 0 || at > E.numRows || count <= 0) {
+		return;
+	}
+	editorIndexInsertRows(at, count);
+
+	editorReserveRows(E.numRows + count);
+	memmove(&E.row[at + count], &E.row[at], sizeof(editorRow) * (E.numRows - at));
+	memmove(&E.rowCold[at + count], &E.rowCold[at], sizeof(struct rowCold) * (E.numRows - at));
+	int j;
+	for (j = at + count; j < E.numRows + count; j++) {
+		E.row[j].index += count;
+	}
+
+	for (j = at; j < at + count; j++) {
+		int len;
+		memcpy(&len, packed, sizeof(int));
+		packed += sizeof(int);
+
+		E.row[j].index = j;
+		E.row[j].size = len;
+		E.row[j].chars = malloc(len + 1);
+		statsAdd(STAT_ALLOCS, 1);
+		memcpy(E.row[j].chars, packed, len);
+		E.row[j].chars[len] = '\0';
+		E.row[j].renderSize = 0;
+		E.row[j].highlight_open_comment = 0;
+		E.rowCold[j] = (struct rowCold){ NULL, NULL, NULL, NULL, 0, 0 };
+		packed += len;
+	}
+	E.numRows += count;
+
+	traceBegin("editorInsertRowsPacked");
+	traceMuted++;
+	for (j = at; j < at + count; j++) {
+		editorUpdateRow(&E.row[j]);
+	}
+	traceMuted--;
+	traceEndArg("editorInsertRowsPacked", "rows", count);
+	E.dirty++;
+	editorUndoRows(UNDO_INSERT_ROWS, at, count);
+}
+
+void editorFreeRow(editorRow *row) {
+	editorChunksFree(row);
+	editorRowDropRender(row);
+	struct rowCold *cold = editorRowCold(row);
+	free(cold->tabs);
+	free(row->chars);
+	free(cold->highlight);
+}
+
+// Deletes count rows from at with a single move of the row array
+void editorDeleteRows(int at, int count) {
+	if (at < 0 || at >= E.numRows || count <= 0) {
+		return;
+	}
+	if (count > E.numRows - at) {
+		count = E.numRows - at;
+	}
+	editorUndoRows(UNDO_DELETE_ROWS, at, count);
+	editorIndexDeleteRows(at, count);
+
+	int j;
+	for (j = at; j < at + count; j++) {
+		editorFreeRow(&E.row[j]);
+	}
+	memmove(&E.row[at], &E.row[at + count], sizeof(editorRow) * (E.numRows - at - count));
+	memmove(&E.rowCold[at], &E.rowCold[at + count], sizeof(struct rowCold) * (E.numRows - at - count));
+	E.numRows -= count;
+	for (j = at; j < E.numRows; j++) {
+		E.row[j].index -= count;
+	}
+
+	// The row after the gap may have been inside a comment that's gone
+	if (at < E.numRows) {
+		editorUpdateSyntax(&E.row[at]);
+	}
+	E.dirty++;
+}
+
+void editorDeleteRow(int at) {
+	editorDeleteRows(at, 1);
+}
+
+// Replaces delLen chars at col with s, then updates the row once
+void editorRowSplice(editorRow *row, int col, int delLen, const char *s, int sLen) {
+	// Find's scan may be reading the chars
+	editorIndexPause();
+	editorUndoSplice(row->index, col, &row->chars[col], delLen, s, sLen);
+	if (sLen > delLen) {
+		row->chars = realloc(row->chars, row->size - delLen + sLen + 1);
+		statsAdd(STAT_ALLOCS, 1);
+	}
+	memmove(&row->chars[col + sLen], &row->chars[col + delLen], row->size - col - delLen + 1);
+	memcpy(&row->chars[col], s, sLen);
+	row->size += sLen - delLen;
+	editorChunksSplice(row, col, delLen, sLen);
+	editorUpdateRow(row);
+	E.dirty++;
+}
+
+void editorRowInsertChar(editorRow *row, int at, int c) {
+	editorIndexPause();
+	// Make sure our position is valid
+	if (at < 0 || at > row->size) {
+		at = row->size;
+	}
+	char ch = c;
+	editorUndoSplice(row->index, at, NULL, 0, &ch, 1);
+
+	// Allocate one more byte in our row
+	row->chars = realloc(row->chars, row->size + 2);
+	statsAdd(STAT_ALLOCS, 1);
 	memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
 	row->size++;
 	row->chars[at] = c;
+	editorChunksSplice(row, at, 0, 1);
 	editorUpdateRow(row);
 	E.dirty++;
 }
 
 void editorRowAppendString(editorRow *row, char *s, size_t len) {
+	editorIndexPause();
+	editorUndoSplice(row->index, row->size, NULL, 0, s, len);
 	row->chars = realloc(row->chars, row->size + len + 1);
+	statsAdd(STAT_ALLOCS, 1);
 	memcpy(&row->chars[row->size], s, len);
+	editorChunksSplice(row, row->size, 0, len);
 	row->size += len;
 	row->chars[row->size] = '\0';
 	editorUpdateRow(row);
@@ -562,9 +1744,12 @@ void editorRowDeleteChar(editorRow *row, int at) {
 	if (at < 0 || at >= row->size) {
 		return;
 	}
+	editorIndexPause();
+	editorUndoSplice(row->index, at, &row->chars[at], 1, NULL, 0);
 
 	memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
 	row->size--;
+	editorChunksSplice(row, at, 1, 0);
 	editorUpdateRow(row);
 	E.dirty++;
 }
@@ -589,9 +1774,7 @@ void editorInsertNewline() {
 		editorRow *row = &E.row[E.cy];
 		editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
 		row = &E.row[E.cy];
-		row->size = E.cx;
-		row->chars[row->size] = '\0';
-		editorUpdateRow(row);
+		editorRowSplice(row, E.cx, row->size - E.cx, "", 0);
 	}
 	E.cy++;
 	E.cx = 0;
@@ -612,210 +1795,3491 @@ void editorDeleteChar() {
 		return;
 	}
 
-	if (E.cx == 0 && E.cy == 0) {
+	if (E.cx == 0 && E.cy == 0) {
+		return;
+	}
+
+	editorRow *row = &E.row[E.cy];
+	if (E.cx > 0) {
+		editorRowDeleteChar(row, E.cx - 1);
+		E.cx--;
+	} else {
+		E.cx = E.row[E.cy - 1].size;
+		editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
+		editorDeleteRow(E.cy);
+		E.cy--;
+	}
+}
+
+/*** undo ***/
+
+// Edits are appended to one buffer as a header, the text padded to a
+// multiple of 4 and the record's total size, so the log can be walked
+// both ways
+// A splice's text is the deleted chars followed by the inserted ones,
+// row records hold their rows packed as for editorInsertRowsPacked()
+struct undoRecord {
+	int type;
+	int group;    // edits made by the same keypress
+	int row;
+	int col;      // splices, or the bytes of the old rows for a replace
+	int deleted;  // chars for splices, rows for row records
+	int inserted; // chars for splices, new rows for a replace
+	int textLen;
+	int cx;       // cursor before the group's keypress
+	int cy;
+};
+
+struct undoLog {
+	char *buf;
+	int used;     // bytes of records, the ones past position can be redone
+	int position;
+	int capacity;
+	int group;    // group of the keypress being handled
+	int groupCx;
+	int groupCy;
+	int dropped;  // a group too big to keep, the rest of it isn't recorded
+	int paused;   // edits aren't recorded while loading or undoing
+};
+
+#define U (*mioCurrent->undo)
+
+// Rows packed as for editorInsertRowsPacked()
+struct packedRows {
+	char *buf;
+	int len;
+	int capacity;
+};
+
+// The rows a macro run has changed, recorded as a single replace when it
+// ends rather than a record per replayed key
+// Rows are taken as the span grows to reach them, before anything changes
+// them: those below it are appended to below, those above it are pushed
+// onto above as blocks followed by their length, to be put back in front
+struct undoSpan {
+	int running; // a macro run is being recorded
+	int touched; // it has changed rows since the span was last recorded
+	int first;
+	int end;     // the row after the span, as the buffer is now
+	int oldRows;
+	struct packedRows above;
+	struct packedRows below;
+};
+
+#define US (*mioCurrent->span)
+
+int undoRecordSize(int textLen) {
+	return sizeof(struct undoRecord) + ((textLen + 3) & ~3) + sizeof(int);
+}
+
+// Starts a new group, called for every keypress
+// A macro's replayed keys all join the group of the key that ran it,
+// and their edits are recorded as one span, see editorUndoSpanBegin()
+void editorUndoBegin() {
+	if (editorMacroPlaying()) {
+		return;
+	}
+	U.group++;
+	U.groupCx = E.cx;
+	U.groupCy = E.cy;
+}
+
+void editorUndoReset() {
+	U.used = 0;
+	U.position = 0;
+}
+
+// Reads the record ending at end, returns where it starts
+int editorUndoReadBack(int end, struct undoRecord *record) {
+	int size;
+	memcpy(&size, &U.buf[end - sizeof(int)], sizeof(int));
+	memcpy(record, &U.buf[end - size], sizeof(struct undoRecord));
+	return end - size;
+}
+
+// Makes room for size more bytes under UNDO_MEMORY_LIMIT, dropping the
+// oldest groups while keeping the one being recorded
+// Returns 0 if it can't fit however much is dropped
+int editorUndoMakeRoom(int size) {
+	if (U.used + size > UNDO_MEMORY_LIMIT) {
+		// Drop down to half the limit so the move happens rarely
+		int keepFrom = 0;
+		while (keepFrom < U.used && U.used - keepFrom + size > UNDO_MEMORY_LIMIT / 2) {
+			struct undoRecord record;
+			memcpy(&record, &U.buf[keepFrom], sizeof(struct undoRecord));
+			if (record.group == U.group) {
+				break;
+			}
+			int next = keepFrom;
+			struct undoRecord other = record;
+			while (next < U.used && other.group == record.group) {
+				next += undoRecordSize(other.textLen);
+				if (next < U.used) {
+					memcpy(&other, &U.buf[next], sizeof(struct undoRecord));
+				}
+			}
+			keepFrom = next;
+		}
+		if (U.used - keepFrom + size > UNDO_MEMORY_LIMIT) {
+			return 0;
+		}
+		memmove(U.buf, &U.buf[keepFrom], U.used - keepFrom);
+		U.used -= keepFrom;
+		U.position -= keepFrom;
+	}
+
+	if (U.used + size > U.capacity) {
+		size_t capacity = (U.used + size) * 2;
+		if (capacity > UNDO_MEMORY_LIMIT) {
+			capacity = UNDO_MEMORY_LIMIT;
+		}
+		if (U.buf == NULL && (U.buf = spareTake(capacity, NULL, &capacity)) != NULL) {
+			U.capacity = capacity;
+		} else {
+			U.capacity = capacity;
+			U.buf = realloc(U.buf, U.capacity);
+			statsAdd(STAT_ALLOCS, 1);
+		}
+	}
+	return 1;
+}
+
+// Appends a record whose text is a followed by b
+// Anything past position can't be redone any more and is overwritten
+void editorUndoAppend(struct undoRecord *record, const char *a, int aLen, const char *b, int bLen) {
+	U.used = U.position;
+	record->textLen = aLen + bLen;
+	int size = undoRecordSize(record->textLen);
+	if (!editorUndoMakeRoom(size)) {
+		// The group alone is over the limit, it can't be undone
+		editorUndoReset();
+		U.dropped = U.group;
+		editorSetStatusMessage("Edit too large to undo, history cleared");
+		return;
+	}
+
+	char *p = &U.buf[U.used];
+	memcpy(p, record, sizeof(struct undoRecord));
+	p += sizeof(struct undoRecord);
+	if (aLen) {
+		memcpy(p, a, aLen);
+	}
+	if (bLen) {
+		memcpy(p + aLen, b, bLen);
+	}
+	memcpy(&U.buf[U.used + size - sizeof(int)], &size, sizeof(int));
+	U.used += size;
+	U.position = U.used;
+}
+
+int editorUndoRecording() {
+	return !E.headless && !U.paused && U.dropped != U.group;
+}
+
+int isWordBoundary(char c, char previous) {
+	return isspace((unsigned char)c) && !isspace((unsigned char)previous);
+}
+
+// Folds a one char splice into the previous keypress's record when it
+// carries on typing or deleting the same word
+// Returns 1 if it was merged
+int editorUndoMerge(int row, int col, const char *deleted, int delLen, const char *inserted, int insLen) {
+	if (U.position == 0 || U.position != U.used) {
+		return 0;
+	}
+
+	struct undoRecord last;
+	int start = editorUndoReadBack(U.position, &last);
+	if (last.type != UNDO_SPLICE || last.group != U.group - 1 || last.row != row) {
+		return 0;
+	}
+	if (start > 0) {
+		struct undoRecord before;
+		editorUndoReadBack(start, &before);
+		if (before.group == last.group) {
+			return 0;
+		}
+	}
+
+	char *text = &U.buf[start + sizeof(struct undoRecord)];
+	int typing = (insLen == 1 && last.deleted == 0 && last.col + last.inserted == col);
+	int backspacing = (delLen == 1 && last.inserted == 0 && col + 1 == last.col);
+	int deleting = (delLen == 1 && last.inserted == 0 && col == last.col);
+	if (typing && isWordBoundary(inserted[0], text[last.textLen - 1])) {
+		return 0;
+	}
+	if (backspacing && isWordBoundary(deleted[0], text[0])) {
+		return 0;
+	}
+	if (!typing && !backspacing && !deleting) {
+		return 0;
+	}
+
+	// The record is last in the log, take it off and append the merged one
+	char *old = malloc(last.textLen);
+	memcpy(old, text, last.textLen);
+	U.position = start;
+	last.group = U.group;
+	if (typing) {
+		last.inserted++;
+		editorUndoAppend(&last, old, last.textLen, inserted, 1);
+	} else if (backspacing) {
+		last.col--;
+		last.deleted++;
+		editorUndoAppend(&last, deleted, 1, old, last.textLen);
+	} else {
+		last.deleted++;
+		editorUndoAppend(&last, old, last.textLen, deleted, 1);
+	}
+	free(old);
+	return 1;
+}
+
+// Appends rows [from, to) to rows
+void editorUndoPack(struct packedRows *rows, int from, int to) {
+	int j;
+	for (j = from; j < to; j++) {
+		int size = E.row[j].size;
+		if (rows->len + (int)sizeof(int) + size > rows->capacity) {
+			rows->capacity = (rows->len + sizeof(int) + size) * 2;
+			rows->buf = realloc(rows->buf, rows->capacity);
+		}
+		memcpy(&rows->buf[rows->len], &size, sizeof(int));
+		memcpy(&rows->buf[rows->len + sizeof(int)], E.row[j].chars, size);
+		rows->len += sizeof(int) + size;
+	}
+}
+
+// Called before count rows from at become count + delta rows, or just
+// after delta rows are inserted at at, which moved the rows from at on
+// down by moved; grows the span over them, taking the rows it reaches
+// while they're still as the run found them
+void editorUndoTouch(int at, int count, int delta, int moved) {
+	if (!US.touched) {
+		US.touched = 1;
+		US.first = at;
+		US.end = at;
+		US.oldRows = 0;
+		US.above.len = 0;
+		US.below.len = 0;
+	}
+	if (at < US.first) {
+		int start = US.above.len;
+		editorUndoPack(&US.above, at + moved, US.first + moved);
+		int len = US.above.len - start;
+		if (US.above.len + (int)sizeof(int) > US.above.capacity) {
+			US.above.capacity = (US.above.len + sizeof(int)) * 2;
+			US.above.buf = realloc(US.above.buf, US.above.capacity);
+		}
+		memcpy(&US.above.buf[US.above.len], &len, sizeof(int));
+		US.above.len += sizeof(int);
+		US.oldRows += US.first - at;
+		US.first = at;
+	}
+	if (at + count > US.end) {
+		editorUndoPack(&US.below, US.end, at + count);
+		US.oldRows += at + count - US.end;
+		US.end = at + count;
+	}
+	US.end += delta;
+}
+
+// Starts recording a macro run as one span of rows
+void editorUndoSpanBegin() {
+	US.running = editorUndoRecording();
+	US.touched = 0;
+}
+
+// Records the rows the run has changed so far as one replace
+// If that's over UNDO_MEMORY_LIMIT on its own it leaves a barrier instead:
+// the older history is kept, but undo can't go back past the run
+// Returns 0 if it left a barrier
+int editorUndoSpanFlush() {
+	if (!US.touched) {
+		return 1;
+	}
+	US.touched = 0;
+
+	// The blocks above went on in the order the span reached them, from
+	// the bottom up
+	struct packedRows old = { NULL, 0, 0 };
+	old.capacity = US.above.len + US.below.len;
+	old.buf = malloc(old.capacity ? old.capacity : 1);
+	int at = US.above.len;
+	while (at > 0) {
+		int len;
+		memcpy(&len, &US.above.buf[at - sizeof(int)], sizeof(int));
+		at -= sizeof(int) + len;
+		memcpy(&old.buf[old.len], &US.above.buf[at], len);
+		old.len += len;
+	}
+	memcpy(&old.buf[old.len], US.below.buf, US.below.len);
+	old.len += US.below.len;
+
+	struct packedRows now = { NULL, 0, 0 };
+	editorUndoPack(&now, US.first, US.end);
+
+	struct undoRecord record = { UNDO_REPLACE_ROWS, U.group, US.first, old.len, US.oldRows, US.end - US.first, 0, U.groupCx, U.groupCy };
+	int fits = (undoRecordSize(old.len + now.len) <= UNDO_MEMORY_LIMIT);
+	if (fits) {
+		editorUndoAppend(&record, old.buf, old.len, now.buf, now.len);
+	} else {
+		record.type = UNDO_BARRIER;
+		editorUndoAppend(&record, NULL, 0, NULL, 0);
+		editorSetStatusMessage("Macro run too large to undo, older edits can't be undone past it");
+	}
+	free(old.buf);
+	free(now.buf);
+	return fits;
+}
+
+// Returns 0 if the run was too large to record
+int editorUndoSpanEnd() {
+	int fits = editorUndoSpanFlush();
+	US.running = 0;
+	return fits;
+}
+
+// Records replacing delLen chars at col of row with insLen chars
+// Called before the row changes
+void editorUndoSplice(int row, int col, const char *deleted, int delLen, const char *inserted, int insLen) {
+	if (!editorUndoRecording() || (delLen == 0 && insLen == 0)) {
+		return;
+	}
+	if (US.running) {
+		editorUndoTouch(row, 1, 0, 0);
+		return;
+	}
+	if (delLen + insLen == 1 && editorUndoMerge(row, col, deleted, delLen, inserted, insLen)) {
+		return;
+	}
+
+	struct undoRecord record = { UNDO_SPLICE, U.group, row, col, delLen, insLen, 0, U.groupCx, U.groupCy };
+	editorUndoAppend(&record, deleted, delLen, inserted, insLen);
+}
+
+// Records count rows from at, after they're inserted or before they're
+// deleted
+void editorUndoRows(int type, int at, int count) {
+	if (!editorUndoRecording()) {
+		return;
+	}
+	if (US.running) {
+		if (type == UNDO_INSERT_ROWS) {
+			editorUndoTouch(at, 0, count, count);
+		} else {
+			editorUndoTouch(at, count, -count, 0);
+		}
+		return;
+	}
+
+	int textLen = 0;
+	int j;
+	for (j = at; j < at + count; j++) {
+		textLen += sizeof(int) + E.row[j].size;
+	}
+	if (undoRecordSize(textLen) > UNDO_MEMORY_LIMIT) {
+		editorUndoReset();
+		U.dropped = U.group;
+		editorSetStatusMessage("Edit too large to undo, history cleared");
+		return;
+	}
+
+	char *packed = malloc(textLen ? textLen : 1);
+	char *p = packed;
+	for (j = at; j < at + count; j++) {
+		memcpy(p, &E.row[j].size, sizeof(int));
+		p += sizeof(int);
+		memcpy(p, E.row[j].chars, E.row[j].size);
+		p += E.row[j].size;
+	}
+
+	struct undoRecord record = { type, U.group, at, 0, count, 0, 0, U.groupCx, U.groupCy };
+	editorUndoAppend(&record, packed, textLen, NULL, 0);
+	free(packed);
+}
+
+// Applies a record backwards for undo or forwards for redo
+void editorUndoApply(struct undoRecord *record, const char *text, int undo) {
+	int type = record->type;
+	if (undo && (type == UNDO_INSERT_ROWS || type == UNDO_DELETE_ROWS)) {
+		type = (type == UNDO_INSERT_ROWS) ? UNDO_DELETE_ROWS : UNDO_INSERT_ROWS;
+	}
+
+	if (type == UNDO_SPLICE) {
+		editorRow *row = &E.row[record->row];
+		if (undo) {
+			editorRowSplice(row, record->col, record->inserted, text, record->deleted);
+		} else {
+			editorRowSplice(row, record->col, record->deleted, text + record->deleted, record->inserted);
+		}
+	} else if (type == UNDO_INSERT_ROWS) {
+		editorInsertRowsPacked(record->row, record->deleted, text);
+	} else if (type == UNDO_DELETE_ROWS) {
+		editorDeleteRows(record->row, record->deleted);
+	} else if (type == UNDO_REPLACE_ROWS) {
+		// The old rows come first in the text, then the new ones
+		if (undo) {
+			editorDeleteRows(record->row, record->inserted);
+			editorInsertRowsPacked(record->row, record->deleted, text);
+		} else {
+			editorDeleteRows(record->row, record->deleted);
+			editorInsertRowsPacked(record->row, record->inserted, text + record->col);
+		}
+	}
+}
+
+void editorUndoClampCursor() {
+	if (E.cy > E.numRows) {
+		E.cy = E.numRows;
+	}
+	if (E.cy < 0) {
+		E.cy = 0;
+	}
+	int size = (E.cy < E.numRows) ? E.row[E.cy].size : 0;
+	if (E.cx > size) {
+		E.cx = size;
+	}
+}
+
+// Reverts the last group of edits, however many rows it touched
+void editorUndo() {
+	if (US.running) {
+		editorSetStatusMessage("Can't undo while a macro runs");
+		return;
+	}
+	if (U.position == 0) {
+		editorSetStatusMessage("Nothing to undo");
+		return;
+	}
+
+	struct undoRecord record;
+	int start = editorUndoReadBack(U.position, &record);
+	if (record.type == UNDO_BARRIER) {
+		editorSetStatusMessage("Can't undo past a macro run too large to record");
+		return;
+	}
+	int group = record.group;
+	U.paused = 1;
+	while (1) {
+		editorUndoApply(&record, &U.buf[start + sizeof(struct undoRecord)], 1);
+		U.position = start;
+		E.cx = record.cx;
+		E.cy = record.cy;
+		if (U.position == 0) {
+			break;
+		}
+		int previous = editorUndoReadBack(U.position, &record);
+		if (record.group != group || record.type == UNDO_BARRIER) {
+			break;
+		}
+		start = previous;
+	}
+	U.paused = 0;
+	editorUndoClampCursor();
+}
+
+void editorRedo() {
+	if (US.running) {
+		editorSetStatusMessage("Can't redo while a macro runs");
+		return;
+	}
+	if (U.position == U.used) {
+		editorSetStatusMessage("Nothing to redo");
+		return;
+	}
+
+	struct undoRecord record;
+	memcpy(&record, &U.buf[U.position], sizeof(struct undoRecord));
+	int group = record.group;
+	U.paused = 1;
+	while (U.position < U.used) {
+		memcpy(&record, &U.buf[U.position], sizeof(struct undoRecord));
+		if (record.group != group) {
+			break;
+		}
+		editorUndoApply(&record, &U.buf[U.position + sizeof(struct undoRecord)], 0);
+		U.position += undoRecordSize(record.textLen);
+
+		E.cy = record.row;
+		E.cx = (record.type == UNDO_SPLICE) ? record.col + record.inserted : 0;
+	}
+	U.paused = 0;
+	editorUndoClampCursor();
+}
+
+/*** clipboard ***/
+
+// Copied text, its rows packed as for editorInsertRowsPacked()
+// Clips are shared by reference: the clipboard holds one, and a paste
+// holds another while it runs, so the text is never copied again
+struct clip {
+	int refs;
+	int count;
+	int len;
+	char packed[];
+};
+
+#define CB (mioCurrent->clip)
+
+void clipRelease(struct clip *clip) {
+	if (clip && --clip->refs == 0) {
+		free(clip);
+	}
+}
+
+// Moves a position on the tilde line to the end of the last row
+void editorClampPosition(int *y, int *x) {
+	if (*y >= E.numRows) {
+		*y = E.numRows - 1;
+		*x = E.row[*y].size;
+	}
+	if (*x > E.row[*y].size) {
+		*x = E.row[*y].size;
+	}
+}
+
+// Fills in the region between the mark and the cursor, start first
+// Returns 0 if there's no mark or the region is empty
+int editorRegion(int *sy, int *sx, int *ey, int *ex) {
+	if (!E.markSet || E.numRows == 0) {
+		return 0;
+	}
+
+	int my = E.markY;
+	int mx = E.markX;
+	int cy = E.cy;
+	int cx = E.cx;
+	editorClampPosition(&my, &mx);
+	editorClampPosition(&cy, &cx);
+
+	if (my < cy || (my == cy && mx < cx)) {
+		*sy = my;
+		*sx = mx;
+		*ey = cy;
+		*ex = cx;
+	} else {
+		*sy = cy;
+		*sx = cx;
+		*ey = my;
+		*ex = mx;
+	}
+	return *sy != *ey || *sx != *ex;
+}
+
+// Packs the region into a new clip in one pass
+struct clip *editorRegionCopy(int sy, int sx, int ey, int ex) {
+	int len = 0;
+	int j;
+	for (j = sy; j <= ey; j++) {
+		int from = (j == sy) ? sx : 0;
+		int to = (j == ey) ? ex : E.row[j].size;
+		len += sizeof(int) + to - from;
+	}
+
+	struct clip *clip = malloc(sizeof(struct clip) + len);
+	clip->refs = 1;
+	clip->count = ey - sy + 1;
+	clip->len = len;
+	char *p = clip->packed;
+	for (j = sy; j <= ey; j++) {
+		int from = (j == sy) ? sx : 0;
+		int size = ((j == ey) ? ex : E.row[j].size) - from;
+		memcpy(p, &size, sizeof(int));
+		p += sizeof(int);
+		memcpy(p, &E.row[j].chars[from], size);
+		p += size;
+	}
+	return clip;
+}
+
+// Removes the region: the first row takes on the tail of the last one
+// and the rows in between go in a single splice of the row array
+void editorRegionDelete(int sy, int sx, int ey, int ex) {
+	if (sy == ey) {
+		editorRowSplice(&E.row[sy], sx, ex - sx, "", 0);
+		return;
+	}
+
+	editorRow *last = &E.row[ey];
+	editorRowSplice(&E.row[sy], sx, E.row[sy].size - sx, &last->chars[ex], last->size - ex);
+	editorDeleteRows(sy + 1, ey - sy);
+}
+
+void editorToggleMark() {
+	if (E.markSet && E.markX == E.cx && E.markY == E.cy) {
+		E.markSet = 0;
+		editorSetStatusMessage("Mark cleared");
+		return;
+	}
+	E.markSet = 1;
+	E.markX = E.cx;
+	E.markY = E.cy;
+	editorSetStatusMessage("Mark set");
+}
+
+void editorCopy(int cut) {
+	int sy, sx, ey, ex;
+	if (!editorRegion(&sy, &sx, &ey, &ex)) {
+		editorSetStatusMessage("No region, set the mark with ^A");
+		return;
+	}
+
+	clipRelease(CB);
+	CB = editorRegionCopy(sy, sx, ey, ex);
+	if (cut) {
+		editorRegionDelete(sy, sx, ey, ex);
+		E.cy = sy;
+		E.cx = sx;
+	}
+	E.markSet = 0;
+	editorSetStatusMessage("%s %d %s", cut ? "Cut" : "Copied", CB->count, (CB->count == 1) ? "line" : "lines");
+}
+
+void editorPaste() {
+	if (CB == NULL) {
+		editorSetStatusMessage("Nothing to paste");
+		return;
+	}
+
+	struct clip *clip = CB;
+	clip->refs++;
+	if (E.cy == E.numRows) {
+		editorInsertRow(E.numRows, "", 0);
+	}
+
+	editorRow *row = &E.row[E.cy];
+	int firstLen;
+	memcpy(&firstLen, clip->packed, sizeof(int));
+	const char *first = clip->packed + sizeof(int);
+
+	if (clip->count == 1) {
+		editorRowSplice(row, E.cx, 0, first, firstLen);
+		E.cx += firstLen;
+	} else {
+		// The cursor's row ends with the first copied row and its tail
+		// moves to the end of the last one, the rows between go in at once
+		int tailLen = row->size - E.cx;
+		char *tail = malloc(tailLen + 1);
+		memcpy(tail, &row->chars[E.cx], tailLen);
+
+		editorRowSplice(row, E.cx, tailLen, first, firstLen);
+		editorInsertRowsPacked(E.cy + 1, clip->count - 1, first + firstLen);
+		E.cy += clip->count - 1;
+		row = &E.row[E.cy];
+		E.cx = row->size;
+		editorRowSplice(row, row->size, 0, tail, tailLen);
+		free(tail);
+	}
+	clipRelease(clip);
+}
+
+/*** multiple cursors ***/
+
+// Extra cursors for column edits, one keypress is applied at all of
+// them with each row rebuilt once
+// The primary cursor (E.cx, E.cy) is one of them
+struct cursor {
+	int row;
+	int col;
+};
+
+struct cursorList {
+	struct cursor *cursors; // sorted by row, then col
+	int count;
+	int capacity;
+};
+
+#define MC (*mioCurrent->cursors)
+
+enum cursorEdit {
+	CURSOR_INSERT,
+	CURSOR_BACKSPACE,
+	CURSOR_DELETE
+};
+
+int editorCursorsActive() {
+	return MC.count > 0;
+}
+
+void editorCursorsClear() {
+	MC.count = 0;
+}
+
+int cursorCompare(const void *a, const void *b) {
+	const struct cursor *x = a;
+	const struct cursor *y = b;
+	if (x->row != y->row) {
+		return x->row - y->row;
+	}
+	return x->col - y->col;
+}
+
+// Sorts the cursors and merges the ones that ended up in the same place
+void editorCursorsNormalize() {
+	qsort(MC.cursors, MC.count, sizeof(struct cursor), cursorCompare);
+	int kept = 0;
+	int j;
+	for (j = 0; j < MC.count; j++) {
+		if (kept == 0 || cursorCompare(&MC.cursors[kept - 1], &MC.cursors[j]) != 0) {
+			MC.cursors[kept++] = MC.cursors[j];
+		}
+	}
+	MC.count = kept;
+}
+
+// Index of the first cursor on row, or MC.count
+int editorCursorsOnRow(int row) {
+	int low = 0;
+	int high = MC.count;
+	while (low < high) {
+		int mid = low + (high - low) / 2;
+		if (MC.cursors[mid].row < row) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+// Moves the primary cursor to the first cursor left on its row
+void editorCursorsSyncPrimary() {
+	int j = editorCursorsOnRow(E.cy);
+	if (j < MC.count && MC.cursors[j].row == E.cy) {
+		E.cx = MC.cursors[j].col;
+	}
+}
+
+// Puts a cursor on every line of the region, all in the cursor's
+// screen column or at the end of shorter lines
+void editorCursorsFromRegion() {
+	int sy, sx, ey, ex;
+	if (!editorRegion(&sy, &sx, &ey, &ex)) {
+		editorSetStatusMessage("No region, set the mark with ^A");
+		return;
+	}
+	if (E.cy >= E.numRows) {
+		E.cy = E.numRows - 1;
+		E.cx = E.row[E.cy].size;
+	}
+
+	int count = ey - sy + 1;
+	if (count > MC.capacity) {
+		MC.capacity = count;
+		MC.cursors = realloc(MC.cursors, sizeof(struct cursor) * MC.capacity);
+	}
+	int rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+	int j;
+	for (j = 0; j < count; j++) {
+		MC.cursors[j].row = sy + j;
+		MC.cursors[j].col = editorRowRxToCx(&E.row[sy + j], rx);
+	}
+	MC.count = count;
+	E.markSet = 0;
+	editorCursorsSyncPrimary();
+	editorSetStatusMessage("%d cursors, ESC to leave", count);
+}
+
+// Applies one edit at every cursor
+// Each row's chars are rebuilt in a single pass however many cursors
+// it holds, then the changed rows are rendered and highlighted once
+void editorCursorsEdit(int edit, int c) {
+	editorIndexPause();
+	int *changed = malloc(sizeof(int) * MC.count);
+	int changedCount = 0;
+	char ch = c;
+
+	int i = 0;
+	while (i < MC.count) {
+		int rowIndex = MC.cursors[i].row;
+		int end = i;
+		while (end < MC.count && MC.cursors[end].row == rowIndex) {
+			end++;
+		}
+		editorRow *row = &E.row[rowIndex];
+
+		int insLen = (edit == CURSOR_INSERT);
+		char *chars = malloc(row->size + (end - i) * insLen + 1);
+		int src = 0;
+		int out = 0;
+		int edits = 0;
+		int j;
+		for (j = i; j < end; j++) {
+			// Each cursor replaces chars [at, at + delLen) with insLen chars
+			int col = MC.cursors[j].col;
+			int at = col;
+			int delLen = 0;
+			if (edit == CURSOR_BACKSPACE && col > 0) {
+				at = col - 1;
+				delLen = 1;
+			} else if (edit == CURSOR_DELETE && col < row->size) {
+				delLen = 1;
+			}
+			if (at < src) {
+				// A neighbouring cursor already took this char
+				at = src;
+				delLen = 0;
+			}
+
+			memcpy(&chars[out], &row->chars[src], at - src);
+			out += at - src;
+			editorUndoSplice(rowIndex, out, &row->chars[at], delLen, &ch, insLen);
+			if (insLen) {
+				chars[out++] = ch;
+			}
+			MC.cursors[j].col = out;
+			src = at + delLen;
+			edits += delLen + insLen;
+		}
+		memcpy(&chars[out], &row->chars[src], row->size - src);
+		out += row->size - src;
+		chars[out] = '\0';
+
+		if (edits) {
+			free(row->chars);
+			row->chars = chars;
+			row->size = out;
+			changed[changedCount++] = rowIndex;
+			E.dirty++;
+		} else {
+			free(chars);
+		}
+		i = end;
+	}
+
+	editorUpdateRows(changed, changedCount);
+	free(changed);
+	editorCursorsNormalize();
+	editorCursorsSyncPrimary();
+}
+
+// Moves every cursor within its row
+void editorCursorsMove(int key) {
+	int j;
+	for (j = 0; j < MC.count; j++) {
+		struct cursor *cursor = &MC.cursors[j];
+		int size = E.row[cursor->row].size;
+		if (key == ARROW_LEFT && cursor->col > 0) {
+			cursor->col--;
+		} else if (key == ARROW_RIGHT && cursor->col < size) {
+			cursor->col++;
+		} else if (key == HOME_KEY) {
+			cursor->col = 0;
+		} else if (key == END_KEY) {
+			cursor->col = size;
+		}
+	}
+	editorCursorsNormalize();
+	editorCursorsSyncPrimary();
+}
+
+// Handles a keypress while there are several cursors
+// Returns 0 for keys that only act at the primary cursor, which also
+// leave multi-cursor mode
+int editorCursorsKeypress(int c) {
+	switch (c) {
+		case BACKSPACE:
+		case CTRL_KEY('h'):
+			editorCursorsEdit(CURSOR_BACKSPACE, 0);
+			return 1;
+
+		case DEL_KEY:
+			editorCursorsEdit(CURSOR_DELETE, 0);
+			return 1;
+
+		case ARROW_LEFT:
+		case ARROW_RIGHT:
+		case HOME_KEY:
+		case END_KEY:
+			editorCursorsMove(c);
+			return 1;
+
+		case CTRL_KEY('b'):
+			editorCursorsMove(HOME_KEY);
+			return 1;
+
+		case CTRL_KEY('e'):
+			editorCursorsMove(END_KEY);
+			return 1;
+	}
+	if (c == '\t' || (c < 256 && !iscntrl(c))) {
+		editorCursorsEdit(CURSOR_INSERT, c);
+		return 1;
+	}
+	editorCursorsClear();
+	return 0;
+}
+
+/*** reload ***/
+
+// Open files are watched through one inotify watch per directory, so
+// files replaced by renaming over them are seen too
+struct fileWatch {
+	int fd;
+	int changed; // the current file changed, not handled yet
+	int waiting; // waiting for a command key, no prompt is open
+};
+
+#define W (*mioCurrent->watch)
+
+int editorWatchWaiting() {
+	return W.waiting;
+}
+
+// Returns 1 once after the poll saw the current file change
+int editorWatchTakeChange() {
+	int changed = W.changed;
+	W.changed = 0;
+	return changed;
+}
+
+// The upcoming lines of a file being reloaded, read on demand
+struct diskLine {
+	const char *s;
+	int len;
+	uint64_t hash; // 0 until it's needed
+};
+
+struct diskReader {
+	const char *data;
+	size_t size;
+	size_t pos;
+	struct diskLine *ahead; // lines read but not consumed yet
+	int first;
+	int count;
+	int capacity;
+};
+
+// Starts watching the current buffer's directory
+void editorWatchFile() {
+	E.disk.watch = -1;
+	if (E.filename == NULL || E.headless) {
+		return;
+	}
+	if (W.fd == -1 && (W.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+		return;
+	}
+
+	const char *slash = strrchr(E.filename, '/');
+	char *dir = slash ? strndup(E.filename, (slash == E.filename) ? 1 : slash - E.filename) : strdup(".");
+	// Writers appending to logs don't close the file between writes, the
+	// modify and create events are only used by followed buffers
+	E.disk.watch = inotify_add_watch(W.fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY | IN_CREATE);
+	free(dir);
+}
+
+// Remembers the file's size and mtime as the version the buffer has
+void editorDiskStamp(const struct stat *st) {
+	E.disk.size = st->st_size;
+	E.disk.time = st->st_mtim;
+	E.disk.inode = st->st_ino;
+}
+
+// Returns 1 if the file on disk isn't the version last read or written
+int editorDiskChanged() {
+	struct stat st;
+	if (E.filename == NULL || stat(E.filename, &st) == -1) {
+		return 0;
+	}
+	return st.st_size != E.disk.size || st.st_mtim.tv_sec != E.disk.time.tv_sec || st.st_mtim.tv_nsec != E.disk.time.tv_nsec;
+}
+
+// Returns the line k places ahead, or NULL past the end of the file
+struct diskLine *diskPeek(struct diskReader *reader, int k) {
+	while (reader->count <= k) {
+		if (reader->pos >= reader->size) {
+			return NULL;
+		}
+		if (reader->first + reader->count == reader->capacity) {
+			// Slide the unconsumed lines down before growing
+			memmove(reader->ahead, &reader->ahead[reader->first], sizeof(struct diskLine) * reader->count);
+			reader->first = 0;
+			if (reader->count == reader->capacity) {
+				reader->capacity = reader->capacity ? reader->capacity * 2 : 64;
+				reader->ahead = realloc(reader->ahead, sizeof(struct diskLine) * reader->capacity);
+			}
+		}
+
+		const char *start = reader->data + reader->pos;
+		const char *newline = memchr(start, '\n', reader->size - reader->pos);
+		size_t len = newline ? (size_t)(newline - start) : reader->size - reader->pos;
+		reader->pos += len + (newline != NULL);
+		while (len > 0 && start[len - 1] == '\r') {
+			len--;
+		}
+
+		struct diskLine *line = &reader->ahead[reader->first + reader->count++];
+		line->s = start;
+		line->len = len;
+		line->hash = 0;
+	}
+	return &reader->ahead[reader->first + k];
+}
+
+uint64_t diskLineHash(struct diskLine *line) {
+	if (line->hash == 0) {
+		line->hash = lineHash(line->s, line->len);
+	}
+	return line->hash;
+}
+
+void diskSkip(struct diskReader *reader, int n) {
+	reader->first += n;
+	reader->count -= n;
+}
+
+// What a row is lined up by: the hash of the line it was read as when
+// merging, so local edits don't count as differences, else its text
+uint64_t editorRowKey(int at, int merge) {
+	return merge ? E.rowCold[at].diskHash : lineHash(E.row[at].chars, E.row[at].size);
+}
+
+// Returns 1 if the row matches the line, comparing the text directly
+// unless merging so only lines that differ get hashed
+int editorRowMatches(int at, struct diskLine *line, int merge) {
+	if (merge) {
+		return E.rowCold[at].diskHash == diskLineHash(line);
+	}
+	return E.row[at].size == line->len && !memcmp(E.row[at].chars, line->s, line->len);
+}
+
+// Finds the nearest place the rows from at and the upcoming lines agree
+// again, as rows and lines to skip with the fewest skipped in total
+// Looks a little way ahead first and further only while nothing's found
+// Returns 0 if they don't agree within RELOAD_SYNC_LINES
+int editorReloadSync(struct diskReader *reader, int at, int merge, int *rows, int *lines) {
+	int window;
+	for (window = 16; ; window *= 4) {
+		if (window > RELOAD_SYNC_LINES) {
+			window = RELOAD_SYNC_LINES;
+		}
+
+		// Upcoming lines by hash, open addressing, first occurrence wins
+		int tableSize = window * 2;
+		int *table = calloc(tableSize, sizeof(int));
+		int n;
+		struct diskLine *line;
+		for (n = 0; n < window && (line = diskPeek(reader, n)) != NULL; n++) {
+			uint64_t hash = diskLineHash(line);
+			int slot = hash & (tableSize - 1);
+			while (table[slot] && diskPeek(reader, table[slot] - 1)->hash != hash) {
+				slot = (slot + 1) & (tableSize - 1);
+			}
+			if (!table[slot]) {
+				table[slot] = n + 1;
+			}
+		}
+
+		int best = -1;
+		int a;
+		for (a = 0; a < window && at + a < E.numRows && (best == -1 || a < best); a++) {
+			if (merge && E.rowCold[at + a].diskHash == 0) {
+				continue;
+			}
+			uint64_t key = editorRowKey(at + a, merge);
+			int slot = key & (tableSize - 1);
+			while (table[slot] && diskPeek(reader, table[slot] - 1)->hash != key) {
+				slot = (slot + 1) & (tableSize - 1);
+			}
+			if (table[slot] && (best == -1 || a + table[slot] - 1 < best)) {
+				best = a + table[slot] - 1;
+				*rows = a;
+				*lines = table[slot] - 1;
+			}
+		}
+		free(table);
+
+		if (best != -1) {
+			return 1;
+		}
+		if (window == RELOAD_SYNC_LINES || (at + window >= E.numRows && n < window)) {
+			return 0;
+		}
+	}
+}
+
+// Replaces rows [at, at + rows) with the next lines lines
+void editorReloadHunk(struct diskReader *reader, int at, int rows, int lines) {
+	int pairs = (rows < lines) ? rows : lines;
+	int k;
+	for (k = 0; k < pairs; k++) {
+		struct diskLine *line = diskPeek(reader, k);
+		editorRowSplice(&E.row[at + k], 0, E.row[at + k].size, line->s, line->len);
+		E.rowCold[at + k].diskHash = diskLineHash(line);
+	}
+	if (rows > lines) {
+		editorDeleteRows(at + lines, rows - lines);
+	} else if (lines > rows) {
+		int packedLen = 0;
+		for (k = rows; k < lines; k++) {
+			packedLen += sizeof(int) + diskPeek(reader, k)->len;
+		}
+		char *packed = malloc(packedLen);
+		char *p = packed;
+		for (k = rows; k < lines; k++) {
+			struct diskLine *line = diskPeek(reader, k);
+			memcpy(p, &line->len, sizeof(int));
+			memcpy(p + sizeof(int), line->s, line->len);
+			p += sizeof(int) + line->len;
+		}
+		editorInsertRowsPacked(at + rows, lines - rows, packed);
+		free(packed);
+		for (k = rows; k < lines; k++) {
+			E.rowCold[at + k].diskHash = diskLineHash(diskPeek(reader, k));
+		}
+	}
+
+	// Keep the cursor on the same text
+	if (E.cy >= at + rows) {
+		E.cy += lines - rows;
+	} else if (E.cy >= at + lines) {
+		E.cy = (lines > 0) ? at + lines - 1 : at;
+	}
+}
+
+// Returns 1 if any of rows [at, at + rows) differs from what was on disk
+int editorRowsEdited(int at, int rows) {
+	int k;
+	for (k = at; k < at + rows; k++) {
+		if (lineHash(E.row[k].chars, E.row[k].size) != E.rowCold[k].diskHash) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Brings the buffer in line with its file on disk, only the lines that
+// differ are replaced
+// Merging keeps local edits: rows are compared as they were read, and a
+// change on disk to rows edited here is left out as a conflict
+void editorReload(int merge) {
+	int fd = open(E.filename, O_RDONLY);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		if (fd != -1) {
+			close(fd);
+		}
+		editorSetStatusMessage("Can't reload! %s", strerror(errno));
+		return;
+	}
+	char *data = NULL;
+	if (st.st_size > 0 && (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		editorSetStatusMessage("Can't reload! %s", strerror(errno));
+		return;
+	}
+
+	editorUndoBegin();
+	editorCursorsClear();
+	E.markSet = 0;
+
+	struct diskReader reader = { data, st.st_size, 0, NULL, 0, 0, 0 };
+	int changed = 0;
+	int conflicts = 0;
+	int at = 0;
+	while (1) {
+		while (merge && at < E.numRows && E.rowCold[at].diskHash == 0) {
+			at++;
+		}
+		struct diskLine *line = diskPeek(&reader, 0);
+		if (line == NULL && at >= E.numRows) {
+			break;
+		}
+		if (line != NULL && at < E.numRows && editorRowMatches(at, line, merge)) {
+			at++;
+			diskSkip(&reader, 1);
+			continue;
+		}
+
+		int rows = 0;
+		int lines = 0;
+		if (!editorReloadSync(&reader, at, merge, &rows, &lines)) {
+			// Nothing lines up again, the rest of the file is the change
+			rows = E.numRows - at;
+			for (lines = 0; diskPeek(&reader, lines) != NULL; lines++) {
+			}
+		}
+
+		if (merge && editorRowsEdited(at, rows)) {
+			conflicts++;
+			at += rows;
+		} else {
+			editorReloadHunk(&reader, at, rows, lines);
+			changed += (rows > lines) ? rows : lines;
+			at += lines;
+		}
+		diskSkip(&reader, lines);
+	}
+	free(reader.ahead);
+	if (data) {
+		munmap(data, st.st_size);
+	}
+	close(fd);
+
+	if (E.cy > E.numRows) {
+		E.cy = E.numRows;
+	}
+	if (E.cy < E.numRows && E.cx > E.row[E.cy].size) {
+		E.cx = E.row[E.cy].size;
+	}
+	editorDiskStamp(&st);
+	const char *lines = (changed == 1) ? "line" : "lines";
+	if (!merge) {
+		E.dirty = 0;
+		editorSetStatusMessage("Reloaded from disk, %d %s changed", changed, lines);
+	} else if (conflicts) {
+		editorSetStatusMessage("Merged %d %s from disk, kept yours in %d %s", changed, lines, conflicts, (conflicts == 1) ? "conflict" : "conflicts");
+	} else {
+		editorSetStatusMessage("Merged %d %s from disk", changed, lines);
+	}
+}
+
+// Handles the current file changing on disk, asking first if there are
+// unsaved edits
+void editorReloadCheck() {
+	// Rows are about to change under any scan still reading them
+	editorIndexPause();
+	if (E.disk.follow) {
+		editorFollowRead();
+		// Unless it stopped following to keep unsaved edits
+		if (E.disk.follow) {
+			return;
+		}
+	}
+	if (!editorDiskChanged()) {
+		return;
+	}
+	if (!E.dirty) {
+		editorReload(0);
+		return;
+	}
+
+	editorSetStatusMessage("%.20s changed on disk: r reload, m merge, any other key keeps yours", E.filename);
+	editorRefreshScreen();
+	int c = editorReadKey();
+	if (c == 'r') {
+		editorReload(0);
+	} else if (c == 'm') {
+		editorReload(1);
+	} else {
+		struct stat st;
+		if (stat(E.filename, &st) != -1) {
+			editorDiskStamp(&st);
+		}
+		editorSetStatusMessage("Kept your version, saving will overwrite the file");
+	}
+}
+
+// Reads pending inotify events and notes if the current file changed
+// The rows aren't touched here, a prompt or scan may be using them, the
+// change comes back as a FILE_CHANGED key once no prompt is open
+// Files of other buffers are checked when switched to
+void editorWatchPoll() {
+	if (W.fd == -1) {
+		return;
+	}
+
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const char *name = NULL;
+	if (E.filename) {
+		name = strrchr(E.filename, '/');
+		name = name ? name + 1 : E.filename;
+	}
+	int touched = 0;
+	ssize_t len;
+	while ((len = read(W.fd, buf, sizeof(buf))) > 0) {
+		char *p;
+		for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+			struct inotify_event *event = (struct inotify_event *)p;
+			// Other buffers wait for the writer to be done, rather than
+			// reading a half written file
+			int done = event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO);
+			if (name && event->wd == E.disk.watch && event->len && !strcmp(event->name, name) && (done || E.disk.follow)) {
+				touched = 1;
+			}
+		}
+	}
+
+	if (touched) {
+		W.changed = 1;
+	}
+}
+
+/*** follow ***/
+
+// Appends text read from the end of the file as rows, carrying on the
+// last row if the file didn't end in a newline
+// All the new rows go in with one insert and only they are highlighted
+void editorFollowAppend(const char *data, size_t len) {
+	const char *p = data;
+	const char *end = data + len;
+	if (E.disk.partial && E.numRows > 0 && p < end) {
+		const char *newline = memchr(p, '\n', end - p);
+		size_t n = newline ? (size_t)(newline - p) : (size_t)(end - p);
+		size_t keep = n;
+		while (newline && keep > 0 && p[keep - 1] == '\r') {
+			keep--;
+		}
+		editorRowAppendString(&E.row[E.numRows - 1], (char *)p, keep);
+		p += n + (newline != NULL);
+		E.disk.partial = (newline == NULL);
+	}
+	if (p == end) {
+		return;
+	}
+
+	// Packed as for editorInsertRowsPacked(), an int length per line
+	// never takes more room than the newline and chars it replaces plus
+	// one int for a last line without one
+	char *packed = malloc((end - p) * (sizeof(int) + 1) + sizeof(int));
+	char *out = packed;
+	int count = 0;
+	while (p < end) {
+		const char *newline = memchr(p, '\n', end - p);
+		int n = newline ? newline - p : end - p;
+		int keep = n;
+		while (newline && keep > 0 && p[keep - 1] == '\r') {
+			keep--;
+		}
+		memcpy(out, &keep, sizeof(int));
+		memcpy(out + sizeof(int), p, keep);
+		out += sizeof(int) + keep;
+		count++;
+		p += n + (newline != NULL);
+		E.disk.partial = (newline == NULL);
+	}
+	editorInsertRowsPacked(E.numRows, count, packed);
+	free(packed);
+}
+
+// Remembers the last bytes read, ending at offset end of data
+void editorFollowMark(const char *data, size_t end) {
+	size_t back = (end < FOLLOW_CHECK_BYTES) ? end : FOLLOW_CHECK_BYTES;
+	E.disk.tailHash = lineHash(data + end - back, back);
+}
+
+// Reads what was added to a followed file since it was last read
+// A file that shrank, was replaced (as log rotation does) or whose last
+// bytes read changed, as when truncated and written again, is read
+// again from the start, unless that would lose unsaved edits: then
+// following stops
+// Returns 1 if the buffer changed
+int editorFollowRead() {
+	int fd = open(E.filename, O_RDONLY);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		// Rotated away and not created again yet
+		if (fd != -1) {
+			close(fd);
+		}
+		return 0;
+	}
+
+	int restart = (st.st_ino != E.disk.inode || st.st_size < E.disk.size);
+	if (!restart && st.st_size == E.disk.size) {
+		close(fd);
+		editorDiskStamp(&st);
+		return 0;
+	}
+
+	// The last bytes already read are read again to check them
+	off_t back = restart ? 0 : ((E.disk.size < FOLLOW_CHECK_BYTES) ? E.disk.size : FOLLOW_CHECK_BYTES);
+	off_t from = restart ? 0 : E.disk.size - back;
+	size_t len = st.st_size - from;
+	char *data = malloc(len ? len : 1);
+	ssize_t nread = pread(fd, data, len, from);
+	if (nread < back) {
+		close(fd);
+		free(data);
+		return 0;
+	}
+	if (!restart && lineHash(data, back) != E.disk.tailHash) {
+		restart = 1;
+		free(data);
+		from = 0;
+		back = 0;
+		len = st.st_size;
+		data = malloc(len ? len : 1);
+		nread = pread(fd, data, len, 0);
+		if (nread < 0) {
+			close(fd);
+			free(data);
+			return 0;
+		}
+	}
+	close(fd);
+	if (restart && E.dirty) {
+		free(data);
+		E.disk.follow = 0;
+		editorSetStatusMessage("%.20s was truncated or replaced, stopped following to keep your edits", E.filename);
+		return 0;
+	}
+
+	// Followed text isn't an edit: it isn't undone or saved as a change
+	int dirty = E.dirty;
+	int atBottom = (E.rowOffset + E.screenRows >= E.numRows);
+	U.paused = 1;
+	if (restart) {
+		editorDeleteRows(0, E.numRows);
+		editorUndoReset();
+		E.disk.partial = 0;
+		E.cy = 0;
+		E.cx = 0;
+	}
+	editorFollowAppend(data + back, nread - back);
+	U.paused = 0;
+	E.dirty = dirty;
+	editorFollowMark(data, nread);
+	free(data);
+
+	editorDiskStamp(&st);
+	E.disk.size = from + nread;
+	if (atBottom && E.numRows > 0) {
+		E.cy = E.numRows - 1;
+		E.cx = 0;
+	}
+	if (restart) {
+		editorSetStatusMessage("%.20s was truncated or replaced, reading it again", E.filename);
+	}
+	return 1;
+}
+
+// Starts or stops following the current file as it grows, like tail -f
+void editorFollowToggle() {
+	if (E.disk.follow) {
+		E.disk.follow = 0;
+		editorSetStatusMessage("Stopped following");
+		return;
+	}
+	if (E.filename == NULL || E.disk.watch == -1) {
+		editorSetStatusMessage("Only files on disk can be followed");
+		return;
+	}
+
+	// Whether the last row is still being written, and the bytes the next
+	// read checks
+	char tail[FOLLOW_CHECK_BYTES];
+	off_t back = (E.disk.size < FOLLOW_CHECK_BYTES) ? E.disk.size : FOLLOW_CHECK_BYTES;
+	ssize_t nread = 0;
+	int fd = open(E.filename, O_RDONLY);
+	if (fd != -1) {
+		nread = pread(fd, tail, back, E.disk.size - back);
+		close(fd);
+	}
+	if (nread != back) {
+		editorSetStatusMessage("Can't follow %.20s: %s", E.filename, strerror(errno));
+		return;
+	}
+	E.disk.partial = (back > 0 && tail[back - 1] != '\n');
+	editorFollowMark(tail, back);
+	E.disk.follow = 1;
+
+	editorFollowRead();
+	if (!E.disk.follow) {
+		return;
+	}
+	if (E.numRows > 0) {
+		E.cy = E.numRows - 1;
+		E.cx = 0;
+	}
+	editorSetStatusMessage("Following %.20s, ^L to stop", E.filename);
+}
+
+/*** file i/o  ***/
+
+// Converts all of the editorRows to a string
+char *editorRowsToString(int *bufLen) {
+
+	// Add up the lengths of our rows
+	int totalLength = 0;
+	int j;
+	for (j = 0; j < E.numRows; j++) {
+		totalLength += E.row[j].size + 1;
+	}
+	*bufLen = totalLength;
+
+	// Allocate a buffer and copy our rows
+	char *buf = malloc(totalLength);
+	char *p = buf;
+	for (j = 0; j < E.numRows; j++) {
+		memcpy(p, E.row[j].chars, E.row[j].size);
+		p += E.row[j].size;
+		*p = '\n';
+		p++;
+	}
+
+	return buf;
+}
+
+// Reads the file fp was opened from into the current buffer and closes it
+void editorOpen(char *filename, FILE *fp) {
+    editorIndexReset();
+    free(E.filename);
+    E.filename = strdup(filename);
+
+    editorSelectSyntaxHighlight();
+
+    char *line = NULL;
+    size_t lineCap = 0; // line capacity
+    ssize_t lineLen;
+    U.paused = 1;
+    traceBegin("editorOpen");
+    traceMuted++;
+    while ((lineLen = getline(&line, &lineCap, fp)) != -1) {
+        while (lineLen > 0 && (line[lineLen - 1] == '\n' || line[lineLen - 1] == '\r')) {
+            lineLen--;
+        }
+        editorInsertRow(E.numRows, line, lineLen);
+        E.rowCold[E.numRows - 1].diskHash = lineHash(line, lineLen);
+    }
+    traceMuted--;
+    traceEndArg("editorOpen", "rows", E.numRows);
+    U.paused = 0;
+    editorUndoReset();
+
+    struct stat st;
+    if (fstat(fileno(fp), &st) != -1) {
+        editorDiskStamp(&st);
+    }
+    editorWatchFile();
+
+    free(line);
+    fclose(fp);
+    E.dirty = 0;
+}
+
+void editorSave() {
+	// Check if this is a new file
+	if (E.filename == NULL) {
+		E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+		if (E.filename == NULL) {
+			editorSetStatusMessage("Save aborted");
+			return;
+		}
+		editorSelectSyntaxHighlight();
+	}
+
+	int length;
+	char *buf = editorRowsToString(&length);
+
+	// Open the file and write to it
+	// TODO:
+	// Safer to write a temp file and then rename it to the file we're overwriting
+	// Be sure to check for errors
+	int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
+	if (fd != -1) {
+		if (ftruncate(fd, length) != -1) {
+			if (write(fd, buf, length) == length) {
+				struct stat st;
+				if (fstat(fd, &st) != -1) {
+					editorDiskStamp(&st);
+				}
+				close(fd);
+				for (int j = 0; j < E.numRows; j++) {
+					E.rowCold[j].diskHash = lineHash(E.row[j].chars, E.row[j].size);
+				}
+				if (E.disk.watch == -1) {
+					editorWatchFile();
+				}
+				free(buf);
+				E.dirty = 0;
+				editorSetStatusMessage("%d bytes written to disk", length);
+				return;
+			}
+		}
+		close(fd);
+	}
+	free(buf);
+	editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+}
+
+void editorOpenFile() {
+    char *file = editorPrompt("Select a file: %s (Use ESC/Enter)", NULL);
+    if (file == NULL) {
+        return;
+    }
+    editorOpenBuffer(file);
+    free(file);
+}
+
+/*** buffers ***/
+
+// The state each open file keeps while another one is on screen
+// The current buffer's lives in E and U, a switch just swaps it out
+struct editorBuffer {
+	int cx;
+	int cy;
+	int rowOffset;
+	int colOffset;
+	int numRows;
+	int rowCapacity;
+	editorRow *row;
+	struct rowCold *rowCold;
+	int dirty;
+	char *filename;
+	struct editorSyntax *syntax;
+	int markSet;
+	int markX;
+	int markY;
+	struct diskState disk;
+	struct undoLog undo;
+};
+
+struct bufferList {
+	struct editorBuffer *buffers; // the current one's slot is stale
+	int count;
+	int capacity;
+	int current;
+	struct editorBuffer killed; // the last one closed, kept whole
+	int hasKilled;
+	int killedAt; // where it was in the list
+};
+
+#define B (*mioCurrent->buffers)
+
+void editorBufferSave(struct editorBuffer *buffer) {
+	// A macro switching buffers leaves its span in the one it edited
+	editorUndoSpanFlush();
+	buffer->cx = E.cx;
+	buffer->cy = E.cy;
+	buffer->rowOffset = E.rowOffset;
+	buffer->colOffset = E.colOffset;
+	buffer->numRows = E.numRows;
+	buffer->rowCapacity = E.rowCapacity;
+	buffer->row = E.row;
+	buffer->rowCold = E.rowCold;
+	buffer->dirty = E.dirty;
+	buffer->filename = E.filename;
+	buffer->syntax = E.syntax;
+	buffer->markSet = E.markSet;
+	buffer->markX = E.markX;
+	buffer->markY = E.markY;
+	buffer->disk = E.disk;
+	buffer->undo = U;
+}
+
+void editorBufferLoad(struct editorBuffer *buffer) {
+	E.cx = buffer->cx;
+	E.cy = buffer->cy;
+	E.rx = 0;
+	E.rowOffset = buffer->rowOffset;
+	E.colOffset = buffer->colOffset;
+	E.numRows = buffer->numRows;
+	E.rowCapacity = buffer->rowCapacity;
+	E.row = buffer->row;
+	E.rowCold = buffer->rowCold;
+	E.dirty = buffer->dirty;
+	E.filename = buffer->filename;
+	E.syntax = buffer->syntax;
+	E.markSet = buffer->markSet;
+	E.markX = buffer->markX;
+	E.markY = buffer->markY;
+	E.disk = buffer->disk;
+	// Group numbers only have to differ between keypresses
+	int group = U.group;
+	U = buffer->undo;
+	U.group = group;
+}
+
+// Puts an empty buffer in E and U
+void editorBufferClear() {
+	struct editorBuffer empty = { 0, 0, 0, 0, 0, 0, NULL, NULL, 0, NULL, NULL, 0, 0, 0, { -1, 0, { 0, 0 }, 0, 0, 0, 0 }, { NULL, 0, 0, 0, 0, 0, 0, -1, 0 } };
+	editorBufferLoad(&empty);
+}
+
+// Makes buffer j current, nothing is reloaded or highlighted again
+void editorSwitchBuffer(int j) {
+	if (j == B.current || j < 0 || j >= B.count) {
+		return;
+	}
+	editorIndexReset();
+	editorBufferSave(&B.buffers[B.current]);
+	B.current = j;
+	editorBufferLoad(&B.buffers[j]);
+	editorReloadCheck();
+}
+
+// Adds an empty buffer after the others and makes it current
+void editorNewBuffer() {
+	if (B.count >= B.capacity) {
+		B.capacity = B.capacity ? B.capacity * 2 : 8;
+		B.buffers = realloc(B.buffers, sizeof(struct editorBuffer) * B.capacity);
+	}
+	editorIndexReset();
+	editorBufferSave(&B.buffers[B.current]);
+	B.current = B.count++;
+	editorBufferClear();
+}
+
+int editorBuffersDirty() {
+	int j;
+	for (j = 0; j < B.count; j++) {
+		if ((j == B.current) ? E.dirty : B.buffers[j].dirty) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Frees the buffer in E and U, its row array and undo log go to the
+// spare pool for the next one
+void editorBufferFree() {
+	int j;
+	for (j = 0; j < E.numRows; j++) {
+		editorFreeRow(&E.row[j]);
+	}
+	spareGive(E.row, E.rowCold, sizeof(editorRow) * E.rowCapacity);
+	spareGive(U.buf, NULL, U.capacity);
+	free(E.filename);
+}
+
+// Frees the buffer the last kill kept
+void editorDropKilled() {
+	if (!B.hasKilled) {
+		return;
+	}
+	struct editorBuffer current;
+	editorBufferSave(&current);
+	editorBufferLoad(&B.killed);
+	editorBufferFree();
+	editorBufferLoad(&current);
+	B.hasKilled = 0;
+}
+
+// Closes the current buffer
+// It's kept whole until the next kill so ^Z can bring it back, the one
+// kept before is freed then
+void editorKillCurrentBuffer() {
+	editorIndexReset();
+	editorDropKilled();
+	editorBufferSave(&B.killed);
+	B.hasKilled = 1;
+	B.killedAt = B.current;
+
+	if (B.count > 1) {
+		memmove(&B.buffers[B.current], &B.buffers[B.current + 1], sizeof(struct editorBuffer) * (B.count - B.current - 1));
+		B.count--;
+		if (B.current == B.count) {
+			B.current--;
+		}
+		editorBufferLoad(&B.buffers[B.current]);
+	} else {
+		editorBufferClear();
+	}
+	E.statusmsg[0] = '\0';
+	E.statusmsg_time = 0;
+}
+
+// Puts the buffer the last kill closed back where it was and makes it
+// current
+void editorRestoreKilled() {
+	if (!B.hasKilled) {
+		return;
+	}
+	editorIndexReset();
+	if (E.filename || E.numRows || E.dirty) {
+		if (B.count >= B.capacity) {
+			B.capacity = B.capacity ? B.capacity * 2 : 8;
+			B.buffers = realloc(B.buffers, sizeof(struct editorBuffer) * B.capacity);
+		}
+		editorBufferSave(&B.buffers[B.current]);
+		int at = (B.killedAt < B.count) ? B.killedAt : B.count;
+		memmove(&B.buffers[at + 1], &B.buffers[at], sizeof(struct editorBuffer) * (B.count - at));
+		B.count++;
+		B.current = at;
+	} else {
+		// Killing the only buffer left this empty one in its place
+		editorBufferFree();
+	}
+	editorBufferLoad(&B.killed);
+	B.hasKilled = 0;
+	editorReloadCheck();
+}
+
+// Switches to the buffer holding filename, opening it in a new buffer
+// if there isn't one
+// Returns 0 if the file can't be read
+int editorOpenBuffer(const char *filename) {
+	int j;
+	for (j = 0; j < B.count; j++) {
+		const char *name = (j == B.current) ? E.filename : B.buffers[j].filename;
+		if (name && !strcmp(name, filename)) {
+			editorSwitchBuffer(j);
+			return 1;
+		}
+	}
+
+	FILE *fp = fopen(filename, "r");
+	if (fp == NULL) {
+		editorSetStatusMessage("Can't open %s: %s", filename, strerror(errno));
+		return 0;
+	}
+
+	// An untouched empty buffer is reused rather than left behind
+	if (E.filename || E.numRows || E.dirty) {
+		editorNewBuffer();
+	}
+	char *name = strdup(filename);
+	editorOpen(name, fp);
+	free(name);
+	return 1;
+}
+
+void editorNextBuffer() {
+	if (B.count == 1) {
+		editorSetStatusMessage("No other buffers");
+		return;
+	}
+	editorSwitchBuffer((B.current + 1) % B.count);
+}
+
+/*** worker pool ***/
+
+// A set of independent tasks handed out to the pool's threads
+// Tasks should poll batchCancelled() and return early once it's set
+// They run as the editor that submitted the batch
+struct workBatch {
+	void (*run)(struct workBatch *batch, int task);
+	void *data;
+	struct mio *editor;
+	int tasks;
+	int next;      // next task to hand out
+	int done;      // tasks finished or skipped
+	int cancelled;
+	struct workBatch *queueNext;
+};
+
+struct workerPool {
+	pthread_mutex_t lock;
+	pthread_cond_t work;     // a batch was queued
+	pthread_cond_t progress; // a task finished
+	int numThreads;
+	struct workBatch *queue;
+};
+
+// Shared by every editor in the process
+struct workerPool WP = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, NULL };
+pthread_once_t poolStarted = PTHREAD_ONCE_INIT;
+
+// Which of the pool's threads this is, from 0 to WP.numThreads - 1
+__thread int poolWorkerId;
+
+void *poolWorker(void *arg) {
+	poolWorkerId = (intptr_t)arg;
+	pthread_mutex_lock(&WP.lock);
+	while (1) {
+		while (WP.queue == NULL) {
+			pthread_cond_wait(&WP.work, &WP.lock);
+		}
+
+		struct workBatch *batch = WP.queue;
+		int task = batch->next++;
+		if (batch->next == batch->tasks) {
+			WP.queue = batch->queueNext;
+		}
+		pthread_mutex_unlock(&WP.lock);
+
+		mioCurrent = batch->editor;
+		batch->run(batch, task);
+
+		pthread_mutex_lock(&WP.lock);
+		batch->done++;
+		pthread_cond_broadcast(&WP.progress);
+	}
+	return NULL;
+}
+
+// Threads are started on first use, SEARCH_THREADS of them or one per CPU
+// If none can be, each batch is run by the thread that submits it
+void poolStart() {
+	int threads = SEARCH_THREADS;
+	if (threads <= 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (threads <= 0) {
+		threads = 1;
+	}
+
+	int j;
+	for (j = 0; j < threads; j++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, poolWorker, (void *)(intptr_t)j) != 0) {
+			break;
+		}
+		pthread_detach(thread);
+		WP.numThreads++;
+	}
+}
+
+// Starts the pool if it isn't yet and returns its number of threads,
+// 1 when batches run on the submitting thread
+int poolThreads() {
+	pthread_once(&poolStarted, poolStart);
+	return WP.numThreads ? WP.numThreads : 1;
+}
+
+int batchCancelled(struct workBatch *batch) {
+	return __atomic_load_n(&batch->cancelled, __ATOMIC_RELAXED);
+}
+
+void poolSubmit(struct workBatch *batch) {
+	pthread_once(&poolStarted, poolStart);
+
+	batch->editor = mioCurrent;
+	batch->next = 0;
+	batch->done = 0;
+	batch->cancelled = 0;
+	batch->queueNext = NULL;
+	if (batch->tasks == 0) {
+		return;
+	}
+	if (WP.numThreads == 0) {
+		// No workers to hand it to, poolWorkerId is 0 on this thread
+		for (; batch->next < batch->tasks; batch->next++, batch->done++) {
+			if (!batchCancelled(batch)) {
+				batch->run(batch, batch->next);
+			}
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&WP.lock);
+	struct workBatch **tail = &WP.queue;
+	while (*tail) {
+		tail = &(*tail)->queueNext;
+	}
+	*tail = batch;
+	pthread_cond_broadcast(&WP.work);
+	pthread_mutex_unlock(&WP.lock);
+}
+
+// Waits until ready(batch) holds or every task has finished
+// ready is called with the pool lock held, pass NULL to wait for all tasks
+void poolWaitUntil(struct workBatch *batch, int (*ready)(struct workBatch *)) {
+	pthread_mutex_lock(&WP.lock);
+	while (batch->done < batch->tasks && !(ready && ready(batch))) {
+		pthread_cond_wait(&WP.progress, &WP.lock);
+	}
+	pthread_mutex_unlock(&WP.lock);
+}
+
+int poolBatchDone(struct workBatch *batch) {
+	pthread_mutex_lock(&WP.lock);
+	int done = (batch->done == batch->tasks);
+	pthread_mutex_unlock(&WP.lock);
+	return done;
+}
+
+void poolWait(struct workBatch *batch) {
+	poolWaitUntil(batch, NULL);
+}
+
+// Stops handing out the batch's tasks and waits for running ones to return
+void poolCancel(struct workBatch *batch) {
+	pthread_mutex_lock(&WP.lock);
+	__atomic_store_n(&batch->cancelled, 1, __ATOMIC_RELAXED);
+	if (batch->next < batch->tasks) {
+		struct workBatch **link = &WP.queue;
+		while (*link && *link != batch) {
+			link = &(*link)->queueNext;
+		}
+		if (*link) {
+			*link = batch->queueNext;
+		}
+		batch->done += batch->tasks - batch->next;
+		batch->next = batch->tasks;
+	}
+	while (batch->done < batch->tasks) {
+		pthread_cond_wait(&WP.progress, &WP.lock);
+	}
+	pthread_mutex_unlock(&WP.lock);
+}
+
+/*** find ***/
+
+// What Find is looking for: a literal, or a regex when re is set
+struct searchQuery {
+	char *text;
+	struct searchPattern literal;
+	struct regex *re;
+};
+
+// Returns -1 and sets error if text isn't a valid regex
+int editorQueryCompile(struct searchQuery *query, const char *text, int regex, const char **error) {
+	query->text = strdup(text);
+	searchCompile(&query->literal, query->text, strlen(query->text));
+	query->re = NULL;
+	if (regex) {
+		query->re = regexCompile(query->text, error);
+		if (query->re == NULL) {
+			free(query->text);
+			query->text = NULL;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void editorQueryFree(struct searchQuery *query) {
+	free(query->text);
+	regexFree(query->re);
+}
+
+// Returns the column of the first match at or after from, or -1
+// Sets len to the length of the match; cache is only used by regexes
+int editorRowSearch(editorRow *row, const struct searchQuery *query, struct regexCache *cache, int from, int *len) {
+	if (from < 0 || from > row->size) {
+		return -1;
+	}
+	if (query->re) {
+		return regexSearch(query->re, cache, row->chars, row->size, from, len);
+	}
+	long at = searchFind(&query->literal, &row->chars[from], row->size - from);
+	*len = query->literal.len;
+	return (at == -1) ? -1 : from + at;
+}
+
+// Returns the column of the last match starting before limit, or -1
+int editorRowSearchBackward(editorRow *row, const struct searchQuery *query, struct regexCache *cache, int limit, int *len) {
+	int found = -1;
+	int atLen;
+	int at = editorRowSearch(row, query, cache, 0, &atLen);
+	while (at != -1 && at < limit) {
+		found = at;
+		*len = atLen;
+		at = editorRowSearch(row, query, cache, at + 1, &atLen);
+	}
+	return found;
+}
+
+// Moves pos to the next match in direction, wrapping around the buffer
+// A pos with row -1 starts a fresh search from the top
+// Returns 1 if a match was found
+int editorSearchNext(const struct searchQuery *query, struct regexCache *cache, struct searchMatch *pos, int direction) {
+	if (E.numRows == 0) {
+		return 0;
+	}
+
+	int current = pos->row;
+	int col = pos->col;
+	if (current < 0 || current >= E.numRows) {
+		current = 0;
+		col = -1;
+		direction = 1;
+	}
+
+	// The starting row is visited twice: once from the previous match
+	// and once more from the other end after wrapping around
+	int i;
+	for (i = 0; i <= E.numRows; i++) {
+		editorRow *row = &E.row[current];
+		int at;
+		int len;
+		if (direction == 1) {
+			at = editorRowSearch(row, query, cache, col + 1, &len);
+		} else {
+			at = editorRowSearchBackward(row, query, cache, (col == -1) ? row->size + 1 : col, &len);
+		}
+
+		if (at != -1) {
+			pos->row = current;
+			pos->col = at;
+			pos->len = len;
+			return 1;
+		}
+
+		current += direction;
+		if (current == -1) {
+			current = E.numRows - 1;
+		} else if (current == E.numRows) {
+			current = 0;
+		}
+		col = -1;
+	}
+	return 0;
+}
+
+// Rows handed to a worker at a time by a parallel scan, and the rows
+// each block of the index starts out with
+#define SEARCH_CHUNK_ROWS 8192
+
+// The matches in one block of rows, counted from the block's first row,
+// so rows inserted or deleted above it don't have to touch them
+struct searchBlock {
+	int rows;
+	struct searchMatch *matches;
+	int count;
+	int capacity;
+	int done;    // searched to the end, set by the worker that did it
+	int counted; // done and added to the index's match counts
+};
+
+// A block handed to a worker, with the buffer rows it covered then
+struct scanTask {
+	int block;
+	int startRow;
+	int endRow;
+};
+
+// A worker's DFA cache, kept across every block it scans
+struct scanCache {
+	struct regexCache cache;
+	int ready;
+};
+
+// The blocks of the index still to search, split across the pool
+// An edit stops it, and the blocks it didn't get through are handed out
+// again once the edit is done
+struct searchScan {
+	struct workBatch batch;
+	struct searchQuery query;
+	struct searchBlock *blocks;
+	struct scanTask *tasks;   // one per block at most
+	struct scanCache *caches; // one per pool thread, for regexes
+	int running;  // submitted and not stopped by an edit since
+	int limit;    // most matches worth remembering
+	int total;    // matches found so far across all blocks
+	int overflow; // total went past limit, the scan was abandoned
+};
+
+// Index of every match of the current query, in blocks of rows
+// Fenwick trees over the blocks' row and match counts find the block
+// holding a row or the nth match in O(log blocks), and an edit only
+// shifts the matches of the block it lands in
+// It's built in the background by a parallel scan, narrowed in place
+// while a literal query only grows, and patched as rows are edited
+struct searchIndex {
+	struct searchBlock *blocks;
+	int numBlocks;
+	int *rowTree;   // rows per block
+	int *countTree; // matches per counted block
+	int count;      // matches in counted blocks
+	struct searchQuery query; // text is NULL when no search is active
+	struct regexCache cache;  // for searching rows on the main thread
+	int valid; // 0 after an overflow, matches are then found on demand
+	struct searchScan *scan; // still collecting matches for query
+};
+
+#define SI (*mioCurrent->index)
+
+// Adds delta to entry at of a Fenwick tree over n entries
+void fenwickAdd(int *tree, int n, int at, int delta) {
+	for (at++; at <= n; at += at & -at) {
+		tree[at - 1] += delta;
+	}
+}
+
+// Returns the sum of the entries before at
+int fenwickSum(const int *tree, int at) {
+	int sum = 0;
+	for (; at > 0; at -= at & -at) {
+		sum += tree[at - 1];
+	}
+	return sum;
+}
+
+// Returns the entry where the running sum first goes past target, or n
+int fenwickFind(const int *tree, int n, int target) {
+	int step = 1;
+	while (step * 2 <= n) {
+		step *= 2;
+	}
+	int at = 0;
+	for (; step > 0; step /= 2) {
+		if (at + step <= n && tree[at + step - 1] <= target) {
+			at += step;
+			target -= tree[at - 1];
+		}
+	}
+	return at;
+}
+
+// Turns n plain entries into a Fenwick tree in place
+void fenwickBuild(int *tree, int n) {
+	int j;
+	for (j = 1; j <= n; j++) {
+		int parent = j + (j & -j);
+		if (parent <= n) {
+			tree[parent - 1] += tree[j - 1];
+		}
+	}
+}
+
+void editorScanBlock(struct workBatch *batch, int task) {
+	struct searchScan *scan = batch->data;
+	struct scanTask *range = &scan->tasks[task];
+	struct searchBlock *block = &scan->blocks[range->block];
+	struct regexCache *cache = NULL;
+	int fileRow;
+
+	// DFA states are built lazily, so each worker has its own cache, and
+	// states built on one block are reused for its next ones
+	if (scan->query.re) {
+		struct scanCache *mine = &scan->caches[poolWorkerId];
+		if (!mine->ready) {
+			regexCacheInit(&mine->cache, scan->query.re);
+			mine->ready = 1;
+		}
+		cache = &mine->cache;
+	}
+
+	// Left over from a run an edit cut short
+	block->count = 0;
+	for (fileRow = range->startRow; fileRow < range->endRow && !batchCancelled(batch); fileRow++) {
+		editorRow *row = &E.row[fileRow];
+		int len;
+		int at = editorRowSearch(row, &scan->query, cache, 0, &len);
+		while (at != -1) {
+			if (__atomic_add_fetch(&scan->total, 1, __ATOMIC_RELAXED) > scan->limit) {
+				__atomic_store_n(&scan->overflow, 1, __ATOMIC_RELAXED);
+				__atomic_store_n(&batch->cancelled, 1, __ATOMIC_RELAXED);
+				break;
+			}
+			if (block->count == block->capacity) {
+				block->capacity = block->capacity ? block->capacity * 2 : 16;
+				block->matches = realloc(block->matches, sizeof(struct searchMatch) * block->capacity);
+			}
+			block->matches[block->count].row = fileRow - range->startRow;
+			block->matches[block->count].col = at;
+			block->matches[block->count].len = len;
+			block->count++;
+			at = editorRowSearch(row, &scan->query, cache, at + 1, &len);
+		}
+	}
+
+	if (!batchCancelled(batch)) {
+		__atomic_store_n(&block->done, 1, __ATOMIC_RELEASE);
+	}
+}
+
+void editorScanFree(struct searchScan *scan) {
+	if (scan->caches) {
+		int threads = poolThreads();
+		int j;
+		for (j = 0; j < threads; j++) {
+			if (scan->caches[j].ready) {
+				regexCacheFree(&scan->caches[j].cache);
+			}
+		}
+		free(scan->caches);
+	}
+	free(scan->tasks);
+	editorQueryFree(&scan->query);
+	free(scan);
+}
+
+// Makes a scan for the index's query with nothing handed out yet
+// Gives up once the set would outgrow SEARCH_CANDIDATE_BUDGET
+// The scan keeps its own copy of the query
+struct searchScan *editorScanNew() {
+	struct searchScan *scan = malloc(sizeof(struct searchScan));
+	const char *error;
+	editorQueryCompile(&scan->query, SI.query.text, SI.query.re != NULL, &error);
+	scan->blocks = SI.blocks;
+	scan->tasks = malloc(sizeof(struct scanTask) * SI.numBlocks);
+	scan->caches = scan->query.re ? calloc(poolThreads(), sizeof(struct scanCache)) : NULL;
+	scan->running = 0;
+	scan->limit = SEARCH_CANDIDATE_BUDGET / sizeof(struct searchMatch);
+	scan->total = 0;
+	scan->overflow = 0;
+	scan->batch.run = editorScanBlock;
+	scan->batch.data = scan;
+	scan->batch.tasks = 0;
+	return scan;
+}
+
+// Hands every block not searched yet to the pool, in buffer order
+void editorScanSubmit(struct searchScan *scan) {
+	int tasks = 0;
+	int row = 0;
+	int k;
+	for (k = 0; k < SI.numBlocks; k++) {
+		if (!SI.blocks[k].done) {
+			scan->tasks[tasks].block = k;
+			scan->tasks[tasks].startRow = row;
+			scan->tasks[tasks].endRow = row + SI.blocks[k].rows;
+			tasks++;
+		}
+		row += SI.blocks[k].rows;
+	}
+	scan->total = SI.count;
+	scan->batch.tasks = tasks;
+	scan->running = 1;
+	poolSubmit(&scan->batch);
+}
+
+// Blocks finish out of order, the first match is known once some
+// block has one and every block before it is done
+int editorScanFirstKnown(struct workBatch *batch) {
+	struct searchScan *scan = batch->data;
+	int j;
+	for (j = 0; j < batch->tasks; j++) {
+		struct searchBlock *block = &scan->blocks[scan->tasks[j].block];
+		if (!__atomic_load_n(&block->done, __ATOMIC_ACQUIRE)) {
+			return __atomic_load_n(&scan->overflow, __ATOMIC_RELAXED);
+		}
+		if (block->count) {
+			return 1;
+		}
+	}
+	return 1;
+}
+
+// Fills first with the first match in buffer order as soon as it's known,
+// without waiting for the rest of a scan that was just submitted
+// Returns 1 on a match, 0 if there are none and -1 if the scan overflowed
+int editorScanFirst(struct searchScan *scan, struct searchMatch *first) {
+	poolWaitUntil(&scan->batch, editorScanFirstKnown);
+
+	int overflow = __atomic_load_n(&scan->overflow, __ATOMIC_RELAXED);
+	int found = -1;
+	int j;
+	for (j = 0; j < scan->batch.tasks && found == -1 && !overflow; j++) {
+		struct searchBlock *block = &scan->blocks[scan->tasks[j].block];
+		if (!__atomic_load_n(&block->done, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+		if (block->count) {
+			*first = block->matches[0];
+			first->row += scan->tasks[j].startRow;
+			found = 1;
+		}
+	}
+	if (found == -1 && j == scan->batch.tasks && !overflow) {
+		found = 0;
+	}
+	return found;
+}
+
+int editorIndexActive() {
+	return SI.query.text != NULL;
+}
+
+// Replaces the index's query with a copy of query, or clears it on NULL
+void editorIndexSetQuery(const struct searchQuery *query) {
+	if (SI.query.text) {
+		if (SI.query.re) {
+			regexCacheFree(&SI.cache);
+		}
+		editorQueryFree(&SI.query);
+		SI.query.text = NULL;
+		SI.query.re = NULL;
+	}
+	if (query) {
+		const char *error;
+		editorQueryCompile(&SI.query, query->text, query->re != NULL, &error);
+		if (SI.query.re) {
+			regexCacheInit(&SI.cache, SI.query.re);
+		}
+	}
+}
+
+void editorIndexFreeBlocks() {
+	int k;
+	for (k = 0; k < SI.numBlocks; k++) {
+		free(SI.blocks[k].matches);
+	}
+	free(SI.blocks);
+	free(SI.rowTree);
+	free(SI.countTree);
+	SI.blocks = NULL;
+	SI.rowTree = NULL;
+	SI.countTree = NULL;
+	SI.numBlocks = 0;
+	SI.count = 0;
+}
+
+void editorIndexReset() {
+	if (SI.scan) {
+		poolCancel(&SI.scan->batch);
+		editorScanFree(SI.scan);
+		SI.scan = NULL;
+	}
+	editorIndexSetQuery(NULL);
+	editorIndexFreeBlocks();
+	SI.valid = 0;
+}
+
+void editorIndexScan(const struct searchQuery *query) {
+	editorIndexReset();
+	editorIndexSetQuery(query);
+
+	SI.numBlocks = (E.numRows + SEARCH_CHUNK_ROWS - 1) / SEARCH_CHUNK_ROWS;
+	if (SI.numBlocks == 0) {
+		SI.numBlocks = 1;
+	}
+	SI.blocks = calloc(SI.numBlocks, sizeof(struct searchBlock));
+	SI.rowTree = malloc(sizeof(int) * SI.numBlocks);
+	SI.countTree = calloc(SI.numBlocks, sizeof(int));
+	int k;
+	for (k = 0; k < SI.numBlocks; k++) {
+		SI.blocks[k].rows = (k + 1 == SI.numBlocks) ? E.numRows - k * SEARCH_CHUNK_ROWS : SEARCH_CHUNK_ROWS;
+		SI.rowTree[k] = SI.blocks[k].rows;
+	}
+	fenwickBuild(SI.rowTree, SI.numBlocks);
+	SI.valid = 1;
+
+	SI.scan = editorScanNew();
+	editorScanSubmit(SI.scan);
+}
+
+// Adds the blocks the scan has finished since last time to the counts
+void editorIndexCollect() {
+	struct searchScan *scan = SI.scan;
+	int j;
+	for (j = 0; j < scan->batch.tasks; j++) {
+		int k = scan->tasks[j].block;
+		struct searchBlock *block = &SI.blocks[k];
+		if (!block->counted && __atomic_load_n(&block->done, __ATOMIC_ACQUIRE)) {
+			block->counted = 1;
+			fenwickAdd(SI.countTree, SI.numBlocks, k, block->count);
+			SI.count += block->count;
+		}
+	}
+}
+
+// Stops a running scan's workers before rows change under them
+// Whatever they didn't finish is searched again when it resumes
+void editorIndexPause() {
+	if (SI.scan == NULL || !SI.scan->running) {
+		return;
+	}
+	poolCancel(&SI.scan->batch);
+	SI.scan->running = 0;
+	editorIndexCollect();
+}
+
+// Hands the blocks not searched yet out again after edits paused the scan
+void editorIndexResume() {
+	if (!SI.scan->running && !SI.scan->overflow) {
+		editorScanSubmit(SI.scan);
+	}
+}
+
+// Waits for the scan to search every block, then drops it
+void editorIndexSettle() {
+	if (SI.scan == NULL) {
+		return;
+	}
+
+	struct searchScan *scan = SI.scan;
+	editorIndexResume();
+	poolWait(&scan->batch);
+	editorIndexCollect();
+	SI.scan = NULL;
+
+	if (scan->overflow) {
+		editorIndexFreeBlocks();
+		SI.valid = 0;
+	}
+	editorScanFree(scan);
+}
+
+// Resumes a paused scan and settles one that has finished on its own
+// Returns 1 while a scan is running or just finished, so there's
+// something new to draw
+int editorIndexPoll() {
+	if (SI.scan == NULL) {
+		return 0;
+	}
+	editorIndexResume();
+	if (poolBatchDone(&SI.scan->batch)) {
+		editorIndexSettle();
+	}
+	return 1;
+}
+
+// Drops the matches that no longer match now that the query grew
+void editorIndexNarrow(const struct searchQuery *query) {
+	const struct searchPattern *literal = &query->literal;
+	int base = 0;
+	int k;
+	SI.count = 0;
+	for (k = 0; k < SI.numBlocks; k++) {
+		struct searchBlock *block = &SI.blocks[k];
+		int kept = 0;
+		int j;
+		for (j = 0; j < block->count; j++) {
+			editorRow *row = &E.row[base + block->matches[j].row];
+			int col = block->matches[j].col;
+			if (row->size - col >= (int)literal->len && !memcmp(&row->chars[col], literal->needle, literal->len)) {
+				block->matches[kept] = block->matches[j];
+				block->matches[kept++].len = literal->len;
+			}
+		}
+		block->count = kept;
+		SI.countTree[k] = kept;
+		SI.count += kept;
+		base += block->rows;
+	}
+	fenwickBuild(SI.countTree, SI.numBlocks);
+	editorIndexSetQuery(query);
+}
+
+// Returns the block holding row and sets base to its first row
+// Rows past the end belong to the last block
+int editorIndexBlock(int row, int *base) {
+	int k = fenwickFind(SI.rowTree, SI.numBlocks, row);
+	if (k == SI.numBlocks) {
+		k--;
+	}
+	*base = fenwickSum(SI.rowTree, k);
+	return k;
+}
+
+// Returns the index of the block's first match at or after (row, col),
+// with row counted from the block's first row
+int editorBlockLowerBound(struct searchBlock *block, int row, int col) {
+	int low = 0;
+	int high = block->count;
+	while (low < high) {
+		int mid = low + (high - low) / 2;
+		struct searchMatch *match = &block->matches[mid];
+		if (match->row < row || (match->row == row && match->col < col)) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+// Returns the number of matches before (row, col)
+int editorIndexLowerBound(int row, int col) {
+	int base;
+	int k = editorIndexBlock(row, &base);
+	return fenwickSum(SI.countTree, k) + editorBlockLowerBound(&SI.blocks[k], row - base, col);
+}
+
+// Returns match j of the index, with its row in the buffer
+struct searchMatch editorIndexMatch(int j) {
+	int k = fenwickFind(SI.countTree, SI.numBlocks, j);
+	struct searchMatch match = SI.blocks[k].matches[j - fenwickSum(SI.countTree, k)];
+	match.row += fenwickSum(SI.rowTree, k);
+	return match;
+}
+
+// Changes a counted block's matches by delta
+void editorIndexCount(int k, int delta) {
+	fenwickAdd(SI.countTree, SI.numBlocks, k, delta);
+	SI.count += delta;
+}
+
+// Searches an edited row again and swaps its matches into its block
+void editorIndexUpdateRow(int at) {
+	if (!editorIndexActive()) {
+		return;
+	}
+	// The row may have changed where the regex cache last looked
+	if (SI.query.re) {
+		regexCacheForget(&SI.cache);
+	}
+	editorIndexPause();
+	if (!SI.valid) {
+		return;
+	}
+
+	int base;
+	int k = editorIndexBlock(at, &base);
+	struct searchBlock *block = &SI.blocks[k];
+	if (!block->counted) {
+		// The scan searches it whole when it resumes
+		return;
+	}
+
+	editorRow *row = &E.row[at];
+	int start = editorBlockLowerBound(block, at - base, 0);
+	int end = editorBlockLowerBound(block, at - base + 1, 0);
+
+	// Count first so the rest of the block only moves once
+	int found = 0;
+	int len;
+	int col = editorRowSearch(row, &SI.query, &SI.cache, 0, &len);
+	while (col != -1) {
+		found++;
+		col = editorRowSearch(row, &SI.query, &SI.cache, col + 1, &len);
+	}
+
+	int count = block->count - (end - start) + found;
+	if (count > block->capacity) {
+		block->capacity = count * 2;
+		block->matches = realloc(block->matches, sizeof(struct searchMatch) * block->capacity);
+	}
+	memmove(&block->matches[start + found], &block->matches[end], sizeof(struct searchMatch) * (block->count - end));
+	editorIndexCount(k, count - block->count);
+	block->count = count;
+
+	int j = start;
+	col = editorRowSearch(row, &SI.query, &SI.cache, 0, &len);
+	while (col != -1) {
+		block->matches[j].row = at - base;
+		block->matches[j].col = col;
+		block->matches[j].len = len;
+		j++;
+		col = editorRowSearch(row, &SI.query, &SI.cache, col + 1, &len);
+	}
+}
+
+// Called before count rows are inserted at at, they join the block
+// holding at and only that block's later matches move down
+void editorIndexInsertRows(int at, int count) {
+	if (!editorIndexActive()) {
+		return;
+	}
+	editorIndexPause();
+	if (!SI.valid) {
+		return;
+	}
+
+	int base;
+	int k = editorIndexBlock(at, &base);
+	struct searchBlock *block = &SI.blocks[k];
+	block->rows += count;
+	fenwickAdd(SI.rowTree, SI.numBlocks, k, count);
+	if (!block->counted) {
+		return;
+	}
+
+	if (count >= SEARCH_CHUNK_ROWS) {
+		// A paste this big is searched in the background with the rest
+		// of its block rather than row by row as it's updated
+		editorIndexCount(k, -block->count);
+		block->count = 0;
+		block->counted = 0;
+		block->done = 0;
+		if (SI.scan == NULL) {
+			SI.scan = editorScanNew();
+		}
+		return;
+	}
+
+	int j;
+	for (j = editorBlockLowerBound(block, at - base, 0); j < block->count; j++) {
+		block->matches[j].row += count;
+	}
+}
+
+// Called before count rows from at are deleted
+void editorIndexDeleteRows(int at, int count) {
+	if (!editorIndexActive()) {
+		return;
+	}
+	editorIndexPause();
+	if (!SI.valid) {
+		return;
+	}
+
+	int base;
+	int k = editorIndexBlock(at, &base);
+	int from = at - base;
+	for (; count > 0 && k < SI.numBlocks; k++, from = 0) {
+		struct searchBlock *block = &SI.blocks[k];
+		int deleted = block->rows - from;
+		if (deleted > count) {
+			deleted = count;
+		}
+		if (block->counted) {
+			int start = editorBlockLowerBound(block, from, 0);
+			int end = editorBlockLowerBound(block, from + deleted, 0);
+			memmove(&block->matches[start], &block->matches[end], sizeof(struct searchMatch) * (block->count - end));
+			block->count -= end - start;
+			editorIndexCount(k, start - end);
+			int j;
+			for (j = start; j < block->count; j++) {
+				block->matches[j].row -= deleted;
+			}
+		}
+		block->rows -= deleted;
+		fenwickAdd(SI.rowTree, SI.numBlocks, k, -deleted);
+		count -= deleted;
+	}
+}
+
+// Moves pos to the next match in direction, wrapping around the buffer
+// A pos with row -1 starts from the top
+// Returns 1 if a match was found
+int editorIndexStep(struct searchMatch *pos, int direction) {
+	editorIndexSettle();
+	if (!SI.valid) {
+		// Too many matches to remember, step through the buffer instead
+		return editorSearchNext(&SI.query, &SI.cache, pos, direction);
+	}
+	if (SI.count == 0) {
+		return 0;
+	}
+
+	int j;
+	if (direction == 1) {
+		j = editorIndexLowerBound(pos->row, pos->col + 1);
+		if (j == SI.count) {
+			j = 0;
+		}
+	} else {
+		j = editorIndexLowerBound(pos->row, pos->col) - 1;
+		if (j < 0) {
+			j = SI.count - 1;
+		}
+	}
+	*pos = editorIndexMatch(j);
+	return 1;
+}
+
+// Formats n with thousands separators, like 98,112
+void editorFormatCount(char *buf, size_t size, int n) {
+	char digits[16];
+	int numDigits = snprintf(digits, sizeof(digits), "%d", n);
+	size_t len = 0;
+	int j;
+	for (j = 0; j < numDigits && len + 1 < size; j++) {
+		if (j > 0 && (numDigits - j) % 3 == 0) {
+			buf[len++] = ',';
+		}
+		buf[len++] = digits[j];
+	}
+	buf[len] = '\0';
+}
+
+// Describes the index for the status bar, "match 1,234 of 98,112" when
+// the cursor sits on a match
+void editorIndexStatus(char *buf, size_t size) {
+	char count[16];
+	char current[16];
+
+	if (!editorIndexActive()) {
+		buf[0] = '\0';
+	} else if (SI.scan && !__atomic_load_n(&SI.scan->overflow, __ATOMIC_RELAXED)) {
+		editorFormatCount(count, sizeof(count), __atomic_load_n(&SI.scan->total, __ATOMIC_RELAXED));
+		snprintf(buf, size, "%s+ matches", count);
+	} else if (SI.scan || !SI.valid) {
+		snprintf(buf, size, "too many matches to count");
+	} else {
+		int j = editorIndexLowerBound(E.cy, E.cx);
+		struct searchMatch match;
+		editorFormatCount(count, sizeof(count), SI.count);
+		if (j < SI.count && (match = editorIndexMatch(j)).row == E.cy && match.col == E.cx) {
+			editorFormatCount(current, sizeof(current), j + 1);
+			snprintf(buf, size, "match %s of %s", current, count);
+		} else {
+			snprintf(buf, size, "%s %s", count, (SI.count == 1) ? "match" : "matches");
+		}
+	}
+}
+
+// Marks a match's span in hl, which holds the visible render columns
+// Returns 0 once the match starts past the right edge of the screen
+int editorHighlightSpan(editorRow *row, int col, int len, unsigned char *hl, int width) {
+	int start = editorRowCxToRx(row, col) - E.colOffset;
+	int end = editorRowCxToRx(row, col + len) - E.colOffset;
+	if (start >= width) {
+		return 0;
+	}
+	if (start < 0) {
+		start = 0;
+	}
+	if (end > width) {
+		end = width;
+	}
+	if (start < end) {
+		memset(&hl[start], HL_MATCH, end - start);
+	}
+	return 1;
+}
+
+// Highlights every match on a visible row
+void editorIndexHighlight(int fileRow, unsigned char *hl, int width) {
+	if (!editorIndexActive()) {
+		return;
+	}
+
+	editorRow *row = &E.row[fileRow];
+	if (SI.scan == NULL && SI.valid) {
+		int base;
+		struct searchBlock *block = &SI.blocks[editorIndexBlock(fileRow, &base)];
+		int j;
+		for (j = editorBlockLowerBound(block, fileRow - base, 0); j < block->count && block->matches[j].row == fileRow - base; j++) {
+			if (!editorHighlightSpan(row, block->matches[j].col, block->matches[j].len, hl, width)) {
+				break;
+			}
+		}
+	} else {
+		// No index to read from, the few rows on screen are cheap to search
+		int len;
+		int col = editorRowSearch(row, &SI.query, &SI.cache, 0, &len);
+		while (col != -1 && editorHighlightSpan(row, col, len, hl, width)) {
+			col = editorRowSearch(row, &SI.query, &SI.cache, col + 1, &len);
+		}
+	}
+}
+
+void editorFindCallback(char *query, int key) {
+	int navigating = 0;
+	if (key == '\r') {
+		// The index stays for ^N/^P, a scan still running carries on
+		// and only pauses while an edit changes rows under it
+		E.findLast.row = -1;
+		E.findDirection = 1;
+		E.searchStatus[0] = '\0';
+		return;
+	} else if (key == '\x1b') {
+		E.findLast.row = -1;
+		E.findDirection = 1;
+		editorIndexReset();
+		E.searchStatus[0] = '\0';
+		return;
+	} else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+		E.findDirection = 1;
+		navigating = 1;
+	} else if (key == ARROW_LEFT || key == ARROW_UP) {
+		E.findDirection = -1;
+		navigating = 1;
+	} else {
+		if (key == CTRL_KEY('t')) {
+			E.searchRegex = !E.searchRegex;
+		}
+		E.findLast.row = -1;
+		E.findDirection = 1;
+	}
+
+	if (E.findLast.row == -1) {
+		E.findDirection = 1;
+	}
+
+	struct searchMatch match = E.findLast;
+	int found = -1;
+	if (!navigating) {
+		snprintf(E.searchStatus, sizeof(E.searchStatus), "%s", E.searchRegex ? "regex" : "");
+		if (strlen(query) == 0) {
+			editorIndexReset();
+			return;
+		}
+
+		struct searchQuery pattern;
+		const char *error;
+		if (editorQueryCompile(&pattern, query, E.searchRegex, &error) == -1) {
+			snprintf(E.searchStatus, sizeof(E.searchStatus), "regex: %s", error);
+			editorIndexReset();
+			return;
+		}
+
+		// Typing onto the end of the query can only remove matches
+		// A scan still running for the old query is stale either way
+		if (SI.scan && SI.scan->running && poolBatchDone(&SI.scan->batch)) {
+			editorIndexSettle();
+		}
+		// Only literal queries narrow, a longer regex can match more
+		int grew = editorIndexActive() && SI.valid && SI.scan == NULL && !SI.query.re && !pattern.re && !strncmp(query, SI.query.text, strlen(SI.query.text));
+		if (grew) {
+			editorIndexNarrow(&pattern);
+		} else {
+			// Shown straight from the scan while it's still running
+			editorIndexScan(&pattern);
+			found = editorScanFirst(SI.scan, &match);
+		}
+		editorQueryFree(&pattern);
+	} else if (!editorIndexActive()) {
+		return;
+	}
+
+	if (found == -1) {
+		found = editorIndexStep(&match, E.findDirection);
+	}
+
+	if (found) {
+		E.findLast = match;
+		E.cy = match.row;
+		E.cx = match.col;
+		E.rowOffset = E.numRows;
+	}
+}
+
+void editorFind() {
+	int saved_cx = E.cx;
+	int saved_cy = E.cy;
+	int saved_colOffset = E.colOffset;
+	int saved_rowOffset = E.rowOffset;
+
+	char *query = editorPrompt("Search: %s (Use ESC/Arrow/Enter, ^T regex)", editorFindCallback);
+
+	if (query) {
+		free(query);
+	} else {
+		E.cx = saved_cx;
+		E.cy = saved_cy;
+		E.colOffset = saved_colOffset;
+		E.rowOffset = saved_rowOffset;
+	}
+}
+
+// Jumps to the next or previous match of the last search
+void editorFindNext(int direction) {
+	if (!editorIndexActive()) {
+		editorSetStatusMessage("No search to repeat, use ^F");
+		return;
+	}
+
+	struct searchMatch pos = { E.cy, E.cx, 0 };
+	if (editorIndexStep(&pos, direction)) {
+		E.cy = pos.row;
+		E.cx = pos.col;
+	}
+}
+
+/*** replace ***/
+
+// Replaces every match from (fromRow, fromCol) to the end of the buffer
+// Each changed row is rebuilt in one pass and updated once, untouched
+// rows aren't re-rendered at all
+// Returns the number of replacements
+int editorReplaceAll(const struct searchQuery *query, const char *with, int fromRow, int fromCol) {
+	int withLen = strlen(with);
+	struct regexCache cache;
+	if (query->re) {
+		regexCacheInit(&cache, query->re);
+	}
+
+	// Patching the index row by row would move its tail once per row
+	editorIndexReset();
+	traceBegin("editorReplaceAll");
+	traceMuted++;
+
+	char *out = NULL;
+	int outCap = 0;
+	int replaced = 0;
+	int fileRow;
+	for (fileRow = fromRow; fileRow < E.numRows; fileRow++) {
+		editorRow *row = &E.row[fileRow];
+		int from = (fileRow == fromRow) ? fromCol : 0;
+		int len;
+		int col = editorRowSearch(row, query, &cache, from, &len);
+		if (col == -1) {
+			continue;
+		}
+
+		int outLen = 0;
+		int copied = 0;
+		while (col != -1) {
+			int need = outLen + (col - copied) + withLen + (row->size - col - len) + 1;
+			if (need > outCap) {
+				outCap = need * 2;
+				out = realloc(out, outCap);
+			}
+			memcpy(&out[outLen], &row->chars[copied], col - copied);
+			outLen += col - copied;
+			// Recorded where the match sits once the ones before it are replaced
+			editorUndoSplice(fileRow, outLen, &row->chars[col], len, with, withLen);
+			memcpy(&out[outLen], with, withLen);
+			outLen += withLen;
+			copied = col + len;
+			replaced++;
+			col = editorRowSearch(row, query, &cache, copied, &len);
+		}
+		memcpy(&out[outLen], &row->chars[copied], row->size - copied);
+		outLen += row->size - copied;
+		out[outLen] = '\0';
+
+		row->chars = realloc(row->chars, outLen + 1);
+		memcpy(row->chars, out, outLen + 1);
+		row->size = outLen;
+		editorUpdateRow(row);
+		E.dirty++;
+	}
+
+	traceMuted--;
+	traceEndArg("editorReplaceAll", "replaced", replaced);
+	free(out);
+	if (query->re) {
+		regexCacheFree(&cache);
+	}
+	return replaced;
+}
+
+// Asks about each match in turn, starting from the one Find landed on
+// Returns the number of replacements
+int editorReplaceEach(const char *with) {
+	int withLen = strlen(with);
+	int replaced = 0;
+	struct searchMatch pos = { E.cy, E.cx, 0 };
+
+	editorIndexSettle();
+	if (!SI.valid) {
+		return 0;
+	}
+	int j = editorIndexLowerBound(E.cy, E.cx);
+	struct searchMatch match;
+	while (j < SI.count && (match = editorIndexMatch(j)).row == pos.row && match.col == pos.col) {
+		pos = match;
+		E.cy = pos.row;
+		E.cx = pos.col;
+		editorSetStatusMessage("Replace this match? (y)es (n)o (a)ll remaining, ESC to stop");
+		editorRefreshScreen();
+
+		int key = editorReadKey();
+		if (key == 'a') {
+			struct searchQuery query;
+			const char *error;
+			editorQueryCompile(&query, SI.query.text, SI.query.re != NULL, &error);
+			replaced += editorReplaceAll(&query, with, pos.row, pos.col);
+			editorQueryFree(&query);
+			break;
+		} else if (key == 'y') {
+			editorRowSplice(&E.row[pos.row], pos.col, pos.len, with, withLen);
+			replaced++;
+			// Carry on after the replacement rather than inside it
+			pos.col += withLen - 1;
+		} else if (key != 'n') {
+			break;
+		}
+
+		// Only go forward, wrapping around could revisit replacements
+		j = editorIndexLowerBound(pos.row, pos.col + 1);
+		if (j < SI.count) {
+			match = editorIndexMatch(j);
+			pos.row = match.row;
+			pos.col = match.col;
+		}
+	}
+	return replaced;
+}
+
+void editorReplace() {
+	int saved_cx = E.cx;
+	int saved_cy = E.cy;
+	int saved_colOffset = E.colOffset;
+	int saved_rowOffset = E.rowOffset;
+
+	char *query = editorPrompt("Replace: %s (Use ESC/Arrow/Enter, ^T regex)", editorFindCallback);
+	if (query == NULL) {
+		E.cx = saved_cx;
+		E.cy = saved_cy;
+		E.colOffset = saved_colOffset;
+		E.rowOffset = saved_rowOffset;
+		return;
+	}
+	free(query);
+
+	char *with = editorPromptEmpty("Replace with: %s (Use ESC/Enter)", NULL);
+	if (with == NULL || !editorIndexActive()) {
+		free(with);
+		editorIndexReset();
+		return;
+	}
+
+	// Stepping through needs every match, or to know there are too many
+	editorIndexSettle();
+	int replaced = 0;
+	if (SI.valid) {
+		replaced = editorReplaceEach(with);
+	} else {
+		editorSetStatusMessage("Too many matches to step through, replace them all? (y/n)");
+		editorRefreshScreen();
+		if (editorReadKey() == 'y') {
+			struct searchQuery copy;
+			const char *error;
+			editorQueryCompile(&copy, SI.query.text, SI.query.re != NULL, &error);
+			replaced = editorReplaceAll(&copy, with, 0, 0);
+			editorQueryFree(&copy);
+		}
+	}
+	free(with);
+	editorIndexReset();
+
+	if (E.cy < E.numRows && E.cx > E.row[E.cy].size) {
+		E.cx = E.row[E.cy].size;
+	}
+	editorSetStatusMessage("Replaced %d %s", replaced, (replaced == 1) ? "occurrence" : "occurrences");
+}
+
+/*** grep ***/
+
+// A line that matched, path points into the search's file list
+struct grepResult {
+	const char *path;
+	int line;
+	int col;
+	char *text;
+};
+
+// A search through every file under the working directory
+// One task walks the tree while the others search the files it finds,
+// results stream into the list while it's on screen
+struct grepSearch {
+	pthread_mutex_t lock; // guards the files and results shared with workers
+	pthread_cond_t filesReady;
+	struct workBatch batch;
+	struct searchQuery query;
+	char **files;
+	int numFiles;
+	int filesCapacity;
+	int nextFile; // next file for a task to search
+	int walking;  // more files may still be found
+	struct grepResult *results;
+	int count;
+	int capacity;
+	int matchedFiles;
+	int truncated; // stopped at GREP_MAX_RESULTS
+	int running;   // the batch hasn't finished yet
+	int active;    // there are results to show
+	int visible;   // the list is drawn instead of the buffer
+	int selected;
+	int offset;    // first result on screen
+};
+
+#define GR (*mioCurrent->grep)
+
+// Queues the regular files under dir, skipping hidden entries and
+// not following symlinks
+void grepWalk(struct workBatch *batch, const char *dir) {
+	DIR *d = opendir(dir);
+	if (d == NULL) {
+		return;
+	}
+
+	struct dirent *entry;
+	while ((entry = readdir(d)) != NULL && !batchCancelled(batch)) {
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+
+		char *path;
+		if (!strcmp(dir, ".")) {
+			path = strdup(entry->d_name);
+		} else {
+			path = malloc(strlen(dir) + strlen(entry->d_name) + 2);
+			sprintf(path, "%s/%s", dir, entry->d_name);
+		}
+
+		int type = entry->d_type;
+		if (type == DT_UNKNOWN) {
+			struct stat st;
+			if (lstat(path, &st) == 0) {
+				type = S_ISDIR(st.st_mode) ? DT_DIR : (S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN);
+			}
+		}
+
+		if (type == DT_DIR) {
+			grepWalk(batch, path);
+			free(path);
+		} else if (type == DT_REG) {
+			pthread_mutex_lock(&GR.lock);
+			if (GR.numFiles == GR.filesCapacity) {
+				GR.filesCapacity = GR.filesCapacity ? GR.filesCapacity * 2 : 64;
+				GR.files = realloc(GR.files, sizeof(char *) * GR.filesCapacity);
+			}
+			GR.files[GR.numFiles++] = path;
+			pthread_cond_signal(&GR.filesReady);
+			pthread_mutex_unlock(&GR.lock);
+		} else {
+			free(path);
+		}
+	}
+	closedir(d);
+}
+
+// Adds one file's results to the list, returns 0 once it's full
+int grepAddResults(struct grepResult *results, int count) {
+	pthread_mutex_lock(&GR.lock);
+	int room = GREP_MAX_RESULTS - GR.count;
+	if (count > room) {
+		int j;
+		for (j = room; j < count; j++) {
+			free(results[j].text);
+		}
+		count = room;
+		GR.truncated = 1;
+	}
+	if (GR.count + count > GR.capacity) {
+		GR.capacity = (GR.count + count) * 2;
+		GR.results = realloc(GR.results, sizeof(struct grepResult) * GR.capacity);
+	}
+	memcpy(&GR.results[GR.count], results, sizeof(struct grepResult) * count);
+	GR.count += count;
+	GR.matchedFiles++;
+	int full = GR.truncated;
+	pthread_mutex_unlock(&GR.lock);
+	return !full;
+}
+
+// Copies a matching line for the list, control chars become spaces
+char *grepLineText(const char *line, size_t len) {
+	if (len > GREP_LINE_MAX) {
+		len = GREP_LINE_MAX;
+	}
+	char *text = malloc(len + 1);
+	size_t j;
+	for (j = 0; j < len; j++) {
+		text[j] = iscntrl((unsigned char)line[j]) ? ' ' : line[j];
+	}
+	text[len] = '\0';
+	return text;
+}
+
+void grepFile(struct workBatch *batch, const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size == 0) {
+		close(fd);
+		return;
+	}
+	size_t size = st.st_size;
+	char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return;
+	}
+
+	// Text files don't have NULs, binary ones almost always have one early
+	if (memchr(data, '\0', (size < GREP_SNIFF_BYTES) ? size : GREP_SNIFF_BYTES)) {
+		munmap(data, size);
 		return;
 	}
 
-	editorRow *row = &E.row[E.cy];
-	if (E.cx > 0) {
-		editorRowDeleteChar(row, E.cx - 1);
-		E.cx--;
-	} else {
-		E.cx = E.row[E.cy - 1].size;
-		editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-		editorDeleteRow(E.cy);
-		E.cy--;
+	struct regexCache cache;
+	if (GR.query.re) {
+		regexCacheInit(&cache, GR.query.re);
 	}
-}
 
-/*** file i/o  ***/
+	struct grepResult *results = NULL;
+	int count = 0;
+	int capacity = 0;
+	size_t lineStart = 0;
+	int line = 0;
+	while (lineStart < size && !batchCancelled(batch)) {
+		long col;
+		int len;
+		if (GR.query.re) {
+			char *end = memchr(data + lineStart, '\n', size - lineStart);
+			size_t lineLen = (end ? end - data : (long)size) - lineStart;
+			col = regexSearch(GR.query.re, &cache, data + lineStart, lineLen, 0, &len);
+			if (col == -1) {
+				lineStart += lineLen + 1;
+				line++;
+				continue;
+			}
+		} else {
+			// Literals are found across the whole file, then placed in lines
+			long at = searchFind(&GR.query.literal, data + lineStart, size - lineStart);
+			if (at == -1) {
+				break;
+			}
+			char *nl;
+			while ((nl = memchr(data + lineStart, '\n', at)) != NULL) {
+				at -= nl + 1 - (data + lineStart);
+				lineStart = nl + 1 - data;
+				line++;
+			}
+			col = at;
+		}
 
-// Converts all of the editorRows to a string
-char *editorRowsToString(int *bufLen) {
+		char *end = memchr(data + lineStart, '\n', size - lineStart);
+		size_t lineLen = (end ? end - data : (long)size) - lineStart;
+		if (count == capacity) {
+			capacity = capacity ? capacity * 2 : 16;
+			results = realloc(results, sizeof(struct grepResult) * capacity);
+		}
+		results[count].path = path;
+		results[count].line = line;
+		results[count].col = col;
+		results[count].text = grepLineText(data + lineStart, lineLen);
+		count++;
+
+		lineStart += lineLen + 1;
+		line++;
+	}
 
-	// Add up the lengths of our rows
-	int totalLength = 0;
-	int j;
-	for (j = 0; j < E.numRows; j++) {
-		totalLength += E.row[j].size + 1;
+	if (count && !grepAddResults(results, count)) {
+		__atomic_store_n(&batch->cancelled, 1, __ATOMIC_RELAXED);
 	}
-	*bufLen = totalLength;
+	free(results);
+	if (GR.query.re) {
+		regexCacheFree(&cache);
+	}
+	munmap(data, size);
+}
 
-	// Allocate a buffer and copy our rows
-	char *buf = malloc(totalLength);
-	char *p = buf;
-	for (j = 0; j < E.numRows; j++) {
-		memcpy(p, E.row[j].chars, E.row[j].size);
-		p += E.row[j].size;
-		*p = '\n';
-		p++;
+// Task 0 walks the tree first, every task then searches files as they
+// turn up until the walk is over and none are left
+void grepTask(struct workBatch *batch, int task) {
+	if (task == 0) {
+		grepWalk(batch, ".");
+		pthread_mutex_lock(&GR.lock);
+		GR.walking = 0;
+		pthread_cond_broadcast(&GR.filesReady);
+		pthread_mutex_unlock(&GR.lock);
 	}
 
-	return buf;
-}
+	while (1) {
+		pthread_mutex_lock(&GR.lock);
+		while (GR.nextFile == GR.numFiles && GR.walking && !batchCancelled(batch)) {
+			pthread_cond_wait(&GR.filesReady, &GR.lock);
+		}
+		if (GR.nextFile == GR.numFiles || batchCancelled(batch)) {
+			pthread_mutex_unlock(&GR.lock);
+			return;
+		}
+		const char *path = GR.files[GR.nextFile++];
+		pthread_mutex_unlock(&GR.lock);
 
-void editorKillCurrentBuffer() {
-	E.cx = 0;
-    E.cy = 0;
-    E.rx = 0;
-    E.rowOffset = 0;
-    E.colOffset = 0;
-    E.numRows = 0;
-    E.row = NULL;
-    E.dirty = 0;
-    E.filename = NULL;
-    E.statusmsg[0] = '\0';
-    E.statusmsg_time = 0;
-    E.syntax = NULL;
+		grepFile(batch, path);
+	}
 }
 
-void editorOpen(char *filename) {
-    free(E.filename);
-    E.filename = strdup(filename);
-
-    editorSelectSyntaxHighlight();
+void editorGrepReset() {
+	if (GR.running) {
+		// Wake the tasks waiting for files so they see the cancel
+		pthread_mutex_lock(&GR.lock);
+		__atomic_store_n(&GR.batch.cancelled, 1, __ATOMIC_RELAXED);
+		pthread_cond_broadcast(&GR.filesReady);
+		pthread_mutex_unlock(&GR.lock);
+		poolCancel(&GR.batch);
+		GR.running = 0;
+	}
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
-        die("fopen");
-    }
+	int j;
+	for (j = 0; j < GR.count; j++) {
+		free(GR.results[j].text);
+	}
+	for (j = 0; j < GR.numFiles; j++) {
+		free(GR.files[j]);
+	}
+	free(GR.results);
+	free(GR.files);
+	if (GR.active) {
+		editorQueryFree(&GR.query);
+	}
 
-    char *line = NULL;
-    size_t lineCap = 0; // line capacity
-    ssize_t lineLen;
-    while ((lineLen = getline(&line, &lineCap, fp)) != -1) {
-        while (lineLen > 0 && (line[lineLen - 1] == '\n' || line[lineLen - 1] == '\r')) {
-            lineLen--;
-        }
-        editorInsertRow(E.numRows, line, lineLen);
-    }
+	GR.results = NULL;
+	GR.files = NULL;
+	GR.numFiles = 0;
+	GR.filesCapacity = 0;
+	GR.nextFile = 0;
+	GR.count = 0;
+	GR.capacity = 0;
+	GR.matchedFiles = 0;
+	GR.truncated = 0;
+	GR.active = 0;
+	GR.selected = 0;
+	GR.offset = 0;
+}
 
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+void editorGrepStart(const char *text) {
+	const char *error;
+	editorGrepReset();
+	if (editorQueryCompile(&GR.query, text, E.searchRegex, &error) == -1) {
+		editorSetStatusMessage("Bad regex: %s", error);
+		return;
+	}
+	GR.active = 1;
+	GR.walking = 1;
+
+	// Task 0 is handed out first, so the walk never waits behind tasks
+	// that are waiting on it
+	// One thread is left over when there are several, the tasks hold
+	// theirs until the search is over and Find shouldn't queue behind it
+	pthread_once(&poolStarted, poolStart);
+	GR.batch.run = grepTask;
+	GR.batch.data = NULL;
+	GR.batch.tasks = (WP.numThreads > 1) ? WP.numThreads - 1 : 1;
+	poolSubmit(&GR.batch);
+	GR.running = 1;
 }
 
-void editorSave() {
-	// Check if this is a new file
-	if (E.filename == NULL) {
-		E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-		if (E.filename == NULL) {
-			editorSetStatusMessage("Save aborted");
-			return;
-		}
-		editorSelectSyntaxHighlight();
+// Returns 1 when the list on screen has new results to draw
+int editorGrepPoll() {
+	if (!GR.running || !GR.visible) {
+		return 0;
 	}
+	if (poolBatchDone(&GR.batch)) {
+		GR.running = 0;
+	}
+	return 1;
+}
 
-	int length;
-	char *buf = editorRowsToString(&length);
+// Opens the selected result's file, or switches to it if it's open
+// Returns 0 if it can't be read
+int editorGrepOpen() {
+	pthread_mutex_lock(&GR.lock);
+	struct grepResult result = GR.results[GR.selected];
+	pthread_mutex_unlock(&GR.lock);
 
-	// Open the file and write to it
-	// TODO:
-	// Safer to write a temp file and then rename it to the file we're overwriting
-	// Be sure to check for errors
-	int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-	if (fd != -1) {
-		if (ftruncate(fd, length) != -1) {
-			if (write(fd, buf, length) == length) {
-				close(fd);
-				free(buf);
-				E.dirty = 0;
-				editorSetStatusMessage("%d bytes written to disk", length);
-				return;
-			}
-		}
-		close(fd);
+	if (!editorOpenBuffer(result.path)) {
+		return 0;
 	}
-	free(buf);
-	editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
-}
 
-// TODO:
-// Should open in a new buffer
-// Currently kills the existing buffer
-void editorOpenFile() {
-	size_t bufsize = 128;
-	char *file = malloc(bufsize);
-    file = editorPrompt("Select a file: %s (Use ESC/Enter)", NULL);
-	editorKillCurrentBuffer();
-	editorOpen(file);
-	free(file);
+	E.cy = (result.line < E.numRows) ? result.line : E.numRows;
+	E.cx = (E.cy < E.numRows && result.col <= E.row[E.cy].size) ? result.col : 0;
+	E.rowOffset = E.numRows;
+	return 1;
 }
 
-/*** find ***/
-
-void editorFindCallback(char *query, int key) {
-	static int last_match = -1;
-	static int direction = 1; // 1 for searching forward, -1 for backward
+// Shows the results until one is opened or ESC closes the list
+void editorGrepResults() {
+	GR.visible = 1;
+	while (1) {
+		editorSetStatusMessage("Arrows/PgUp/PgDn to pick a result, Enter to open, ESC to close");
+		editorRefreshScreen();
+		int c = editorReadKey();
 
-	static int saved_highlight_line;
-	static char *saved_highlight = NULL;
+		pthread_mutex_lock(&GR.lock);
+		int count = GR.count;
+		pthread_mutex_unlock(&GR.lock);
+
+		int page = E.screenRows - 1;
+		if (c == ARROW_UP || c == ARROW_LEFT) {
+			GR.selected--;
+		} else if (c == ARROW_DOWN || c == ARROW_RIGHT) {
+			GR.selected++;
+		} else if (c == PAGE_UP) {
+			GR.selected -= page;
+		} else if (c == PAGE_DOWN) {
+			GR.selected += page;
+		} else if (c == '\r' && count > 0) {
+			if (editorGrepOpen()) {
+				break;
+			}
+		} else if (c == '\x1b' || c == CTRL_KEY('q')) {
+			break;
+		}
 
-	if (saved_highlight) {
-		memcpy(E.row[saved_highlight_line].highlight, saved_highlight, E.row[saved_highlight_line].renderSize);
-		free(saved_highlight);
-		saved_highlight = NULL;
+		if (GR.selected >= count) {
+			GR.selected = count - 1;
+		}
+		if (GR.selected < 0) {
+			GR.selected = 0;
+		}
 	}
+	GR.visible = 0;
+	editorSetStatusMessage("");
+}
 
+void editorGrepCallback(char *query, int key) {
+	(void)query;
+	if (key == CTRL_KEY('t')) {
+		E.searchRegex = !E.searchRegex;
+	}
+	snprintf(E.searchStatus, sizeof(E.searchStatus), "%s", E.searchRegex ? "regex" : "");
 	if (key == '\r' || key == '\x1b') {
-		last_match = -1;
-		direction = 1;
-		return;
-	} else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-		direction = 1;
-	} else if (key == ARROW_LEFT || key == ARROW_UP) {
-		direction = -1;
-	} else {
-		last_match = -1;
-		direction = 1;
+		E.searchStatus[0] = '\0';
 	}
+}
 
-	if (last_match == -1) {
-		direction = 1;
+// Searches every file under the working directory
+// An empty query brings back the last results
+void editorGrep() {
+	char *query = editorPromptEmpty("Grep: %s (ESC/Enter, ^T regex, empty for last results)", editorGrepCallback);
+	if (query == NULL) {
+		return;
 	}
 
-	int current = last_match;
-	int i;
-	for (i = 0; i< E.numRows; i++) {
-		current += direction;
-		if (current == -1) {
-			current = E.numRows - 1;
-		} else if (current == E.numRows) {
-			current = 0;
-		}
-		editorRow *row = &E.row[current];
-		char *match = strstr(row->render, query);
-		if (match) {
-			last_match = current;
-			E.cy = current;
-			E.cx = editorRowRxToCx(row, match - row->render);
-			E.rowOffset = E.numRows;
-
-			saved_highlight_line = current;
-			saved_highlight = malloc(row->renderSize);
-			memcpy(saved_highlight, row->highlight, row->renderSize);
-			memset(&row->highlight[match - row->render], HL_MATCH, strlen(query));
-			break;
-		}
+	if (query[0] != '\0') {
+		editorGrepStart(query);
 	}
-
-}
-
-void editorFind() {
-	int saved_cx = E.cx;
-	int saved_cy = E.cy;
-	int saved_colOffset = E.colOffset;
-	int saved_rowOffset = E.rowOffset;
-
-	char *query = editorPrompt("Search: %s (Use ESC/Arrow/Enter)", editorFindCallback);
-
-	if (query) {
-		free(query);
-	} else {
-		E.cx = saved_cx;
-		E.cy = saved_cy;
-		E.colOffset = saved_colOffset;
-		E.rowOffset = saved_rowOffset;
+	free(query);
+	if (GR.active) {
+		editorGrepResults();
 	}
 }
 
@@ -876,6 +5340,7 @@ struct abuf {
 
 void abAppend(struct abuf *ab, const char *s, int len) {
     char *new = realloc(ab->b, ab->len + len);
+    statsAdd(STAT_ALLOCS, 1);
 
     if (new == NULL) {
         return;
@@ -889,9 +5354,232 @@ void abFree(struct abuf *ab) {
     free(ab->b);
 }
 
+/*** output queue ***/
+
+// At most one frame is on the wire (possibly partially written) and one
+// waits behind it. A newer frame replaces the waiting one, so a congested
+// terminal skips stale frames and always catches up to the latest state.
+struct outputQueue {
+    struct abuf inflight;
+    int written; // bytes of inflight already accepted by the terminal
+    struct abuf next;
+};
+
+#define OQ (*mioCurrent->output)
+
+int editorOutputPending() {
+    return OQ.inflight.len != 0;
+}
+
+// Writes as much queued output as the terminal accepts without blocking
+// Returns -1 and drops the queue on a write error
+int editorFlushOutput() {
+    while (OQ.inflight.len) {
+        traceBegin("write");
+        ssize_t n = write(E.outFd, OQ.inflight.b + OQ.written, OQ.inflight.len - OQ.written);
+        traceEndArg("write", "bytes", n);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EINTR) {
+                return 0;
+            }
+            abFree(&OQ.inflight);
+            abFree(&OQ.next);
+            OQ.inflight = (struct abuf)ABUF_INIT;
+            OQ.next = (struct abuf)ABUF_INIT;
+            OQ.written = 0;
+            return -1;
+        }
+
+        OQ.written += n;
+        if (OQ.written == OQ.inflight.len) {
+            abFree(&OQ.inflight);
+            OQ.inflight = OQ.next;
+            OQ.next = (struct abuf)ABUF_INIT;
+            OQ.written = 0;
+        }
+    }
+    return 0;
+}
+
+// Takes ownership of the frame in ab
+void editorQueueFrame(struct abuf *ab) {
+    if (OQ.written == 0) {
+        // Nothing of the current frame has been sent yet, replace it outright
+        abFree(&OQ.inflight);
+        OQ.inflight = *ab;
+    } else {
+        abFree(&OQ.next);
+        OQ.next = *ab;
+    }
+    *ab = (struct abuf)ABUF_INIT;
+    editorFlushOutput();
+}
+
+// Finishes the frame on the wire so nothing written directly afterwards
+// lands in the middle of an escape sequence; a waiting frame is dropped
+void editorDrainOutput() {
+    abFree(&OQ.next);
+    OQ.next = (struct abuf)ABUF_INIT;
+
+    while (editorOutputPending()) {
+        if (editorFlushOutput() == -1) {
+            break;
+        }
+        if (editorOutputPending()) {
+            fd_set writeFds;
+            FD_ZERO(&writeFds);
+            FD_SET(E.outFd, &writeFds);
+            if (select(E.outFd + 1, NULL, &writeFds, NULL, NULL) == -1 && errno != EINTR) {
+                break;
+            }
+        }
+    }
+}
+
+/*** macros ***/
+
+// Keys read while recording, in the codes editorReadKey() returns
+struct macro {
+	int *keys;
+	int count;
+	int capacity;
+	int recording;
+	int playing;  // keys come from the macro and the screen isn't drawn
+	int position; // next key to replay
+};
+
+#define M (*mioCurrent->macro)
+
+int editorMacroPlaying() {
+	return M.playing;
+}
+
+// Waits for a keypress and returns it
+// While a macro plays its keys are returned instead, running out of
+// them inside a prompt cancels it
+int editorReadKey() {
+	if (M.playing) {
+		return (M.position < M.count) ? M.keys[M.position++] : '\x1b';
+	}
+
+	int previous = statsSwitch(PHASE_NONE);
+	traceBegin("editorReadKey");
+	int c = editorReadTerminalKey();
+	traceEndArg("editorReadKey", "key", c);
+	statsSwitch(previous);
+	statsAdd(STAT_KEYS, 1);
+	if (M.recording && c != FILE_CHANGED) {
+		if (M.count == M.capacity) {
+			M.capacity = M.capacity ? M.capacity * 2 : 64;
+			M.keys = realloc(M.keys, sizeof(int) * M.capacity);
+		}
+		M.keys[M.count++] = c;
+	}
+	return c;
+}
+
+void editorMacroToggle() {
+	if (M.recording) {
+		// Leave out the key that stopped recording
+		M.count--;
+		M.recording = 0;
+		editorSetStatusMessage("Macro recorded, %d keys", M.count);
+	} else {
+		M.count = 0;
+		M.recording = 1;
+		editorSetStatusMessage("Recording macro, ^] to stop");
+	}
+}
+
+// Replays the macro once from the start
+void editorMacroRunOnce() {
+	M.position = 0;
+	while (M.position < M.count) {
+		editorProcessKeypress();
+	}
+}
+
+// Runs the macro a number of times, or once at the start of every line
+// of the region
+// The whole run is drawn once at the end and undone in one step
+void editorMacroRun() {
+	if (M.recording) {
+		M.count--;
+		editorSetStatusMessage("Can't run a macro while recording it");
+		return;
+	}
+	if (M.count == 0) {
+		editorSetStatusMessage("No macro, record one with ^]");
+		return;
+	}
+
+	char *answer = editorPromptEmpty("Run macro how many times (r for each line of the region): %s", NULL);
+	if (answer == NULL) {
+		return;
+	}
+	int times = answer[0] ? atoi(answer) : 1;
+	int lines = (answer[0] == 'r');
+	free(answer);
+
+	int sy, sx, ey, ex;
+	if (lines && !editorRegion(&sy, &sx, &ey, &ex)) {
+		editorSetStatusMessage("No region, set the mark with ^A");
+		return;
+	}
+	if (!lines && times <= 0) {
+		editorSetStatusMessage("Nothing to do");
+		return;
+	}
+
+	// A region ending at the start of a line doesn't take that line in
+	if (lines && ex == 0 && ey > sy) {
+		ey--;
+	}
+
+	E.markSet = 0;
+	M.playing = 1;
+	editorUndoSpanBegin();
+	int ran = 0;
+	if (lines) {
+		// Rows the macro adds or removes move the lines still to go
+		int at = sy;
+		int last = ey;
+		while (at <= last && at < E.numRows) {
+			int before = E.numRows;
+			E.cy = at;
+			E.cx = 0;
+			editorMacroRunOnce();
+			ran++;
+			at += 1 + E.numRows - before;
+			last += E.numRows - before;
+		}
+	} else {
+		for (; ran < times; ran++) {
+			editorMacroRunOnce();
+		}
+	}
+	int recorded = editorUndoSpanEnd();
+	M.playing = 0;
+	editorSetStatusMessage(recorded ? "Macro ran %d %s" : "Macro ran %d %s, too large to undo", ran, (ran == 1) ? "time" : "times");
+}
+
 /*** input  ***/
 
-char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
+// Called about every 100ms while waiting for a key
+// Redraws while a background search has new matches to show
+void editorIdle() {
+	int redraw = statsPoll();
+	redraw |= editorIndexPoll();
+	redraw |= editorGrepPoll();
+	editorWatchPoll();
+	if (redraw) {
+		editorRefreshScreen();
+	}
+}
+
+// Reads a line in the message bar, returns NULL if ESC is pressed
+// callback is passed the input and the key after every keypress
+char *editorPromptInput(char *prompt, void (*callback)(char *, int), int allowEmpty) {
 	size_t bufsize = 128;
 	char *buf = malloc(bufsize);
 
@@ -915,7 +5603,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 			free(buf);
 			return NULL;
 		} else if (c == '\r') {
-			if (buflen != 0) {
+			if (buflen != 0 || allowEmpty) {
 				editorSetStatusMessage("");
 				if (callback) {
 					callback(buf, c);
@@ -937,6 +5625,15 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 	}
 }
 
+char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
+	return editorPromptInput(prompt, callback, 0);
+}
+
+// Like editorPrompt, but Enter also accepts an empty line
+char *editorPromptEmpty(char *prompt, void (*callback)(char *, int)) {
+	return editorPromptInput(prompt, callback, 1);
+}
+
 void editorMoveCursor(int key) {
     // row should point to the editorRow that the cursor is on
     // E.cy can be one past the last line, so row might be NULL
@@ -982,25 +5679,35 @@ void editorMoveCursor(int key) {
     }
 }
 
-// Handles the keypress returned by editorReadKey()
-void editorProcessKeypress() {
-	static int quit_times = QUIT_TIMES;
-
-    int c = editorReadKey();
+void editorHandleKey(int c) {
+    editorUndoBegin();
+    if (editorCursorsActive() && editorCursorsKeypress(c)) {
+    	E.quitTimes = QUIT_TIMES;
+    	E.killPending = 0;
+    	E.killUndo = 0;
+    	return;
+    }
     switch(c) {
     	case '\r':
     		editorInsertNewline();
     		break;
 
         case CTRL_KEY('q'):
-        	if (E.dirty && quit_times > 0) {
-        		editorSetStatusMessage("WARNING!!! File has unsaved changes. " "Press Ctrl-Q %d more times to quit.", quit_times);
-        		quit_times--;
+        	if (editorBuffersDirty() && E.quitTimes > 0) {
+        		editorSetStatusMessage("WARNING!!! File has unsaved changes. " "Press Ctrl-Q %d more times to quit.", E.quitTimes);
+        		E.quitTimes--;
         		return;
         	}
-            write(STDOUT_FILENO, "\x1b[2j", 4);
-            write(STDOUT_FILENO, "\x1b[H", 3);
-            exit(0);
+            editorDrainOutput();
+            write(E.outFd, "\x1b[2j", 4);
+            write(E.outFd, "\x1b[H", 3);
+            if (getenv("MIO_STATS")) {
+                statsDump(statsPath());
+            }
+            if (TR.events) {
+                traceWrite(TR.path);
+            }
+            E.quit = 1;
             break;
 
         case CTRL_KEY('s'):
@@ -1012,8 +5719,26 @@ void editorProcessKeypress() {
 			break;
 
         case CTRL_KEY('k'):
+        	if (E.dirty && !E.killPending) {
+        		editorSetStatusMessage("WARNING!!! Buffer has unsaved changes. Press Ctrl-K again to kill it.");
+        		E.killPending = 1;
+        		return;
+        	}
         	editorKillCurrentBuffer();
-			break;
+        	editorSetStatusMessage("Buffer killed, ^Z brings it back");
+        	E.quitTimes = QUIT_TIMES;
+        	E.killPending = 0;
+        	E.killUndo = 1;
+        	return;
+
+        // Ctrl-^ as in vi's alternate file, ^T is the prompts' regex toggle
+        case CTRL_KEY('^'):
+        	editorNextBuffer();
+        	break;
+
+        case CTRL_KEY('_'):
+        	ST.overlay = !ST.overlay;
+        	break;
 
 	case CTRL_KEY('d'):
 		editorDeleteLine();
@@ -1039,6 +5764,34 @@ void editorProcessKeypress() {
         	editorGoToLine();
         	break;
 
+        case CTRL_KEY('z'):
+        	if (E.killUndo) {
+        		editorRestoreKilled();
+        	} else {
+        		editorUndo();
+        	}
+        	break;
+
+        case CTRL_KEY('y'):
+        	editorRedo();
+        	break;
+
+        case CTRL_KEY('r'):
+        	editorReplace();
+        	break;
+
+        case CTRL_KEY('w'):
+        	editorGrep();
+        	break;
+
+        case CTRL_KEY('n'):
+        	editorFindNext(1);
+        	break;
+
+        case CTRL_KEY('p'):
+        	editorFindNext(-1);
+        	break;
+
         case BACKSPACE:
         case CTRL_KEY('h'):
         case DEL_KEY:
@@ -1076,10 +5829,46 @@ void editorProcessKeypress() {
             editorMoveCursor(c);
             break;
 
-        // Traditionally used to refresh the screen in terminal programs
-        // We don't want to do anything with it
         case CTRL_KEY('l'):
+        	editorFollowToggle();
+        	break;
+
+        // Clears the mark and the highlighted matches of the last search
         case '\x1b':
+        	E.markSet = 0;
+        	editorIndexReset();
+        	break;
+
+        case CTRL_KEY('a'):
+        	editorToggleMark();
+        	break;
+
+        case CTRL_KEY('c'):
+        	editorCopy(0);
+        	break;
+
+        case CTRL_KEY('x'):
+        	editorCopy(1);
+        	break;
+
+        case CTRL_KEY('v'):
+        	editorPaste();
+        	break;
+
+        case CTRL_KEY('u'):
+        	editorCursorsFromRegion();
+        	break;
+
+        case FILE_CHANGED:
+        	editorReloadCheck();
+        	break;
+
+        case CTRL_KEY(']'):
+        	editorMacroToggle();
+        	break;
+
+        case CTRL_KEY('\\'):
+        	editorMacroRun();
         	break;
 
         default:
@@ -1087,7 +5876,24 @@ void editorProcessKeypress() {
         	break;
     }
 
-    quit_times = QUIT_TIMES;
+    E.quitTimes = QUIT_TIMES;
+    E.killPending = 0;
+    E.killUndo = 0;
+}
+
+// Handles the keypress returned by editorReadKey()
+void editorProcessKeypress() {
+    W.waiting = 1;
+    int c = editorReadKey();
+    W.waiting = 0;
+    if (E.inputError) {
+        return;
+    }
+    int previous = statsSwitch(PHASE_EDIT);
+    traceBegin("editorProcessKeypress");
+    editorHandleKey(c);
+    traceEndArg("editorProcessKeypress", "key", c);
+    statsSwitch(previous);
 }
 
 /*** output ***/
@@ -1119,7 +5925,78 @@ void editorScroll() {
     }
 }
 
+// Draws the grep results in place of the buffer, one header line and
+// then "path:line: text" per result
+void editorDrawGrepResults(struct abuf *ab) {
+    pthread_mutex_lock(&GR.lock);
+
+    char header[120];
+    char count[16];
+    editorFormatCount(count, sizeof(count), GR.count);
+    int len = snprintf(header, sizeof(header), "%s %s in %d %s%s", count, (GR.count == 1) ? "match" : "matches", GR.matchedFiles, (GR.matchedFiles == 1) ? "file" : "files", GR.truncated ? ", stopped early" : (GR.running ? ", searching..." : ""));
+    if (len > E.screenCols) {
+        len = E.screenCols;
+    }
+    abAppend(ab, header, len);
+    abAppend(ab, "\x1b[K\r\n", 5);
+
+    // Keep the selection on screen
+    int rows = E.screenRows - 1;
+    if (GR.selected < GR.offset) {
+        GR.offset = GR.selected;
+    }
+    if (GR.selected >= GR.offset + rows) {
+        GR.offset = GR.selected - rows + 1;
+    }
+
+    int y;
+    for (y = 0; y < rows; y++) {
+        int j = GR.offset + y;
+        if (j < GR.count) {
+            struct grepResult *result = &GR.results[j];
+            char location[256];
+            int locationLen = snprintf(location, sizeof(location), "%s:%d:", result->path, result->line + 1);
+            if (locationLen >= (int)sizeof(location)) {
+                locationLen = sizeof(location) - 1;
+            }
+            if (locationLen > E.screenCols) {
+                locationLen = E.screenCols;
+            }
+            int textLen = strlen(result->text);
+            if (textLen > E.screenCols - locationLen - 1) {
+                textLen = E.screenCols - locationLen - 1;
+            }
+
+            if (j == GR.selected) {
+                abAppend(ab, "\x1b[7m", 4);
+            }
+            abAppend(ab, "\x1b[36m", 5);
+            abAppend(ab, location, locationLen);
+            abAppend(ab, "\x1b[39m", 5);
+            if (textLen > 0) {
+                abAppend(ab, " ", 1);
+                abAppend(ab, result->text, textLen);
+            }
+            abAppend(ab, "\x1b[m", 3);
+        } else {
+            abAppend(ab, "~", 1);
+        }
+        abAppend(ab, "\x1b[K\r\n", 5);
+    }
+
+    pthread_mutex_unlock(&GR.lock);
+}
+
 void editorDrawRows(struct abuf *ab) {
+    if (GR.visible) {
+        editorDrawGrepResults(ab);
+        return;
+    }
+
+    // Matches are drawn over a copy of the visible highlight
+    unsigned char *overlay = malloc(E.screenCols + 1);
+    int sy, sx, ey, ex;
+    int region = editorRegion(&sy, &sx, &ey, &ex);
     int y;
     for(y = 0; y < E.screenRows; y++) {
         int fileRow = y + E.rowOffset;
@@ -1153,16 +6030,51 @@ void editorDrawRows(struct abuf *ab) {
                 len = E.screenCols;
             }
 
-            char *c = &E.row[fileRow].render[E.colOffset];
-            unsigned char *highlight = &E.row[fileRow].highlight[E.colOffset];
+            const char *c;
+            const unsigned char *rowHighlight;
+            editorRowView(&E.row[fileRow], E.colOffset, len, &c, &rowHighlight);
+            unsigned char *highlight = overlay;
+            memcpy(highlight, rowHighlight, len);
+            editorIndexHighlight(fileRow, highlight, len);
+
+            // The region and extra cursors are drawn in inverted colors,
+            // in render columns
+            int selStart = 0;
+            int selEnd = 0;
+            if (region && fileRow >= sy && fileRow <= ey) {
+                selStart = (fileRow == sy) ? editorRowCxToRx(&E.row[fileRow], sx) - E.colOffset : 0;
+                selEnd = (fileRow == ey) ? editorRowCxToRx(&E.row[fileRow], ex) - E.colOffset : len;
+            }
+            int cursor = editorCursorsOnRow(fileRow);
+            int cursorRx = -1;
+            int selected = 0;
+
             int current_color = -1;
             int j;
-            for (j = 0; j < len; j++) {
+            for (j = 0; j <= len && j < E.screenCols; j++) {
+            	while (cursorRx < j && cursor < MC.count && MC.cursors[cursor].row == fileRow) {
+            		cursorRx = editorRowCxToRx(&E.row[fileRow], MC.cursors[cursor++].col) - E.colOffset;
+            	}
+            	int inverted = (j >= selStart && j < selEnd) || cursorRx == j;
+            	if (j == len) {
+            		// A cursor past the end of the line
+            		if (inverted) {
+            			abAppend(ab, selected ? " " : "\x1b[7m \x1b[27m", selected ? 1 : 10);
+            		}
+            		break;
+            	}
+            	if (inverted != selected) {
+            		selected = !selected;
+            		abAppend(ab, selected ? "\x1b[7m" : "\x1b[27m", selected ? 4 : 5);
+            	}
             	if (iscntrl(c[j])) {
             		char sym = (c[j] <= 26) ? '@' + c[j] : '?';
             		abAppend(ab, "\x1b[7m", 4);
             		abAppend(ab, &sym, 1);
             		abAppend(ab, "\x1b[m", 3);
+            		if (selected) {
+            			abAppend(ab, "\x1b[7m", 4);
+            		}
             		if (current_color != -1) {
             			char buf[16];
             			int colorLen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
@@ -1185,6 +6097,9 @@ void editorDrawRows(struct abuf *ab) {
             		abAppend(ab, &c[j], 1);
             	}
             }
+            if (selected) {
+            	abAppend(ab, "\x1b[27m", 5);
+            }
             abAppend(ab, "\x1b[39m", 5);
 
             //abAppend(ab, &E.row[fileRow].render[E.colOffset], len);
@@ -1196,6 +6111,7 @@ void editorDrawRows(struct abuf *ab) {
             abAppend(ab, "\r\n", 2);
         //}
     }
+    free(overlay);
 }
 
 void editorDrawStatusBar(struct abuf *ab) {
@@ -1277,12 +6193,46 @@ void editorDrawStatusBar(struct abuf *ab) {
     abAppend(ab, "\x1b[m", 3); // normal
     abAppend(ab, " Prev ", 6);
 
+    abAppend(ab, "\x1b[7m", 4); // invert
+    abAppend(ab, "^R", 2);
+    abAppend(ab, "\x1b[m", 3); // normal
+    abAppend(ab, " Replace ", 9);
+
+    abAppend(ab, "\x1b[7m", 4); // invert
+    abAppend(ab, "^W", 2);
+    abAppend(ab, "\x1b[m", 3); // normal
+    abAppend(ab, " Grep ", 6);
+
+    abAppend(ab, "\x1b[7m", 4); // invert
+    abAppend(ab, "^Z", 2);
+    abAppend(ab, "\x1b[m", 3); // normal
+    abAppend(ab, " Undo ", 6);
+
+    abAppend(ab, "\x1b[7m", 4); // invert
+    abAppend(ab, "^Y", 2);
+    abAppend(ab, "\x1b[m", 3); // normal
+    abAppend(ab, " Redo ", 6);
+
+    abAppend(ab, "\x1b[7m", 4); // invert
+    abAppend(ab, "^^", 2);
+    abAppend(ab, "\x1b[m", 3); // normal
+    abAppend(ab, " NextBuf ", 9);
+
 	abAppend(ab, "\x1b[7m", 4); // invert
 	abAppend(ab, "\r\n", 2); // print a new line for our next status
 
     // Print the file status bar
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s", E.filename ? E.filename : "[No Name]", E.numRows, E.dirty ? "(modified)" : "");
-    int rightLen = snprintf(rightStatus, sizeof(rightStatus), "%s | %d/%d", E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numRows);
+    char bufferNum[32] = "";
+    if (B.count > 1) {
+        snprintf(bufferNum, sizeof(bufferNum), "[%d/%d] ", B.current + 1, B.count);
+    }
+    int len = snprintf(status, sizeof(status), "%s%.20s - %d lines %s%s%s", bufferNum, E.filename ? E.filename : "[No Name]", E.numRows, E.dirty ? "(modified) " : "", M.recording ? "(recording) " : "", E.disk.follow ? "(following)" : "");
+    char matches[48];
+    editorIndexStatus(matches, sizeof(matches));
+    int rightLen = snprintf(rightStatus, sizeof(rightStatus), "%s%s%s%s%s | %d/%d", E.searchStatus, E.searchStatus[0] ? " | " : "", matches, matches[0] ? " | " : "", E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numRows);
+    if (rightLen >= (int)sizeof(rightStatus)) {
+        rightLen = sizeof(rightStatus) - 1;
+    }
 
     if (len > E.screenCols) {
         len = E.screenCols;
@@ -1307,18 +6257,42 @@ void editorDrawStatusBar(struct abuf *ab) {
 
 void editorDrawMessageBar(struct abuf *ab) {
     abAppend(ab, "\x1b[K", 3); // clear the message bar
+    // The stats overlay takes the right end, a message what's left
+    char stats[128];
+    int statsLen = ST.overlay ? statsFormat(stats, sizeof(stats)) : 0;
+    if (statsLen > E.screenCols) {
+        statsLen = E.screenCols;
+    }
     int msglen = strlen(E.statusmsg);
-    if (msglen > E.screenCols) {
-        msglen = E.screenCols;
+    if (msglen > E.screenCols - statsLen) {
+        msglen = E.screenCols - statsLen;
     }
 
-    if (msglen && time(NULL) - E.statusmsg_time < 5) {
+    if (time(NULL) - E.statusmsg_time >= 5) {
+        msglen = 0;
+    }
+    if (msglen) {
         abAppend(ab, E.statusmsg, msglen);
     }
+    if (statsLen) {
+        int j;
+        for (j = msglen; j < E.screenCols - statsLen; j++) {
+            abAppend(ab, " ", 1);
+        }
+        abAppend(ab, "\x1b[7m", 4);
+        abAppend(ab, stats, statsLen);
+        abAppend(ab, "\x1b[m", 3);
+    }
 }
 
 // Clears the screen
 void editorRefreshScreen() {
+    // A macro run is drawn once it's done
+    if (M.playing || E.headless) {
+        return;
+    }
+    statsEndCycle();
+    int previous = statsSwitch(PHASE_DRAW);
     editorScroll();
 
     // Use abuf to prevent calling write() several times
@@ -1337,7 +6311,9 @@ void editorRefreshScreen() {
     abAppend(&ab, "\x1b[H", 3);
     // H means Cursor Position
 
+    traceBegin("editorDrawRows");
     editorDrawRows(&ab);
+    traceEnd("editorDrawRows");
     editorDrawStatusBar(&ab);
     editorDrawMessageBar(&ab);
 
@@ -1348,9 +6324,12 @@ void editorRefreshScreen() {
     abAppend(&ab, "\x1b[?25h", 6);
     // h means Set Mode
 
-    write(STDOUT_FILENO, ab.b, ab.len);
-
-    abFree(&ab);
+    // Hand the frame to the output queue rather than blocking on write()
+    statsAdd(STAT_FRAMES, 1);
+    statsAdd(STAT_FRAME_BYTES, ab.len);
+    statsSwitch(PHASE_WRITE);
+    editorQueueFrame(&ab);
+    statsSwitch(previous);
 }
 
 // variadic function
@@ -1362,9 +6341,313 @@ void editorSetStatusMessage(const char *fmt, ...) {
     E.statusmsg_time = time(NULL);
 }
 
-/*** main  ***/
+/*** batch ***/
+
+// mio -b script [file...] runs a script of edits over every file with
+// no terminal, then saves the ones that changed; main.c reads the script
+// and the file names and spreads the files over processes, each one runs
+// the script with a headless editor of its own through mioScriptRun()
+// Script lines:
+//   s/find/with/[r]  replace every match, r makes find a regex
+//   d/find/[r]       delete every line with a match
+//   N[,M]d           delete lines N to M, $ is the last line
+//   Ni text          insert a line before line N
+//   a text           append a line
+// Blank lines and lines starting with # are skipped, any character can
+// stand in for / and a \ before it takes it literally
+
+enum batchType {
+	BATCH_REPLACE,
+	BATCH_DELETE_MATCHING,
+	BATCH_DELETE_LINES,
+	BATCH_INSERT,
+	BATCH_APPEND
+};
+
+struct batchCommand {
+	int type;
+	struct searchQuery query;
+	char *text;
+	int from; // lines, 1 based, -1 for the last one
+	int to;
+};
+
+struct mioScript {
+	struct batchCommand *commands;
+	int count;
+};
+
+// Reads up to the next unescaped delim, leaves *p after it
+// Returns NULL if there's no delim
+char *batchField(char **p, char delim) {
+	char *out = malloc(strlen(*p) + 1);
+	int len = 0;
+	char *s = *p;
+	while (*s && *s != delim) {
+		if (*s == '\\' && s[1] == delim) {
+			s++;
+		}
+		out[len++] = *s++;
+	}
+	if (*s != delim) {
+		free(out);
+		return NULL;
+	}
+	out[len] = '\0';
+	*p = s + 1;
+	return out;
+}
+
+// Reads a line number, $ for the last line
+int batchLineNumber(char **p) {
+	if (**p == '$') {
+		(*p)++;
+		return -1;
+	}
+	return strtol(*p, p, 10);
+}
+
+// Parses one script line into command, returns an error or NULL
+const char *batchParse(char *line, struct batchCommand *command) {
+	memset(command, 0, sizeof(struct batchCommand));
+	char *p = line;
+	const char *error = NULL;
+
+	if ((p[0] == 's' || p[0] == 'd') && p[1] && !isalnum((unsigned char)p[1])) {
+		char delim = p[1];
+		int replace = (p[0] == 's');
+		p += 2;
+		char *find = batchField(&p, delim);
+		if (find == NULL) {
+			return "unterminated pattern";
+		}
+		if (replace && (command->text = batchField(&p, delim)) == NULL) {
+			free(find);
+			return "unterminated replacement";
+		}
+		int regex = (*p == 'r');
+		p += regex;
+		if (*p) {
+			error = "unexpected text after the pattern";
+		} else if (find[0] == '\0') {
+			error = "empty pattern";
+		} else {
+			// Sets error if the regex doesn't compile
+			editorQueryCompile(&command->query, find, regex, &error);
+		}
+		free(find);
+		command->type = replace ? BATCH_REPLACE : BATCH_DELETE_MATCHING;
+		return error;
+	}
+
+	if (p[0] == 'a' && (p[1] == ' ' || p[1] == '\0')) {
+		command->type = BATCH_APPEND;
+		command->text = strdup(p[1] ? p + 2 : "");
+		return NULL;
+	}
+
+	if (!isdigit((unsigned char)p[0]) && p[0] != '$') {
+		return "unknown command";
+	}
+	command->from = batchLineNumber(&p);
+	command->to = command->from;
+	if (*p == ',') {
+		p++;
+		command->to = batchLineNumber(&p);
+	}
+	if (command->from == 0 || command->to == 0) {
+		return "lines are numbered from 1";
+	}
+	if (p[0] == 'd' && p[1] == '\0') {
+		command->type = BATCH_DELETE_LINES;
+		return NULL;
+	}
+	if (p[0] == 'i' && (p[1] == ' ' || p[1] == '\0') && command->from == command->to) {
+		command->type = BATCH_INSERT;
+		command->text = strdup(p[1] ? p + 2 : "");
+		return NULL;
+	}
+	return "unknown command";
+}
+
+void batchCommandFree(struct batchCommand *command) {
+	editorQueryFree(&command->query);
+	free(command->text);
+}
+
+void batchScriptFree(struct mioScript *script) {
+	int j;
+	for (j = 0; j < script->count; j++) {
+		batchCommandFree(&script->commands[j]);
+	}
+	free(script->commands);
+	free(script);
+}
+
+// Parses the whole script
+// Returns NULL and puts the first bad line's error in error
+struct mioScript *batchParseScript(const char *text, char *error, int errorLen) {
+	struct mioScript *script = calloc(1, sizeof(struct mioScript));
+	char *copy = strdup(text);
+	char *line = copy;
+	int lineNumber = 0;
+	int capacity = 0;
+	while (*line) {
+		lineNumber++;
+		char *next = strchr(line, '\n');
+		next = next ? next + 1 : line + strlen(line);
+		int lineLen = next - line;
+		while (lineLen > 0 && (line[lineLen - 1] == '\n' || line[lineLen - 1] == '\r')) {
+			lineLen--;
+		}
+		line[lineLen] = '\0';
+		if (lineLen == 0 || line[0] == '#') {
+			line = next;
+			continue;
+		}
+
+		if (script->count == capacity) {
+			capacity = capacity ? capacity * 2 : 16;
+			script->commands = realloc(script->commands, sizeof(struct batchCommand) * capacity);
+		}
+		struct batchCommand *command = &script->commands[script->count];
+		const char *parseError = batchParse(line, command);
+		if (parseError) {
+			snprintf(error, errorLen, "script line %d: %s", lineNumber, parseError);
+			batchCommandFree(command);
+			batchScriptFree(script);
+			free(copy);
+			return NULL;
+		}
+		script->count++;
+		line = next;
+	}
+	free(copy);
+	return script;
+}
+
+// Turns a 1 based line number into a row, -1 meaning the last one
+int batchRow(int line) {
+	return (line == -1) ? E.numRows - 1 : line - 1;
+}
+
+// Deletes every row with a match in one pass over the row array
+// Nothing's being undone or indexed headless, so the rows are dropped
+// directly instead of one editorDeleteRows() move per run of them
+int batchDeleteMatching(const struct searchQuery *query) {
+	struct regexCache cache;
+	if (query->re) {
+		regexCacheInit(&cache, query->re);
+	}
+	int kept = 0;
+	int j;
+	for (j = 0; j < E.numRows; j++) {
+		int len;
+		if (editorRowSearch(&E.row[j], query, &cache, 0, &len) != -1) {
+			editorFreeRow(&E.row[j]);
+			continue;
+		}
+		E.row[kept] = E.row[j];
+		E.rowCold[kept] = E.rowCold[j];
+		E.row[kept].index = kept;
+		kept++;
+	}
+	if (query->re) {
+		regexCacheFree(&cache);
+	}
+
+	int deleted = E.numRows - kept;
+	E.numRows = kept;
+	E.dirty += deleted;
+	return deleted;
+}
+
+// Runs the script on the current buffer, returns the number of changes
+int batchRun(struct mioScript *script) {
+	int changes = 0;
+	int j;
+	for (j = 0; j < script->count; j++) {
+		struct batchCommand *command = &script->commands[j];
+		switch (command->type) {
+			case BATCH_REPLACE:
+				changes += editorReplaceAll(&command->query, command->text, 0, 0);
+				break;
+
+			case BATCH_DELETE_MATCHING:
+				changes += batchDeleteMatching(&command->query);
+				break;
+
+			case BATCH_DELETE_LINES:
+				{
+					int from = batchRow(command->from);
+					int to = batchRow(command->to);
+					if (from >= 0 && from < E.numRows && to >= from) {
+						int count = (to < E.numRows) ? to - from + 1 : E.numRows - from;
+						editorDeleteRows(from, count);
+						changes += count;
+					}
+				}
+				break;
+
+			case BATCH_INSERT:
+				{
+					// Line numbers past the end append
+					int at = batchRow(command->from);
+					if (at < 0 || at > E.numRows) {
+						at = E.numRows;
+					}
+					editorInsertRow(at, command->text, strlen(command->text));
+					changes++;
+				}
+				break;
+
+			case BATCH_APPEND:
+				editorInsertRow(E.numRows, command->text, strlen(command->text));
+				changes++;
+				break;
+		}
+	}
+	return changes;
+}
+
+// Opens, edits and saves one file in a headless editor
+// Returns the number of changes, or -1 with the reason in error
+int batchFile(const char *path, struct mioScript *script, char *error, int errorLen) {
+	if (!E.headless) {
+		snprintf(error, errorLen, "scripts only run in a headless editor");
+		return -1;
+	}
+	FILE *fp = (access(path, W_OK) == -1) ? NULL : fopen(path, "r");
+	if (fp == NULL) {
+		snprintf(error, errorLen, "%s", strerror(errno));
+		return -1;
+	}
+
+	char *name = strdup(path);
+	editorOpen(name, fp);
+	free(name);
+	int changes = batchRun(script);
+	if (E.dirty) {
+		editorSave();
+		if (E.dirty) {
+			snprintf(error, errorLen, "%s", E.statusmsg);
+			changes = -1;
+		}
+	}
+
+	// The row array is kept for the next file
+	int j;
+	for (j = 0; j < E.numRows; j++) {
+		editorFreeRow(&E.row[j]);
+	}
+	E.numRows = 0;
+	E.dirty = 0;
+	return changes;
+}
+
+/*** library ***/
 
-void initEditor() {
+void initEditor(int rows, int cols) {
     // Init cursor at top left
     E.cx = 0;
     E.cy = 0;
@@ -1373,35 +6656,276 @@ void initEditor() {
     E.colOffset = 0;
     E.numRows = 0;
     E.row = NULL;
+    E.rowCold = NULL;
+    E.rowCapacity = 0;
     E.dirty = 0;
     E.filename = NULL;
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
     E.syntax = NULL;
-
-    if (getWindowSize(&E.screenRows, &E.screenCols) == -1) {
-        die("getWindowSize");
+    E.markSet = 0;
+    E.disk.watch = -1;
+    E.searchRegex = 0;
+    E.searchStatus[0] = '\0';
+    E.findLast = (struct searchMatch){ -1, -1, 0 };
+    E.findDirection = 1;
+    E.quitTimes = QUIT_TIMES;
+    E.killPending = 0;
+    E.killUndo = 0;
+    E.inputError = 0;
+    E.quit = 0;
+    E.view = NULL;
+    E.viewHighlight = NULL;
+    E.viewCapacity = 0;
+    ST.phase = PHASE_NONE;
+    ST.dumps = statsDumpRequests;
+    pthread_mutex_init(&GR.lock, NULL);
+    pthread_cond_init(&GR.filesReady, NULL);
+
+    if (E.headless) {
+        E.screenRows = 0;
+        E.screenCols = 0;
+        return;
     }
 
     // Create space for status bar
-    E.screenRows -= 4;
+    E.screenRows = rows - 4;
+    E.screenCols = cols;
 }
 
-int main(int argc, char *argv[]) {
-	enableRawMode();
-    initEditor(); // might make sense to put enableRawMode() in here
-    if (argc >= 2) {
-        editorOpen(argv[1]);
-    }
+// The calling thread works on the new editor until another is used
+struct mio *mioNew(int inFd, int outFd, int rows, int cols) {
+	struct mio *ed = calloc(1, sizeof(struct mio));
+	if (ed == NULL) {
+		return NULL;
+	}
+	ed->spare = calloc(1, sizeof(struct sparePool));
+	ed->undo = malloc(sizeof(struct undoLog));
+	*ed->undo = (struct undoLog){ NULL, 0, 0, 0, 0, 0, 0, -1, 0 };
+	ed->cursors = calloc(1, sizeof(struct cursorList));
+	ed->watch = malloc(sizeof(struct fileWatch));
+	*ed->watch = (struct fileWatch){ -1, 0, 0 };
+	ed->buffers = calloc(1, sizeof(struct bufferList));
+	ed->buffers->count = 1;
+	ed->index = calloc(1, sizeof(struct searchIndex));
+	ed->grep = calloc(1, sizeof(struct grepSearch));
+	ed->output = calloc(1, sizeof(struct outputQueue));
+	ed->macro = calloc(1, sizeof(struct macro));
+	ed->span = calloc(1, sizeof(struct undoSpan));
+	ed->stats = calloc(1, sizeof(struct editorStats));
+	pthread_once(&traceStarted, traceStart);
+
+	mioCurrent = ed;
+	E.inFd = inFd;
+	E.outFd = outFd;
+	E.headless = (outFd == -1);
+	initEditor(rows, cols);
+	return ed;
+}
+
+void mioFree(struct mio *ed) {
+	mioCurrent = ed;
+	editorGrepReset();
+	int j;
+	for (j = B.count; j > 0; j--) {
+		editorKillCurrentBuffer();
+	}
+	editorDropKilled();
+	free(B.buffers);
+	editorIndexReset();
+	for (j = 0; j < SP.count; j++) {
+		free(SP.blocks[j].ptr);
+		free(SP.blocks[j].pair);
+	}
+	clipRelease(CB);
+	free(MC.cursors);
+	if (W.fd != -1) {
+		close(W.fd);
+	}
+	abFree(&OQ.inflight);
+	abFree(&OQ.next);
+	free(M.keys);
+	free(E.view);
+	free(E.viewHighlight);
+	pthread_mutex_destroy(&GR.lock);
+	pthread_cond_destroy(&GR.filesReady);
+
+	free(ed->spare);
+	free(ed->undo);
+	free(ed->cursors);
+	free(ed->watch);
+	free(ed->buffers);
+	free(ed->index);
+	free(ed->grep);
+	free(ed->output);
+	free(ed->macro);
+	free(ed->span->above.buf);
+	free(ed->span->below.buf);
+	free(ed->span);
+	free(ed->stats);
+	free(ed);
+	mioCurrent = NULL;
+}
 
-    // Init status message with key bindings
-    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+int mioProcessKey(struct mio *ed) {
+	mioCurrent = ed;
+	editorProcessKeypress();
+	if (E.inputError) {
+		errno = E.inputError;
+		return -1;
+	}
+	return !E.quit;
+}
 
-	// Main loop, quits on ctrl+q
-	while (1) {
-	    editorRefreshScreen();
-	    editorProcessKeypress();
+void mioRefresh(struct mio *ed) {
+	mioCurrent = ed;
+	editorRefreshScreen();
+}
+
+int mioFlush(struct mio *ed) {
+	mioCurrent = ed;
+	editorFlushOutput();
+	return editorOutputPending();
+}
+
+void mioSetStatus(struct mio *ed, const char *msg) {
+	mioCurrent = ed;
+	editorSetStatusMessage("%s", msg);
+}
+
+int mioOpen(struct mio *ed, const char *filename) {
+	mioCurrent = ed;
+	return editorOpenBuffer(filename);
+}
+
+void mioFollow(struct mio *ed) {
+	mioCurrent = ed;
+	if (!E.disk.follow) {
+		editorFollowToggle();
+	}
+}
+
+void mioShowBuffer(struct mio *ed, int buffer) {
+	mioCurrent = ed;
+	editorSwitchBuffer(buffer);
+}
+
+void mioSave(struct mio *ed) {
+	mioCurrent = ed;
+	editorSave();
+}
+
+int mioNumLines(struct mio *ed) {
+	mioCurrent = ed;
+	return E.numRows;
+}
+
+const char *mioLine(struct mio *ed, int line, int *len) {
+	mioCurrent = ed;
+	if (line < 0 || line >= E.numRows) {
+		return NULL;
 	}
+	*len = E.row[line].size;
+	return E.row[line].chars;
+}
 
-    return 0;
+const unsigned char *mioHighlight(struct mio *ed, int line, int *len) {
+	mioCurrent = ed;
+	if (line < 0 || line >= E.numRows || (E.rowCold[line].highlight == NULL && E.rowCold[line].chunks == NULL)) {
+		return NULL;
+	}
+	const char *render;
+	const unsigned char *hl;
+	editorRowView(&E.row[line], 0, E.row[line].renderSize, &render, &hl);
+	*len = E.row[line].renderSize;
+	return hl;
+}
+
+char *mioContents(struct mio *ed, int *len) {
+	mioCurrent = ed;
+	return editorRowsToString(len);
+}
+
+void mioInsert(struct mio *ed, int line, int col, const char *text, int len) {
+	mioCurrent = ed;
+	if (line < 0 || line > E.numRows) {
+		return;
+	}
+	E.cy = line;
+	E.cx = 0;
+	if (line < E.numRows && col > 0) {
+		E.cx = (col < E.row[line].size) ? col : E.row[line].size;
+	}
+	editorUndoBegin();
+	int j;
+	for (j = 0; j < len; j++) {
+		if (text[j] == '\n') {
+			editorInsertNewline();
+		} else {
+			editorInsertChar(text[j]);
+		}
+	}
+}
+
+int mioFind(struct mio *ed, const char *query, int regex, struct mioMatch *match) {
+	mioCurrent = ed;
+	struct searchQuery pattern;
+	const char *error;
+	if (editorQueryCompile(&pattern, query, regex, &error) == -1) {
+		return -1;
+	}
+	struct regexCache cache;
+	if (pattern.re) {
+		regexCacheInit(&cache, pattern.re);
+	}
+
+	struct searchMatch pos = { match->line, match->col, 0 };
+	int found = editorSearchNext(&pattern, &cache, &pos, 1);
+	if (found) {
+		match->line = pos.row;
+		match->col = pos.col;
+		match->len = pos.len;
+	}
+
+	if (pattern.re) {
+		regexCacheFree(&cache);
+	}
+	editorQueryFree(&pattern);
+	return found;
+}
+
+int mioSyntaxCount() {
+	return HLDB_ENTRIES;
+}
+
+const struct editorSyntax *mioSyntax(int j) {
+	return (j >= 0 && j < (int)HLDB_ENTRIES) ? &HLDB[j] : NULL;
+}
+
+struct mioScript *mioScriptParse(const char *text, char *error, int errorLen) {
+	return batchParseScript(text, error, errorLen);
+}
+
+void mioScriptFree(struct mioScript *script) {
+	if (script) {
+		batchScriptFree(script);
+	}
+}
+
+int mioScriptRun(struct mio *ed, struct mioScript *script, const char *path, char *error, int errorLen) {
+	mioCurrent = ed;
+	return batchFile(path, script, error, errorLen);
+}
+
+int mioStatsDump(struct mio *ed, const char *path) {
+	mioCurrent = ed;
+	return statsDump(path);
+}
+
+void mioStatsRequestDump() {
+	statsDumpRequests++;
+}
+
+int mioTraceWrite(const char *path) {
+	return traceWrite(path);
 }
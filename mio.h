@@ -0,0 +1,114 @@
+#ifndef MIO_H
+#define MIO_H
+
+#include "data.h"
+
+// libmio: the editor without a terminal of its own
+// Every struct mio is an independent editor with its own buffers, undo
+// log, search and screen, so several can run in one process, each on its
+// own thread. An editor must only be used by one thread at a time; the
+// worker threads that search for it are shared by all of them.
+
+struct mio;
+
+// What each rendered char of a line is highlighted as
+enum editorHighlight {
+	HL_NORMAL = 0,
+	HL_COMMENT,
+	HL_MLCOMMENT,
+	HL_KEYWORD1,
+	HL_KEYWORD2,
+	HL_STRING,
+	HL_NUMBER,
+	HL_MATCH
+};
+
+// A match, col is an index into the line's chars
+struct mioMatch {
+	int line;
+	int col;
+	int len;
+};
+
+// Keys are read from inFd and frames written to outFd, which should be
+// non-blocking; rows and cols are the terminal's size
+// An outFd of -1 makes a headless editor that draws and highlights nothing
+struct mio *mioNew(int inFd, int outFd, int rows, int cols);
+void mioFree(struct mio *ed);
+
+/*** terminal ***/
+
+// Reads one key from inFd and handles it
+// Returns 0 once the user has quit, or -1 with errno set once inFd can't
+// be read; a prompt open then is cancelled
+int mioProcessKey(struct mio *ed);
+// Draws the screen into the output queue and writes what outFd takes
+void mioRefresh(struct mio *ed);
+// Writes more of the output queue, returns 1 while some is left
+int mioFlush(struct mio *ed);
+void mioSetStatus(struct mio *ed, const char *msg);
+
+/*** buffers ***/
+
+// Opens filename in a buffer of its own and shows it
+// Returns 0 if it can't be read
+int mioOpen(struct mio *ed, const char *filename);
+// Reads what's appended to the shown buffer's file as it grows
+void mioFollow(struct mio *ed);
+// Buffers are numbered in the order they were opened, from 0
+void mioShowBuffer(struct mio *ed, int buffer);
+void mioSave(struct mio *ed);
+int mioNumLines(struct mio *ed);
+// Returns line's chars, not NUL terminated, or NULL past the end
+const char *mioLine(struct mio *ed, int line, int *len);
+// Returns the whole buffer, lines ending in newlines, for the caller to free
+char *mioContents(struct mio *ed, int *len);
+// Inserts text at line, col as if it was typed, \n splits the line
+void mioInsert(struct mio *ed, int line, int col, const char *text, int len);
+
+/*** search ***/
+
+// Moves match to the next match of query after it, wrapping around the
+// buffer; a match with line -1 searches from the top
+// Returns 1 if there's a match, 0 if not and -1 if a regex is invalid
+int mioFind(struct mio *ed, const char *query, int regex, struct mioMatch *match);
+
+/*** highlighting ***/
+
+// Returns one enum editorHighlight per rendered char (tabs expanded) of
+// line, or NULL past the end or when nothing is highlighted
+const unsigned char *mioHighlight(struct mio *ed, int line, int *len);
+// The languages highlighted, by the files they're picked for
+int mioSyntaxCount();
+const struct editorSyntax *mioSyntax(int j);
+
+/*** stats ***/
+
+// Appends the editor's counters and phase timings to path
+// Returns -1 if it can't be written
+int mioStatsDump(struct mio *ed, const char *path);
+// Has every editor append its stats to $MIO_STATS, or the STATS_FILE
+// set in config.h, at its next idle moment; safe in a signal handler
+void mioStatsRequestDump();
+
+/*** trace ***/
+
+// Writes the events traced since MIO_TRACE was set to path as Chrome
+// trace JSON; returns -1 if it can't be written or tracing is off
+int mioTraceWrite(const char *path);
+
+/*** batch ***/
+
+// A parsed script of edits, as mio -b runs
+struct mioScript;
+
+// Returns NULL, with the first bad line in error, if text doesn't parse
+struct mioScript *mioScriptParse(const char *text, char *error, int errorLen);
+void mioScriptFree(struct mioScript *script);
+// Opens path in ed, which must be headless, runs script over it and saves
+// it if anything changed; the file's rows are dropped afterwards, so ed
+// can go on to the next file
+// Returns the number of changes, or -1 with the reason in error
+int mioScriptRun(struct mio *ed, struct mioScript *script, const char *path, char *error, int errorLen);
+
+#endif
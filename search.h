@@ -0,0 +1,42 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+#include <string.h> // memmem(), needs _GNU_SOURCE
+
+// A match in the buffer, col is an index into the row's chars
+struct searchMatch {
+	int row;
+	int col;
+	int len;
+};
+
+// A needle prepared for searchFind()
+// The search itself is libc's memmem(), which is already Two-Way with
+// vectorized filtering, so there's nothing to precompute yet; the
+// pattern is still compiled once per query so callers don't change if
+// that stops being true
+struct searchPattern {
+	const char *needle;
+	size_t len;
+};
+
+static void searchCompile(struct searchPattern *p, const char *needle, size_t len) {
+	p->needle = needle;
+	p->len = len;
+}
+
+// Returns the offset of the first occurrence of the pattern in hay, or -1
+static long searchFind(const struct searchPattern *p, const char *hay, size_t len) {
+	const char *match = memmem(hay, len, p->needle, p->len);
+	return match ? match - hay : -1;
+}
+
+// Returns the offset of the first occurrence of needle in hay, or -1
+static inline long searchMemory(const char *hay, size_t len, const char *needle, size_t needleLen) {
+	struct searchPattern p;
+	searchCompile(&p, needle, needleLen);
+	return searchFind(&p, hay, len);
+}
+
+#endif